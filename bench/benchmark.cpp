@@ -0,0 +1,596 @@
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iostream>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <random>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "blockserver.hpp"
+#include "blockclient.hpp"
+#include "blocklistener.hpp"
+#include "memorybus.hpp"
+#include "uringsocket.hpp"
+#include "metrics.hpp"
+#include "logger.hpp"
+
+// Time allowed for the clients to open their sockets before the server
+// starts, in milliseconds
+#define SETTLE_TIME 200
+
+// Default limit on the length of one run, in seconds
+#define RUN_TIMEOUT 120
+
+// Longest the thread stepping the clients on the bus waits between steps,
+// in virtual milliseconds
+#define STEP_IDLE_TIMEOUT 1000
+
+/**
+ * Runs a server and a number of clients in one process over loopback
+ * multicast, and reports how long it takes every client to receive a file.
+ * Throughput is measured to the moment the last client has every block;
+ * the session itself runs on for a few goodbye rounds after that.
+ * Each combination of file size and client count is run in its own child
+ * process, so that CPU time and peak RSS cover that run alone, and is
+ * reported as one line of JSON.  On the in-memory bus, times are virtual:
+ * waiting for timers costs nothing, so large fleets can be simulated.
+ */
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+    Options() :
+        sizes(1, 16 << 20),
+        clients(1, 1),
+        repeat(1),
+        rate(0),
+        stripes(1),
+        receive_threads(1),
+        peer_repair(false),
+        catchup(true),
+        timeout(RUN_TIMEOUT),
+        group("228.5.6.9"),
+        port(9400),
+        directory("/tmp"),
+        verbose(false),
+        memory(false),
+        latency(0),
+        uring(false),
+        receive_offload(false)
+    {
+    }
+
+    std::vector<uint64_t> sizes;
+    std::vector<uint64_t> clients;
+    unsigned int repeat;
+    unsigned long rate;
+    unsigned int stripes;
+    unsigned int receive_threads;
+    bool peer_repair;
+    bool catchup;
+    unsigned long timeout;
+    std::string group;
+    unsigned short port;
+    std::string directory;
+    std::string output;
+    bool verbose;
+    Msync::ImpairmentProfile impairment;
+    bool memory;
+    unsigned long latency;
+    bool uring;
+    bool receive_offload;
+};
+
+/**
+ * Moves each client's copy of the file to its own destination, so that
+ * every copy can be checked, and records when the client finishes it.
+ * Clients may report the same file more than once, so only the first
+ * report counts.
+ */
+class CompletionListener : public Msync::BlockListener {
+public:
+    CompletionListener(Msync::TransportFactory& transport, const std::string& destination) :
+        transport(transport), destination(destination), finished(false) {}
+
+    virtual void file_started(const Msync::FileInfo& info, std::string& path, const std::string& temp)
+    {
+        path = destination;
+    }
+    virtual void block_received(const Msync::Message& message) {}
+
+    virtual void file_finished(const Msync::FileInfo& info)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!finished) {
+            finished = true;
+            time = transport.now();
+        }
+    }
+
+    bool get_time(Clock::time_point& time)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        time = this->time;
+        return finished;
+    }
+
+    const std::string& get_destination() const
+    {
+        return destination;
+    }
+
+private:
+    Msync::TransportFactory& transport;
+    std::string destination;
+    std::mutex mutex;
+    bool finished;
+    Clock::time_point time;
+};
+
+/**
+ * Parses a size with an optional K, M or G suffix.
+ */
+static uint64_t parse_size(const std::string& text)
+{
+    char* end;
+    uint64_t size = strtoull(text.c_str(), &end, 10);
+    switch (*end) {
+        case 'k': case 'K': size <<= 10; end++; break;
+        case 'm': case 'M': size <<= 20; end++; break;
+        case 'g': case 'G': size <<= 30; end++; break;
+    }
+    if (end == text.c_str() || *end != '\0') {
+        throw std::string("Invalid size: ") + text;
+    }
+    return size;
+}
+
+/**
+ * Parses a comma-separated list of sizes.
+ */
+static std::vector<uint64_t> parse_list(const std::string& text)
+{
+    std::vector<uint64_t> values;
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        values.push_back(parse_size(item));
+    }
+    if (values.empty()) {
+        throw std::string("Empty list");
+    }
+    return values;
+}
+
+/**
+ * Writes a file of random data.  Random data has no zero extents, so
+ * every block goes over the network.
+ */
+static void make_source(const std::string& path, uint64_t size)
+{
+    std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+    std::minstd_rand random(size);
+    std::vector<uint32_t> chunk(16384);
+    while (size > 0 && out) {
+        for (size_t i = 0; i < chunk.size(); i++) {
+            chunk[i] = random() | 1;
+        }
+        size_t bytes = (size_t)std::min<uint64_t>(size, chunk.size() * sizeof(uint32_t));
+        out.write((const char*)&chunk.front(), bytes);
+        size -= bytes;
+    }
+    if (!out) {
+        throw std::string("Could not write ") + path + ": " + strerror(errno);
+    }
+}
+
+/**
+ * Steps every client on the bus from one thread until told to stop, so that
+ * a run on the virtual clock doesn't depend on how threads are scheduled.
+ */
+static void step_clients(Msync::MemoryBus& bus, const std::vector<Msync::BlockClient*>& clients,
+    const std::atomic<bool>& running, Msync::Logger& logger)
+{
+    Msync::TransportThread attached(bus);
+    std::vector<bool> failed(clients.size(), false);
+    for (size_t k = 0; k < clients.size(); k++) {
+        if (clients[k]->open() != Msync::ERROR_NONE) {
+            MSYNC_LOG(logger, ERR) << "Client failed: " << clients[k]->get_error() << "\n";
+            failed[k] = true;
+        }
+    }
+    uint64_t seen = 0;
+    while (running) {
+        long timeout = STEP_IDLE_TIMEOUT;
+        for (size_t k = 0; k < clients.size(); k++) {
+            if (failed[k]) {
+                continue;
+            }
+            if (clients[k]->step() != Msync::ERROR_NONE) {
+                MSYNC_LOG(logger, ERR) << "Client failed: " << clients[k]->get_error() << "\n";
+                failed[k] = true;
+                continue;
+            }
+            timeout = std::min(timeout, clients[k]->get_timeout());
+        }
+        bus.wait_for_delivery(seen, bus.now() + std::chrono::milliseconds(timeout));
+    }
+}
+
+static double seconds(Clock::duration duration)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(duration).count() / 1e6;
+}
+
+static double cpu_seconds(const struct rusage& usage)
+{
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+        usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+/**
+ * Runs one transfer and writes its results to the given stream.  Returns
+ * true if every client received an intact copy of the file.
+ */
+static bool run(const Options& options, const std::string& source, uint64_t size,
+    unsigned int clients, unsigned int run_index, std::ostream& results)
+{
+    std::stringstream name;
+    name << options.directory << "/msync-bench-" << getpid() << ".out";
+    std::string path = name.str();
+
+    Msync::BlockSocket::set_default_impairment(options.impairment);
+    Msync::Logger logger(std::cerr);
+    logger.set_level(options.verbose ? Msync::Logger::INFO : Msync::Logger::WARNING);
+
+    // The bus must outlive the clients and server
+    std::tr1::shared_ptr<Msync::MemoryBus> bus;
+    Msync::TransportFactory* transport = &Msync::BlockSocketFactory::Default;
+    if (options.memory) {
+        bus.reset(new Msync::MemoryBus(options.latency));
+        transport = bus.get();
+    }
+
+    // Only the clients receive through a ring; the server mostly sends.
+    // The clients all bind the same ports, so each gets its own seed to
+    // keep their losses independent.
+    std::vector<Msync::BlockClient*> client_list;
+    std::vector<std::tr1::shared_ptr<Msync::BlockSocketFactory> > factories;
+    std::vector<std::tr1::shared_ptr<CompletionListener> > listeners;
+    std::vector<std::thread> threads;
+    for (unsigned int k = 0; k < clients; k++) {
+        Msync::TransportFactory* client_transport = transport;
+        if (!options.memory) {
+            factories.push_back(std::tr1::shared_ptr<Msync::BlockSocketFactory>(options.uring ?
+                new Msync::UringSocketFactory() : new Msync::BlockSocketFactory()));
+            Msync::ImpairmentProfile impairment = options.impairment;
+            impairment.seed += k + 1;
+            factories.back()->set_impairment(impairment);
+            client_transport = factories.back().get();
+        }
+        Msync::BlockClient* client = new Msync::BlockClient(options.group, options.port, logger);
+        std::stringstream destination;
+        destination << path << "." << k;
+        listeners.push_back(std::tr1::shared_ptr<CompletionListener>(new CompletionListener(*client_transport, destination.str())));
+        client->set_transport(*client_transport);
+        client->set_stripes(options.stripes);
+        client->set_receive_threads(options.receive_threads);
+        client->set_rate(options.rate);
+        client->set_peer_repair(options.peer_repair);
+        client->set_receive_offload(options.receive_offload);
+        
+        // A server with no clients only waits briefly after its first pass,
+        // so don't hold back the hello
+        client->set_jitter(0);
+        client->set_listener(listeners[k].get());
+        client_list.push_back(client);
+        if (!options.memory) {
+            threads.push_back(std::thread([client, &logger] {
+                try {
+                    client->start();
+                } catch (std::string& message) {
+                    MSYNC_LOG(logger, ERR) << "Client failed: " << message << "\n";
+                }
+            }));
+        }
+    }
+    
+    // The virtual clock stands still while this thread is attached, so the
+    // server starts at the same virtual time on every run
+    std::atomic<bool> stepping(true);
+    transport->attach_thread();
+    if (options.memory) {
+        threads.push_back(std::thread(step_clients, std::ref(*bus), std::cref(client_list), std::cref(stepping), std::ref(logger)));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(SETTLE_TIME));
+
+    Msync::BlockServer server(source, path, options.group, options.port, logger);
+    server.set_rate(options.rate);
+    server.set_stripes(options.stripes);
+    server.set_transport(*transport);
+    server.set_catchup(options.catchup && !options.memory);
+    server.set_deadline(options.timeout * 1000);
+
+    struct rusage before;
+    getrusage(RUSAGE_SELF, &before);
+    Clock::time_point start = transport->now();
+    Clock::time_point real_start = Clock::now();
+    std::string error;
+    try {
+        server.start();
+    } catch (std::string& message) {
+        error = message;
+    }
+    Clock::time_point end = transport->now();
+    double real_elapsed = seconds(Clock::now() - real_start);
+    transport->detach_thread();
+
+    stepping = false;
+    for (unsigned int k = 0; k < clients; k++) {
+        client_list[k]->stop();
+    }
+    for (size_t k = 0; k < threads.size(); k++) {
+        threads[k].join();
+    }
+    for (unsigned int k = 0; k < clients; k++) {
+        delete client_list[k];
+    }
+    struct rusage after;
+    getrusage(RUSAGE_SELF, &after);
+
+    unsigned int finished = 0;
+    double first = 0;
+    double last = 0;
+    for (unsigned int k = 0; k < clients; k++) {
+        Clock::time_point time;
+        if (listeners[k]->get_time(time)) {
+            double elapsed = seconds(time - start);
+            first = finished ? std::min(first, elapsed) : elapsed;
+            last = std::max(last, elapsed);
+            finished++;
+        }
+    }
+    bool verified = finished == clients;
+    for (unsigned int k = 0; k < clients; k++) {
+        const std::string& copy = listeners[k]->get_destination();
+        if (verified) {
+            try {
+                verified = Msync::FileInfo(copy) == server.get_file_info();
+            } catch (std::string& message) {
+                error = message;
+                verified = false;
+            }
+        }
+        unlink(copy.c_str());
+    }
+
+    double elapsed = seconds(end - start);
+    double cpu = cpu_seconds(after) - cpu_seconds(before);
+    double delivered = (double)size * clients;
+    results << "{\"run\": " << run_index
+        << ", \"file_size\": " << size
+        << ", \"block_size\": " << BLOCKSIZE
+        << ", \"clients\": " << clients
+        << ", \"stripes\": " << options.stripes
+        << ", \"receive_threads\": " << options.receive_threads
+        << ", \"rate\": " << options.rate
+        << ", \"peer_repair\": " << (options.peer_repair ? "true" : "false")
+        << ", \"receive_offload\": " << (options.receive_offload ? "true" : "false")
+        << ", \"catchup\": " << (options.catchup ? "true" : "false")
+        << ", \"impairment\": \"" << options.impairment.spec << "\""
+        << ", \"finished\": " << finished
+        << ", \"verified\": " << (verified ? "true" : "false")
+        << ", \"failed\": " << (error.empty() ? "false" : "true")
+        << ", \"session_seconds\": " << elapsed
+        << ", \"first_client_seconds\": " << first
+        << ", \"last_client_seconds\": " << last
+        << ", \"throughput_mbps\": " << (last > 0 ? size * 8 / last / 1e6 : 0)
+        << ", \"aggregate_mbps\": " << (last > 0 ? delivered * 8 / last / 1e6 : 0)
+        << ", \"packets_sent\": " << server.get_packets_sent()
+        << ", \"repairs_sent\": " << server.get_repairs_sent()
+        << ", \"catchup_blocks\": " << server.get_catchup_blocks()
+        << ", \"cpu_seconds\": " << cpu
+        << ", \"cpu_seconds_per_gb\": " << (delivered > 0 ? cpu * (1 << 30) / delivered : 0)
+        << ", \"peak_rss_kb\": " << after.ru_maxrss
+        << ", \"transport\": \"" << (bus ? "memory" : options.uring ? "uring" : "udp") << "\""
+        << ", \"real_seconds\": " << real_elapsed;
+    if (bus) {
+        // Control messages are the ones clients send to the server
+        uint64_t control = 0;
+        const unsigned int types[] = { Msync::MESSAGE_TYPE_CHELLO, Msync::MESSAGE_TYPE_GETINFO, Msync::MESSAGE_TYPE_GETBLOCK,
+            Msync::MESSAGE_TYPE_GETRANGES, Msync::MESSAGE_TYPE_HEARTBEAT, Msync::MESSAGE_TYPE_CGOODBYE };
+        for (size_t k = 0; k < sizeof(types) / sizeof(types[0]); k++) {
+            control += bus->get_messages_sent(types[k]);
+        }
+        results << ", \"latency_ms\": " << options.latency
+            << ", \"control_messages\": " << control
+            << ", \"heartbeats\": " << bus->get_messages_sent(Msync::MESSAGE_TYPE_HEARTBEAT)
+            << ", \"repair_requests\": " << bus->get_messages_sent(Msync::MESSAGE_TYPE_GETRANGES)
+            << ", \"server_goodbyes\": " << bus->get_messages_sent(Msync::MESSAGE_TYPE_SGOODBYE)
+            << ", \"bus_deliveries\": " << bus->get_deliveries()
+            << ", \"bus_bytes\": " << bus->get_bytes_sent();
+    }
+    
+    // Each run has a process of its own, so the library's metrics cover
+    // just this run
+    results << ", \"metrics\": {";
+    for (unsigned int k = 0; k < Msync::METRIC_COUNT; k++) {
+        results << (k ? ", " : "") << "\"" << Msync::Metrics::get_name((Msync::Metric)k) << "\": " << Msync::Metrics::get((Msync::Metric)k);
+    }
+    results << "}, \"latency\": {";
+    for (unsigned int k = 0; k < Msync::STAGE_COUNT; k++) {
+        Msync::Histogram histogram;
+        Msync::Metrics::get_histogram((Msync::Stage)k, histogram);
+        results << (k ? ", " : "") << "\"" << Msync::Metrics::get_name((Msync::Stage)k) << "\": {"
+            << "\"count\": " << histogram.get_count()
+            << ", \"p50\": " << histogram.get_quantile(0.5)
+            << ", \"p99\": " << histogram.get_quantile(0.99)
+            << ", \"p999\": " << histogram.get_quantile(0.999)
+            << ", \"max\": " << histogram.get_max() << "}";
+    }
+    results << "}}" << std::endl;
+    if (!error.empty()) {
+        MSYNC_LOG(logger, ERR) << error << "\n";
+    }
+    return verified && error.empty();
+}
+
+static void usage(const char* program)
+{
+    std::cerr << "Usage: " << program << " [options]\n"
+        << "  -s SIZES     file sizes, comma-separated, with K/M/G suffixes (default 16M)\n"
+        << "  -c COUNTS    client counts, comma-separated (default 1)\n"
+        << "  -n REPEAT    runs of each combination (default 1)\n"
+        << "  -r RATE      server send rate in bytes per second, 0 for none (default 0)\n"
+        << "  -t STRIPES   number of stripes (default 1)\n"
+        << "  -T THREADS   receive threads per stripe in each client (default 1)\n"
+        << "  -p           enable peer repair\n"
+        << "  -C           disable TCP catch-up\n"
+        << "  -i SPEC      emulate network conditions on received traffic, such as\n"
+        << "               loss=1%,burst=0.01:0.3,reorder=5%,dup=1%,delay=20:5,rate=10M,seed=7\n"
+        << "  -m           run on an in-memory bus with a virtual clock instead of UDP;\n"
+        << "               TCP catch-up is disabled\n"
+        << "  -l MS        latency of the in-memory bus (default 0)\n"
+        << "  -u           receive through io_uring in the clients\n"
+        << "  -G           coalesce received blocks in the clients\n"
+        << "  -d SECONDS   limit on each run (default " << RUN_TIMEOUT << ")\n"
+        << "  -g GROUP     multicast group (default 228.5.6.9)\n"
+        << "  -P PORT      port (default 9400)\n"
+        << "  -w DIR       directory for the test files (default /tmp)\n"
+        << "  -o FILE      append results to FILE instead of standard output\n"
+        << "  -v           log progress to standard error\n"
+        << "The block size is fixed when the library is built (BLOCKSIZE = " << BLOCKSIZE << ").\n";
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    try {
+        int option;
+        while ((option = getopt(argc, argv, "s:c:n:r:t:T:pCi:ml:uGd:g:P:w:o:vh")) != -1) {
+            switch (option) {
+                case 's': options.sizes = parse_list(optarg); break;
+                case 'c': options.clients = parse_list(optarg); break;
+                case 'n': options.repeat = (unsigned int)parse_size(optarg); break;
+                case 'r': options.rate = (unsigned long)parse_size(optarg); break;
+                case 't': options.stripes = (unsigned int)parse_size(optarg); break;
+                case 'T': options.receive_threads = (unsigned int)parse_size(optarg); break;
+                case 'p': options.peer_repair = true; break;
+                case 'C': options.catchup = false; break;
+                case 'i': options.impairment = Msync::ImpairmentProfile::parse(optarg); break;
+                case 'm': options.memory = true; break;
+                case 'l': options.latency = (unsigned long)parse_size(optarg); break;
+                case 'u': options.uring = true; break;
+                case 'G': options.receive_offload = true; break;
+                case 'd': options.timeout = (unsigned long)parse_size(optarg); break;
+                case 'g': options.group = optarg; break;
+                case 'P': options.port = (unsigned short)parse_size(optarg); break;
+                case 'w': options.directory = optarg; break;
+                case 'o': options.output = optarg; break;
+                case 'v': options.verbose = true; break;
+                default: usage(argv[0]); return 2;
+            }
+        }
+    } catch (std::string& message) {
+        std::cerr << message << std::endl;
+        usage(argv[0]);
+        return 2;
+    }
+
+    // Every simulated client keeps its partial file open
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    std::ofstream file;
+    if (!options.output.empty()) {
+        file.open(options.output.c_str(), std::ios::app);
+        if (!file) {
+            std::cerr << "Could not open " << options.output << ": " << strerror(errno) << std::endl;
+            return 1;
+        }
+    }
+    std::ostream& results = options.output.empty() ? std::cout : file;
+
+    int status = 0;
+    for (size_t s = 0; s < options.sizes.size(); s++) {
+        std::stringstream name;
+        name << options.directory << "/msync-bench-" << getpid() << ".src";
+        std::string source = name.str();
+        try {
+            make_source(source, options.sizes[s]);
+        } catch (std::string& message) {
+            std::cerr << message << std::endl;
+            return 1;
+        }
+
+        for (size_t c = 0; c < options.clients.size(); c++) {
+            for (unsigned int n = 0; n < options.repeat; n++) {
+                // The library reports progress on standard output, so the
+                // child sends it to standard error and writes its results
+                // through a pipe
+                int fds[2];
+                if (pipe(fds) < 0) {
+                    std::cerr << "Could not create pipe: " << strerror(errno) << std::endl;
+                    return 1;
+                }
+                results.flush();
+                pid_t pid = fork();
+                if (pid == 0) {
+                    close(fds[0]);
+                    dup2(2, 1);
+                    std::stringstream line;
+                    bool passed = false;
+                    try {
+                        passed = run(options, source, options.sizes[s], (unsigned int)options.clients[c], n, line);
+                    } catch (std::string& message) {
+                        std::cerr << message << std::endl;
+                        Msync::Logger::flush();
+                        _exit(1);
+                    }
+                    std::string text = line.str();
+                    ssize_t written = write(fds[1], text.data(), text.size());
+                    Msync::Logger::flush();
+                    _exit(passed && written == (ssize_t)text.size() ? 0 : 1);
+                } else if (pid < 0) {
+                    std::cerr << "Could not fork: " << strerror(errno) << std::endl;
+                    return 1;
+                }
+                close(fds[1]);
+                char buffer[4096];
+                ssize_t length;
+                while ((length = read(fds[0], buffer, sizeof(buffer))) > 0) {
+                    results.write(buffer, length);
+                }
+                close(fds[0]);
+                results.flush();
+
+                int child;
+                waitpid(pid, &child, 0);
+                if (!WIFEXITED(child) || WEXITSTATUS(child) != 0) {
+                    status = 1;
+                }
+            }
+        }
+        unlink(source.c_str());
+    }
+    return status;
+}
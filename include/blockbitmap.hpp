@@ -0,0 +1,117 @@
+#ifndef BLOCKBITMAP_HPP
+#define BLOCKBITMAP_HPP
+
+#include "extent.hpp"
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+
+namespace Msync {
+
+/**
+ * Set of received blocks that can be updated from several threads at once
+ * without locking.  Each block is one bit in a leaf word; each leaf word is
+ * one bit in two summary words, one set once the leaf is full and one set
+ * once it has any block.  Searches for missing blocks skip full leaves 64
+ * at a time, and searches for received blocks skip empty ones, so finding
+ * the next hole or the next run in a multi-terabyte file touches only a
+ * few words.
+ */
+class BlockBitmap {
+public:
+
+    /**
+     * Creates a new bitmap with every block missing.
+     * @param count the number of blocks
+     */
+    BlockBitmap(uint64_t count);
+
+    /**
+     * Marks a block as received.
+     * @param block the block number
+     * @return true if this call set the bit, false if it was already set
+     */
+    bool set(uint64_t block);
+
+    /**
+     * Marks a run of blocks as received.
+     * @param start the first block
+     * @param count the number of blocks
+     * @return the number of blocks that weren't already set
+     */
+    uint64_t set_range(uint64_t start, uint64_t count);
+
+    /**
+     * Checks whether a block has been received.
+     * @param block the block number
+     * @return true if the block is set
+     */
+    bool test(uint64_t block) const;
+
+    /**
+     * Returns the number of blocks in the bitmap.
+     * @return the block count
+     */
+    uint64_t size() const;
+
+    /**
+     * Returns the number of blocks that haven't been set yet.
+     * @return the number of missing blocks
+     */
+    uint64_t remaining() const;
+
+    /**
+     * Finds the first missing block at or after the given block.
+     * @param block the block to start from
+     * @return the first missing block, or size() if there is none
+     */
+    uint64_t next_missing(uint64_t block) const;
+
+    /**
+     * Finds the first received block at or after the given block.
+     * @param block the block to start from
+     * @return the first received block, or size() if there is none
+     */
+    uint64_t next_present(uint64_t block) const;
+
+    /**
+     * Counts the missing blocks in a range.
+     * @param start the first block
+     * @param count the number of blocks
+     * @return the number of missing blocks in the range
+     */
+    uint64_t count_missing(uint64_t start, uint64_t count) const;
+
+    /**
+     * Encodes runs of missing blocks as extents.
+     * @param block the block to start from
+     * @param extents receives the runs of missing blocks
+     * @param max the maximum number of extents to add
+     * @return the block to continue encoding from, or size() if every
+     * missing block was encoded
+     */
+    uint64_t encode_missing(uint64_t block, std::vector<Extent>& extents, size_t max) const;
+
+private:
+    BlockBitmap(const BlockBitmap&);
+    BlockBitmap& operator=(const BlockBitmap&);
+
+    /**
+     * Sets bits in a leaf word, and the leaf's summary bits if it stops
+     * being empty or becomes full.
+     * @param word the leaf word index
+     * @param mask the bits to set
+     * @return the number of bits that weren't already set
+     */
+    unsigned int set_bits(uint64_t word, uint64_t mask);
+
+    std::vector<std::atomic<uint64_t> > leaves;
+    std::vector<std::atomic<uint64_t> > summary;
+    std::vector<std::atomic<uint64_t> > occupied;
+    uint64_t count;
+    std::atomic<uint64_t> missing;
+};
+
+}
+
+#endif
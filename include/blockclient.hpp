@@ -1,27 +1,43 @@
 #ifndef BLOCKCLIENT_HPP
 #define BLOCKCLIENT_HPP
 
-
-#define STATE_OPEN      0
-#define STATE_WAITING   1
-#define STATE_READING   2
-#define STATE_CLOSED    3
-
 #include "blocksocket.hpp"
 #include "fileinfo.hpp"
 #include "blockinfo.hpp"
 #include "syncstatus.hpp"
+#include "blocklistener.hpp"
+#include "pathmonitor.hpp"
+#include "timerwheel.hpp"
+#include "error.hpp"
 #include <string>
 #include <vector>
 #include <list>
 #include <map>
+#include <set>
+#include <chrono>
+#include <random>
 #include <fstream>
 #include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
 
 #ifndef WINDOWS
 #include <tr1/memory>
 #endif
 
+// Default time a file's sync waits for its server before it is abandoned,
+// in milliseconds
+#define SESSION_TIMEOUT 60000
+
+// Interval at which the hello is repeated until the server acknowledges
+// it, in milliseconds
+#define HELLO_INTERVAL 250
+
+// Resolution and size of the session timer wheel
+#define SESSION_TICK 1000
+#define SESSION_SLOTS 256
+
 namespace Msync {
 
 class BlockClient {
@@ -34,29 +50,236 @@ public:
      */
     BlockClient(const std::string& group = "228.5.6.7",  
 		unsigned short port = 9000, Logger& logger = Logger::Default);
+    
+    /**
+     * Stops and joins the receive threads.
+     */
+    ~BlockClient();
 
     /**
      * Binds the socket and prepares to listen for messages.
      * @throw string if the operation fails
      */
     void start();
+    
+    /**
+     * Opens the client's sockets to be driven from the caller's own event
+     * loop, instead of calling start().  No threads are started: the
+     * caller waits until the descriptor is readable or the timeout has
+     * passed, and then calls step().  TCP catch-up isn't used, and
+     * packets held back by an emulated network are only delivered by the
+     * next step.  On a MemoryBus, which has no descriptors, the caller
+     * waits with MemoryBus::wait_for_delivery() instead, and attaches its
+     * thread to the bus.  Only supported on Linux.
+     * @return ERROR_NONE, or why the client couldn't be opened
+     */
+    Error open();
+    
+    /**
+     * Returns a descriptor that polls as readable whenever step() has work
+     * to do other than on a timer.
+     * @return the descriptor, or -1 if the client isn't open or its
+     * transports have no descriptors
+     */
+    int get_descriptor() const;
+    
+    /**
+     * Returns how long the caller may wait for the descriptor before
+     * calling step() anyway.
+     * @return the timeout in milliseconds
+     */
+    long get_timeout();
+    
+    /**
+     * Handles the messages that have arrived, sends what can be sent, and
+     * runs the timers that are due.  Never blocks, and handles at most
+     * STEP_MESSAGE_LIMIT messages from each socket, so that many clients
+     * can share one thread.  The listener is called from here.
+     * @return ERROR_NONE, or the error that stopped the client
+     */
+    Error step();
+    
+    /**
+     * Returns true once every file the client has started has been synced
+     * and the server has acknowledged it, or has been abandoned.
+     * @return true if the client has finished
+     */
+    bool is_complete();
+    
+    /**
+     * Returns a description of the last error returned by open() or
+     * step().
+     * @return the description
+     */
+    const std::string& get_error() const;
+    
+    /**
+     * Sets the number of stripes the server spreads blocks across.  One
+     * receive thread is started for each stripe after the first.
+     * @param count the number of stripes
+     */
+    void set_stripes(unsigned int count);
+    
+    /**
+     * Sets the number of threads receiving each stripe.  The threads share
+     * the stripe's port, and a kernel filter on each socket steers every
+     * block to exactly one of them.
+     * @param count the number of receive threads per stripe
+     */
+    void set_receive_threads(unsigned int count);
+    
+    /**
+     * Sets the rate the server is expected to send at, so that the
+     * receive buffers can be sized to hold a burst of it.  Must be called
+     * before start().
+     * @param rate the rate in bytes per second, or 0 if unknown
+     */
+    void set_rate(unsigned long rate);
+    
+    /**
+     * Sets the maximum random delay before the hello, goodbye and repair
+     * messages that every client sends at about the same time, so that a
+     * large fleet doesn't answer the server all at once.
+     * @param jitter the maximum delay in milliseconds
+     */
+    void set_jitter(unsigned long jitter);
+    
+    /**
+     * Sets how long a file's sync may go without hearing from its server
+     * before it is abandoned and its partial file removed.  A file that has
+     * been moved into place is kept, even if the server never acknowledges
+     * the client's goodbye.  Must be called before start().
+     * @param timeout the timeout in milliseconds, or 0 to wait forever
+     */
+    void set_session_timeout(unsigned long timeout);
+    
+    /**
+     * Sets an object to be told about files as they arrive.  Must be
+     * called before start().
+     * @param listener the listener, or null for none
+     */
+    void set_listener(BlockListener* listener);
+    
+    /**
+     * Enables peer-assisted repair.  Repair requests are sent to the group
+     * first, and clients that have the requested blocks send them after a
+     * random delay, unless another client sends them first.  The server is
+     * asked instead whenever a round of peer requests makes no progress.
+     * Must be called before start().
+     * @param enabled true to answer and send peer repair requests
+     */
+    void set_peer_repair(bool enabled);
+    
+    /**
+     * Enables receive offload, so that runs of blocks that arrive together
+     * are read in one call where the kernel can coalesce them.  The
+     * kernel's filter only sees the first block of a run, so blocks that
+     * have already been received are no longer dropped before they are
+     * read, which costs more than offload saves while repairs for other
+     * clients are being sent.  Off by default.  Must be called before
+     * start().
+     * @param enabled true to coalesce received blocks
+     */
+    void set_receive_offload(bool enabled);
+    
+    /**
+     * Sets the transport to receive files over, and the clock to time the
+     * session with.  Must be called before start().
+     * @param factory the transport factory, which must outlive the client
+     */
+    void set_transport(TransportFactory& factory);
+    
+    /**
+     * Asks start() to return as soon as possible.  May be called from any
+     * thread.
+     */
+    void stop();
 
 private:
 
 	typedef void (BlockClient::*message_handler)(const Message&, const Address&);
     
+    struct PeerRepair {
+        PeerRepair(const FileInfo& info, const std::tr1::shared_ptr<SyncStatus>& status,
+            TransportFactory::Clock::time_point due);
+        FileInfo info;
+        std::tr1::shared_ptr<SyncStatus> status;
+        TransportFactory::Clock::time_point due;
+    };
+    
+    class BlockWrite;
+    
+    /**
+     * Opens the sockets.
+     * @param threaded true to start a receive thread for each receiver
+     * @throw string if the operation fails
+     */
+    void open_sockets(bool threaded);
+    
+    /**
+     * Sends heartbeats and the delayed messages and peer repairs that are
+     * due.
+     * @return the time until the next of them is due, in milliseconds
+     */
+    long run_timers();
+    
+    /**
+     * Abandons the syncs whose servers have gone quiet for longer than the
+     * session timeout.
+     */
+    void check_timeouts();
+    
+    /**
+     * Returns true if there are messages waiting to be sent.
+     * @return true if the control socket should be polled for writing
+     */
+    bool output_pending();
+    
+    /**
+     * Reads and handles the messages waiting on one socket without
+     * blocking.
+     * @param socket the socket to read from
+     * @param more set to true if the socket may have more to read
+     * @return ERROR_NONE, or the error that stopped the client
+     */
+    Error step_socket(Transport& socket, bool& more);
+    
+    /**
+     * Records an error returned by open() or step().
+     * @param code the error
+     * @param description its description
+     * @return the error
+     */
+    Error fail(Error code, const std::string& description);
+    
     /**
      * Loops while processing messages and the send queue for the given amount
-     * of time.
+     * of time.  Nothing is sent until the server's address is known.
      * @param timeout the time to loop in milliseconds
      * @throw string on I/O error
      */
     void select(long timeout);
     
     /**
-     * Processes one incoming message from the underlying socket.
+     * Processes one incoming message from the given socket.
+     * @param socket the socket to read from
+     */
+    void process_message(Transport& socket);
+    
+    /**
+     * Hands a message that has been read to its handler.
+     * @param message the message
+     * @param address the address it came from
+     * @param receiver the transport it was read from
      */
-    void process_message();
+    void dispatch(Message& message, const Address& address, Transport& receiver);
+    
+    /**
+     * Receive thread: processes messages from one socket until the client
+     * is destroyed.
+     * @param socket the socket to receive from
+     */
+    void receive(Transport* socket);
     
     /**
      * Saves file information.
@@ -65,31 +288,168 @@ private:
      */
     void save_info(const FileInfo& info, const std::string& path);
     
+    /**
+     * Determines whether a block belongs to the current session, rather
+     * than being a peer's repair for a file this client isn't syncing.
+     * @param message the block
+     * @param info the file the block belongs to
+     * @return true if the block should be received
+     */
+    bool from_session(const Message& message, const FileInfo& info);
+    
     /**
      * Returns the synchronization status associated with the given file
      * identification information.
      * @param info file information.
-     * @return the status of the given file.
+     * @return the status of the given file, or null if the file has already
+     * been synced
+     */
+    std::tr1::shared_ptr<SyncStatus> get_sync_status(const FileInfo& info, const Address& address);
+    
+    /**
+     * Moves the file into place once every block has arrived, and forgets
+     * it once both sides agree the sync has completed.
+     * @param info file information
+     * @param status the status of the file
+     */
+    void check_sync_status(const FileInfo& info, SyncStatus& status);
+    
+    /**
+     * Records the address that the server's control messages come from, so
+     * that requests can be sent back to it by unicast.
+     * @param address the server's control address
+     * @param sender the server's host ID, which identifies the session
+     */
+    void set_server(const Address& address, unsigned int sender);
+    
+    /**
+     * Updates the kernel filters on the receive sockets to drop messages
+     * from other sessions and blocks in the longest run already received.
+     * Only called from the thread running start() or step().
+     */
+    void update_filters();
+    
+    /**
+     * Enqueues a message to be sent after a random delay of up to the
+     * configured jitter.
+     * @param message the message to send
+     * @param to_group true to send the message to the group rather than to
+     * the server
+     */
+    void enqueue_later(const Message& message, bool to_group = false);
+    
+    /**
+     * Moves delayed messages that are due to the send queues.
+     * @return the time until the next delayed message is due, in
+     * milliseconds, or -1 if there are none
+     */
+    long release_delayed();
+    
+    /**
+     * Returns the packets dropped so far by the receive buffers of every
+     * transport the client reads.
+     * @return the number of packets dropped
+     */
+    uint64_t get_receive_drops() const;
+    
+    /**
+     * Enqueues repair requests for the blocks that are still missing.
+     * @param info file information
+     * @param status the status of the file
+     */
+    void request_missing(const FileInfo& info, SyncStatus& status);
+    
+    /**
+     * Reads the peer repairs that are due from the partial file and queues
+     * them to be sent to the group.
+     * @return the time until the next peer repair is due, in milliseconds,
+     * or -1 if there are none
+     */
+    long release_peer_repairs();
+    
+    /**
+     * Returns the index a socket's path measurements are kept under: the
+     * control socket's is 0, and each receiver's follows.
+     * @param receiver the socket
+     * @return the index
+     */
+    size_t get_source(const Transport& receiver) const;
+    
+    /**
+     * Tells the listener about a block that has been handled, and moves the
+     * file into place if it was the last.
+     * @param message the block
+     * @param info the file the block belongs to
+     * @param status the status of the file
+     * @param stored true if the block was new and has been written
      */
-    SyncStatus& get_sync_status(const FileInfo& info, const Address& address);
+    void block_stored(const Message& message, const FileInfo& info, SyncStatus& status, bool stored);
     
     /**
-     * Checks the sync status to see if the file transfer is complete.
-     * @param status the status object
+     * Catch-up thread: fetches the missing blocks of a file over TCP.
+     * @param info file information
+     * @param status the status of the file
+     * @param host the server's address
+     * @param port the port the server offered
      */
-    void check_sync_status(const SyncStatus& status);
+    void catch_up(FileInfo info, std::tr1::shared_ptr<SyncStatus> status, std::string host, unsigned short port);
 
 	void handle_info(const Message& message, const Address& address);
-	void handle_block(const Message& message, const Address& address);
+	void handle_block(const Message& message, const Address& address, Transport& receiver);
+	void handle_extents(const Message& message, const Address& address);
     void handle_sgoodbye(const Message& message, const Address& address);
+    void handle_shello(const Message& message, const Address& address);
+    void handle_getranges(const Message& message, const Address& address);
+    void handle_catchup(const Message& message, const Address& address);
 
     HostInfo info;
     Logger logger;
-    BlockSocket socket;
-    std::map<FileInfo, SyncStatus> sync_set;
+    std::string group;
+    unsigned short port;
+    TransportFactory* transport;
+    std::tr1::shared_ptr<Transport> socket;
+    std::mutex mutex;
+    PathMonitor path;
+    Address server;
+    unsigned int server_id;
+    bool has_server;
+    bool joined;
+    unsigned int filtered_id;
+    uint64_t filtered_start;
+    uint64_t filtered_end;
+    std::map<FileInfo, std::tr1::shared_ptr<SyncStatus> > sync_set;
+    std::set<FileInfo> finished;
+    TimerWheel sessions;
+    std::map<unsigned int, FileInfo> session_timers;
+    unsigned int next_session;
+    uint64_t session_timeout;
     std::list<Message> message_queue;
+    std::list<std::pair<Address, Message> > group_queue;
+    std::multimap<TransportFactory::Clock::time_point, std::pair<bool, Message> > delayed;
+    bool peer_repair;
+    bool receive_offload;
+    uint64_t peer_remaining;
+    std::map<uint64_t, PeerRepair> peer_repairs;
+    unsigned long jitter;
+    std::minstd_rand random;
 	std::map<unsigned int, message_handler> handlers;
     unsigned int id;
+    unsigned int stripe_count;
+    unsigned int receive_threads;
+    unsigned long rate;
+    std::vector<std::tr1::shared_ptr<Transport> > receivers;
+    std::vector<std::thread> threads;
+    std::atomic<bool> stopped;
+    std::atomic<bool> catching_up;
+    std::thread catchup_thread;
+    BlockListener* listener;
+    TransportFactory::Clock::time_point heartbeat;
+    TransportFactory::Clock::time_point hello;
+    TransportFactory::Clock::time_point next_step;
+    bool driven;
+    int poller;
+    bool polling_write;
+    std::string error;
 };
 
 }
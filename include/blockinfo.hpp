@@ -2,6 +2,7 @@
 #define BLOCKINFO_HPP
 
 #include "fileinfo.hpp"
+#include "byteorder.hpp"
 #include <string>
 
 namespace Msync {
@@ -14,7 +15,7 @@ public:
      * @param info the file info
      * @param block the block number
      */
-    BlockInfo(const FileInfo& info, unsigned int block = 0);
+    BlockInfo(const FileInfo& info, uint64_t block = 0);
     
     /**
      * Determines whether or not this file info is equal to another file's
@@ -33,23 +34,38 @@ public:
      * Casts the block info into an unsigned integer.
      * @return the int value of this block info
      */
-    operator unsigned int() const;
+    operator uint64_t() const;
     
     /**
      * Returns the block number
      * @return the block number
      */
-    unsigned int get_block() const;  
+    uint64_t get_block() const;  
     
     /**
      * Returns the file into object.
      * @return information about the file this block came from
      */
     const FileInfo& get_file_info() const;   
+    
+    /**
+     * Returns the time the server sent the block.
+     * @return the time in microseconds since the epoch, or 0 if the sender
+     * didn't record it
+     */
+    uint64_t get_sent() const;
+    
+    /**
+     * Records the time the block is sent, so that the receiver can measure
+     * the one-way delay.
+     * @param time the time in microseconds since the epoch
+     */
+    void set_sent(uint64_t time);
 
 private:
     FileInfo file_info;
-    unsigned int block_num;
+    uint64_t block_num;
+    uint64_t sent_time;
 };
 
 }
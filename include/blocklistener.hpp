@@ -0,0 +1,61 @@
+#ifndef BLOCKLISTENER_HPP
+#define BLOCKLISTENER_HPP
+
+#include "fileinfo.hpp"
+#include "message.hpp"
+#include <string>
+
+namespace Msync {
+
+/**
+ * Receives notifications from a BlockClient as a file arrives.  The
+ * methods are called from the client's receive threads, possibly several
+ * at once, and more than once for the same file; or from step() if the
+ * client is driven by another program's event loop.
+ */
+class BlockListener {
+public:
+
+    virtual ~BlockListener() {}
+
+    /**
+     * Called when file information arrives for a file being synced.
+     * @param info the file information
+     * @param path the destination path sent by the server, which the
+     * listener may change to move the finished file somewhere else
+     * @param temp the partial file that blocks are being written to
+     */
+    virtual void file_started(const FileInfo& info, std::string& path, const std::string& temp) = 0;
+    
+    /**
+     * Called after a new block has been written, or when a message
+     * announcing empty extents arrives.
+     * @param message the block or extents message
+     */
+    virtual void block_received(const Message& message) = 0;
+    
+    /**
+     * Called once every block of a file has arrived.
+     * @param info the file information
+     */
+    virtual void file_finished(const FileInfo& info) = 0;
+    
+    /**
+     * Called after each new block of a file has been written.
+     * @param info the file information
+     * @param remaining the number of blocks still missing
+     * @param total the number of blocks in the file
+     */
+    virtual void file_progress(const FileInfo& info, uint64_t remaining, uint64_t total) {}
+    
+    /**
+     * Called when a file is abandoned because its server went quiet
+     * before every block arrived.  The partial file has been removed.
+     * @param info the file information
+     */
+    virtual void file_failed(const FileInfo& info) {}
+};
+
+}
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef BLOCKREADER_HPP
+#define BLOCKREADER_HPP
+
+#include "fileinfo.hpp"
+#include "blockinfo.hpp"
+#include "extent.hpp"
+#include "message.hpp"
+#include "sparsescanner.hpp"
+#include <string>
+#include <vector>
+#include <fstream>
+
+namespace Msync {
+
+class BlockReader {
+public:
+
+    /**
+     * Creates a new reader that formats blocks of the given file into
+     * messages.
+     * @param source the path to the file to read
+     * @param info the file information
+     * @param sender the sender ID to put in each message
+     */
+    BlockReader(const std::string& source, const FileInfo& info, unsigned int sender);
+
+    /**
+     * Returns the first block at or after the given block that may contain
+     * data.  The last block of the file is never skipped.
+     * @param block the block to start searching from
+     * @return the next block that may contain data
+     */
+    uint64_t next_data(uint64_t block);
+
+    /**
+     * Reads the given block into a block message.  All-zero blocks (other
+     * than the last block) are added to the pending extents instead.
+     * @param block the block to read
+     * @param message receives the block message
+     * @return true if the message was filled in, false if the block was
+     * empty
+     * @throw string if the block can't be read
+     */
+    bool read(const BlockInfo& block, Message& message);
+
+    /**
+     * Adds a run of empty blocks to the pending extents, merging it with
+     * the previous run if the two are adjacent.
+     * @param start the first empty block
+     * @param count the number of empty blocks
+     */
+    void add_empty(uint64_t start, uint64_t count);
+
+    /**
+     * Returns true if the pending extents fill a whole message.
+     * @return true if the extents should be flushed
+     */
+    bool extents_full() const;
+
+    /**
+     * Formats all pending extents into an extent message and clears them.
+     * @param message receives the extent message
+     * @return false if there were no pending extents
+     */
+    bool flush(Message& message);
+
+private:
+    std::ifstream input;
+    SparseScanner scanner;
+    FileInfo file_info;
+    unsigned int sender;
+    std::vector<Extent> extents;
+};
+
+}
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef BLOCKRELAY_HPP
+#define BLOCKRELAY_HPP
+
+#include "blockclient.hpp"
+#include "blockserver.hpp"
+#include "blocklistener.hpp"
+#include "logger.hpp"
+#include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+
+#ifndef WINDOWS
+#include <tr1/memory>
+#endif
+
+namespace Msync {
+
+/**
+ * Receives files from an upstream group as a client and serves them to a
+ * downstream group as a server, so that a push can cross subnets that
+ * multicast doesn't route between.  Blocks are forwarded as they arrive
+ * rather than once the file is complete, and downstream repairs are
+ * handled by the relay.  One file is relayed at a time.
+ */
+class BlockRelay : public BlockListener {
+public:
+
+    /**
+     * Creates a new relay with the given attributes.
+     * @param upstream_group the multicast group to receive from
+     * @param upstream_port the port to receive from
+     * @param downstream_group the multicast group to serve
+     * @param downstream_port the port to serve
+     * @param logger the logger to use
+     */
+    BlockRelay(const std::string& upstream_group = "228.5.6.7", unsigned short upstream_port = 9000,
+        const std::string& downstream_group = "228.5.6.8", unsigned short downstream_port = 9000,
+        Logger& logger = Logger::Default);
+    
+    /**
+     * Stops the downstream server and waits for it to finish.
+     */
+    ~BlockRelay();
+    
+    /**
+     * Starts receiving from upstream.  Does not return unless an error
+     * occurs.
+     * @throw string if the operation fails
+     */
+    void start();
+    
+    /**
+     * Limits the rate at which blocks are sent downstream.
+     * @param rate the rate in bytes per second, or 0 for no limit
+     */
+    void set_rate(unsigned long rate);
+    
+    /**
+     * Returns the upstream client, for configuring before start().
+     * @return the client
+     */
+    BlockClient& get_client();
+
+    virtual void file_started(const FileInfo& info, std::string& path, const std::string& temp);
+    virtual void block_received(const Message& message);
+    virtual void file_finished(const FileInfo& info);
+
+private:
+
+    /**
+     * Server thread: serves one file downstream until its clients are done.
+     * @param server the server to run
+     */
+    void serve(BlockServer* server);
+
+    Logger& logger;
+    std::string group;
+    unsigned short port;
+    unsigned long rate;
+    std::mutex mutex;
+    std::tr1::shared_ptr<BlockServer> server;
+    std::thread serving;
+    std::atomic<bool> finished;
+    
+    // Declared last so that the receive threads are stopped before the
+    // rest of the relay is destroyed
+    BlockClient client;
+};
+
+}
+
+#endif
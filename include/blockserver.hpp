@@ -12,14 +12,95 @@
 #include <map>
 #include <vector>
 #include <list>
+#include <deque>
 #include <iostream>
 #include <fstream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <tr1/memory>
 #include "blocksocket.hpp"
 #include "hostinfo.hpp"
 #include "logger.hpp"
 #include "fileinfo.hpp"
+#include "blockinfo.hpp"
+#include "blockreader.hpp"
+#include "extentset.hpp"
+#include "ringbuffer.hpp"
+#include "timerwheel.hpp"
+#include "hostfilter.hpp"
+#include "catchupsender.hpp"
 
+// Size of a block in bytes; can be overridden at build time
+#ifndef BLOCKSIZE
 #define BLOCKSIZE 1024
+#endif
+
+// Maximum number of zero extents announced in a single message
+#define EXTENTS_PER_MESSAGE 128
+
+// Number of preformatted block messages the reader thread may run ahead of
+// the sender thread
+#define PREFETCH_BLOCKS 1024
+
+// Number of relayed blocks that may wait for the reader thread.  Blocks that
+// arrive from upstream faster than they can be sent are dropped, and the
+// downstream clients repair them from the finished file.
+#define RELAY_FEED_LIMIT 4096
+
+// Maximum number of waiting blocks a stripe sends in one call, so that the
+// kernel can cut them into packets together
+#define SEND_BATCH 16
+
+// Longest burst a rate-limited stripe sends in one call, in milliseconds at
+// its rate
+#define SEND_BURST 1
+
+// Maximum number of repair blocks waiting in the control send queue
+#define REPAIR_QUEUE_DEPTH 5
+
+// Number of server goodbyes that acknowledge each client goodbye
+#define ACK_ROUNDS 3
+
+// Time the server waits after the first pass for clients whose hellos were
+// lost, in milliseconds
+#define HELLO_GRACE 2000
+
+// Interval between server goodbyes after the first pass, in milliseconds
+#define GOODBYE_INTERVAL 1000
+
+// Maximum number of wanted blocks sent in carousel mode before the next
+// block in the cycle
+#define PRIORITY_RATIO 4
+
+// Default time a client may stay silent before it is evicted, in
+// milliseconds
+#define LEASE_TIMEOUT 10000
+
+// Resolution and size of the lease timer wheel
+#define LEASE_TICK 100
+#define LEASE_SLOTS 1024
+
+// Default maximum number of clients tracked at once
+#define MAX_HOSTS 65536
+
+// Once no more than CATCHUP_HOSTS clients are left, a client that asks for
+// at least CATCHUP_BLOCKS blocks at once is sent them over TCP instead
+#define CATCHUP_HOSTS 4
+#define CATCHUP_BLOCKS 1024
+
+// Number of times a client is offered a catch-up stream before its repairs
+// are multicast, in case the offers are lost or it can't connect
+#define CATCHUP_OFFERS 3
+
+// Queueing delay, in microseconds, above which a rate-limited server slows
+// down, and the interval in milliseconds between changes to the rate; each
+// client reports once a heartbeat
+#define RATE_DELAY_TARGET 20000
+#define RATE_ADJUST_INTERVAL 1000
+
+// The slowest a server slows down to, as a fraction of its configured rate
+#define RATE_FLOOR_DIVISOR 16
 
 namespace Msync {
 
@@ -38,17 +119,167 @@ public:
     BlockServer(const std::string& source, const std::string& path,
         const std::string& group = "228.5.6.7", unsigned short port = 9000,
 		Logger& logger = Logger::Default);	
+    
+    /**
+     * Creates a new block server for a file whose information is already
+     * known, such as a file that is still arriving from upstream.
+     * @param info the file information
+     * @param source the path to the file to serve
+     * @param path the destination path
+     * @param group the multicast group address
+     * @param port the port number
+     * @param logger the logger to use
+     */
+    BlockServer(const FileInfo& info, const std::string& source, const std::string& path,
+        const std::string& group = "228.5.6.7", unsigned short port = 9000,
+		Logger& logger = Logger::Default);
+
+    /**
+     * Withdraws the server's share of the host and queue gauges.
+     */
+    ~BlockServer();
 
     /**
      * Opens the socket and begins serving the file.
      * @throw string if the operation fails
      */
     void start();
+    
+    /**
+     * Limits the rate at which blocks are sent during the initial pass.
+     * @param rate the rate in bytes per second, or 0 for no limit
+     */
+    void set_rate(unsigned long rate);
+    
+    /**
+     * Sets the number of stripes to spread blocks across.  Stripe k is sent
+     * to the group on port + k by its own sender thread; clients must be
+     * configured with the same number of stripes.
+     * @param count the number of stripes
+     */
+    void set_stripes(unsigned int count);
+    
+    /**
+     * Enables carousel mode.  Instead of making one pass over the file and
+     * then serving repairs, the server cycles through the file until
+     * stop() is called, re-announcing the file information every
+     * GOODBYE_INTERVAL.  A client can join at any point and has every block
+     * after one full cycle.
+     * @param enabled true to cycle through the file
+     * @param prioritise true to send blocks that clients ask for ahead of
+     * the rest of the cycle; otherwise requests are ignored and clients
+     * wait for the carousel to come around
+     */
+    void set_carousel(bool enabled, bool prioritise = false);
+    
+    /**
+     * Sets how long a client may go without sending anything (clients send
+     * heartbeats while they are syncing) before it is evicted from the
+     * session.
+     * @param timeout the lease length in milliseconds
+     */
+    void set_lease_timeout(unsigned long timeout);
+    
+    /**
+     * Sets an overall limit on the length of the session.  Once it passes,
+     * start() returns whether or not the clients are finished.
+     * @param deadline the session length in milliseconds, or 0 for no limit
+     */
+    void set_deadline(unsigned long deadline);
+    
+    /**
+     * Sets the maximum number of clients tracked at once.  Clients that
+     * join once the session is full are ignored until others leave.
+     * @param count the maximum number of clients
+     */
+    void set_max_hosts(size_t count);
+    
+    /**
+     * Enables or disables TCP catch-up.  When it is enabled (the default),
+     * the last few clients are offered their missing blocks over TCP if
+     * they are missing many of them, instead of multicasting the repairs
+     * to the whole group.
+     * @param enabled true to offer catch-up streams
+     */
+    void set_catchup(bool enabled);
+    
+    /**
+     * Enables relay mode.  Instead of reading the source file, the first
+     * pass sends the messages passed to relay() as they arrive, and ends
+     * once end_relay() has been called and they have all been sent.
+     * Repairs are read from the source file after the pass, by which time
+     * it is complete.
+     */
+    void set_relay();
+    
+    /**
+     * Queues a block or extents message received from upstream to be sent
+     * as this server's own.  Blocks are dropped while RELAY_FEED_LIMIT
+     * messages are waiting.  May be called from any thread.
+     * @param message the message to forward
+     */
+    void relay(const Message& message);
+    
+    /**
+     * Tells the relay that every block has arrived.  May be called from
+     * any thread, more than once.
+     */
+    void end_relay();
+    
+    /**
+     * Returns the information for the file being served.
+     * @return the file information
+     */
+    const FileInfo& get_file_info() const;
+    
+    /**
+     * Returns the number of packets sent to the group or to clients,
+     * including repairs and control messages.
+     * @return the packet count
+     */
+    uint64_t get_packets_sent() const;
+    
+    /**
+     * Returns the number of repair blocks sent in answer to requests.
+     * @return the repair count
+     */
+    uint64_t get_repairs_sent() const;
+    
+    /**
+     * Returns the number of blocks sent over TCP catch-up streams.
+     * @return the block count
+     */
+    uint64_t get_catchup_blocks() const;
+    
+    /**
+     * Sets the transport to serve the file over, and the clock to time
+     * the session with.  Must be called before start().
+     * @param factory the transport factory, which must outlive the server
+     */
+    void set_transport(TransportFactory& factory);
+    
+    /**
+     * Asks start() to return as soon as possible.  May be called from any
+     * thread.
+     */
+    void stop();
 
 private:
 
 	typedef void (BlockServer::*message_handler)(const Message&, const Address&);
     
+    struct Lease {
+        uint64_t expiry;
+        uint64_t check;
+        Address address;
+    };
+    
+    struct Stripe {
+        Stripe(TransportFactory& transport, const std::string& group, unsigned short port, Logger& logger);
+        std::tr1::shared_ptr<Transport> socket;
+        RingBuffer<Message> prefetched;
+    };
+    
     /**
      * Loops while processing messages and the send queue for the given amount
      * of time.
@@ -56,26 +287,189 @@ private:
      * @throw string on I/O error
      */
     void select(long timeout);
+
+    /**
+     * Brings the host and queue gauges up to date.
+     * @param hosts the number of hosts
+     * @param depth the number of messages and ranges waiting to be sent
+     */
+    void report_gauges(int64_t hosts, int64_t depth);
     
     /**
      * Processes one incoming message from the underlying socket.
      */
     void process_message();
 
+    /**
+     * Reader thread: reads and formats every block of the file into the
+     * prefetch ring.
+     */
+    void read_blocks();
+    
+    /**
+     * Reader thread in relay mode: moves the messages passed to relay()
+     * into the prefetch rings.
+     */
+    void relay_blocks();
+    
+    /**
+     * Sender thread: paces and transmits the messages in a stripe's
+     * prefetch ring until the reader thread is finished.  Messages that
+     * are already waiting are sent together, up to SEND_BATCH at a time.
+     * @param stripe the stripe to send
+     */
+    void send_blocks(Stripe* stripe);
+    
+    /**
+     * Adds a message to a stripe's prefetch ring, waiting for space if
+     * necessary.  The message is stamped with the time it was queued.
+     * @param stripe the stripe to send the message on
+     * @param message the message to add
+     * @return false if the pass was stopped
+     */
+    bool prefetch(Stripe& stripe, Message& message);
+    
+    /**
+     * Adds a message to the control thread's send queue, stamped with the
+     * time it was queued.
+     * @param message the message to add
+     */
+    void enqueue(const Message& message);
+    
+    /**
+     * Records how long a message was queued for, and stamps blocks with the
+     * time they are sent.  Called just before the message is sent.
+     * @param message the message
+     */
+    void mark_sent(Message& message);
+    
+    /**
+     * Reader thread: sends up to PRIORITY_RATIO of the blocks that clients
+     * have asked for during carousel mode.
+     * @param reader the reader to read blocks with
+     */
+    void prefetch_wanted(BlockReader& reader);
+    
+    /**
+     * Records an error from one of the worker threads and stops the pass.
+     * The first error is rethrown from start().
+     * @param message the error message
+     */
+    void set_error(const std::string& message);
+    
+    /**
+     * Moves blocks from the repair queue to the send queue until the send
+     * queue is full or there are no more repairs.  If only one client is
+     * left the repairs are sent to it directly rather than to the group.
+     */
+    void enqueue_repairs();
+    
+    /**
+     * Enqueues a round of server goodbyes.  The goodbyes carry a filter of
+     * the clients whose goodbyes arrived in the last few rounds, split
+     * into segments; there is always at least one, which also tells the
+     * remaining clients to ask for any blocks they're missing.
+     */
+    void enqueue_goodbye();
+    
+    /**
+     * Returns true if there are client goodbyes left to acknowledge.
+     * @return true if another server goodbye should be sent
+     */
+    bool acks_pending() const;
+    
+    /**
+     * Renews the lease of a client.
+     * @param id the client's host ID
+     * @param address the client's control address
+     * @param join true to add the client to the session if it isn't in it
+     */
+    void touch_host(unsigned int id, const Address& address, bool join);
+    
+    /**
+     * Slows the block stream when clients report that blocks are queueing
+     * along the path to them, and speeds it back up towards the configured
+     * rate when the queues drain.  Only used when a rate is set.
+     * @param queueing the queueing delay a client reported, in
+     * microseconds
+     */
+    void adjust_rate(uint32_t queueing);
+    
+    /**
+     * Offers a straggling client a TCP stream of its missing blocks, if the
+     * session is in its tail and the client hasn't had a stream yet or
+     * been offered one CATCHUP_OFFERS times.
+     * @param id the client's host ID
+     * @param address the client's control address
+     * @param blocks the number of blocks the client asked for
+     * @return true if the client was offered a stream
+     */
+    bool offer_catchup(unsigned int id, const Address& address, uint64_t blocks);
+    
+    /**
+     * Evicts clients whose leases have run out, and stops the session if
+     * its deadline has passed.
+     */
+    void check_timeouts();
+
 	void handle_chello(const Message& message, const Address& address);
 	void handle_getinfo(const Message& message, const Address& address);
 	void handle_getblock(const Message& message, const Address& address);
+	void handle_getranges(const Message& message, const Address& address);
 	void handle_cgoodbye(const Message& message, const Address& address);
+	void handle_heartbeat(const Message& message, const Address& address);
 
-    BlockSocket socket;
+    TransportFactory* transport;
+    std::tr1::shared_ptr<Transport> socket;
     unsigned int id;
+    std::string source;
     std::string path;
-    std::ifstream input;
-    std::set<HostInfo> host_info;
-    std::list<Message> message_queue;
     FileInfo file_info;
+    BlockReader repairs;
+    std::map<HostInfo, Lease> host_info;
+    TimerWheel leases;
+    uint64_t lease_timeout;
+    uint64_t deadline;
+    uint64_t session_end;
+    size_t max_hosts;
+    std::list<Message> message_queue;
+    std::list<std::pair<Address, Message> > reply_queue;
+    ExtentSet repair_queue;
+    std::deque<std::vector<unsigned int> > acknowledged;
     Logger logger;
 	std::map<unsigned int, message_handler> handlers;
+    std::string group;
+    unsigned short port;
+    unsigned int stripe_count;
+    std::vector<std::tr1::shared_ptr<Stripe> > stripes;
+    std::atomic<bool> reading;
+    std::atomic<bool> stopped;
+    std::atomic<unsigned int> active_senders;
+    bool carousel;
+    bool prioritise;
+    std::mutex wanted_mutex;
+    ExtentSet wanted;
+    std::atomic<bool> has_wanted;
+    bool relaying;
+    bool catchup_enabled;
+    std::tr1::shared_ptr<CatchupSender> catchup;
+    unsigned short catchup_port;
+    std::map<unsigned int, unsigned int> catchup_offers;
+    std::atomic<uint64_t> packets_sent;
+    std::atomic<uint64_t> repairs_sent;
+    uint64_t catchup_blocks;
+    int64_t reported_hosts;
+    int64_t reported_depth;
+    std::mutex feed_mutex;
+    std::list<Message> feed;
+    bool feed_closed;
+    uint64_t feed_drops;
+    std::mutex error_mutex;
+    std::string error;
+    unsigned long rate;
+    std::atomic<unsigned long> current_rate;
+    uint32_t worst_queueing;
+    uint64_t rate_adjusted;
 };
 
 }
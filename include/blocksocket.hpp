@@ -8,33 +8,22 @@
 #include <winsock2.h>
 #else
 #include <netinet/in.h>
+#include <sys/socket.h>
 #endif
 
 #include <vector>
+#include <atomic>
+#include <tr1/memory>
 #include "message.hpp"
 #include "logger.hpp"
+#include "impairment.hpp"
+#include "transport.hpp"
 
 namespace Msync {
 
-struct Address {
-	Address(const std::string& ip_address, unsigned short port) :
-		ip_address(ip_address),
-		port(port)
-    {
-	}
-	
-	Address() {}
-
-	std::string ip_address;
-	unsigned short port;
-};
-
-
-class BlockSocket {
+class BlockSocket : public Transport {
 public:
 
-    enum Status { READ, WRITE, BOTH, NONE };
-
     /**
      * Creates a new block socket with the given attributes.
      * @param group the multicast group address
@@ -45,13 +34,14 @@ public:
     /**
      * Closes the underlying block socket if not already closed.
      */
-    ~BlockSocket();
+    virtual ~BlockSocket();
     
     /**
-     * Binds the socket to the multicast group and port.
+     * Binds the socket to the port, and joins the group if it is a
+     * multicast address.
      * @throw string error if the operation fails
      */
-    void open();
+    virtual void open();
     
     /**
      * Waits for activity on the underlying socket.
@@ -60,7 +50,7 @@ public:
      * @throw string error of the operation fails
      * @return the status of the select call
      */
-    Status select(long timeout, bool poll_write = false);
+    virtual Status select(long timeout, bool poll_write = false);
     
     /**
      * Waits for activity on the underlying socket.  Uses the default timeout
@@ -75,31 +65,93 @@ public:
      * @param message the message to read into
      * @throw string error if the operation fails
      */
-    BlockSocket& operator>>(Message& message);
+    virtual BlockSocket& operator>>(Message& message);
     
     /**
      * Writes a message to the socket.
      * @param message the message to write
      * @throw string error if the operation fails
      */
-    BlockSocket& operator<<(const Message& message);
+    virtual BlockSocket& operator<<(const Message& message);
+    
+    /**
+     * Sends several messages to the socket.  Runs of messages of the same
+     * length, but for a shorter last one, are handed to the kernel in one
+     * call and cut into packets by the kernel or the device, if
+     * offload is enabled.
+     * @param messages the messages
+     * @param count the number of messages
+     * @throw string error if the operation fails
+     */
+    virtual void send(const Message* messages, size_t count);
 	
 	/**
 	 * Gets the last address of the socket.
 	 * @param last the last received address
 	 */
-	BlockSocket& operator>>(Address& address);
+	virtual BlockSocket& operator>>(Address& address);
 	
 	/**
 	 * Sets the destination address of the socket.
 	 * @param dest the destination
 	 */
-	BlockSocket& operator<<(const Address& address);
+	virtual BlockSocket& operator<<(const Address& address);
 
     /**
      * Closes the underlying socket.  The socket can be reponed with open().
      */
-    void close();
+    virtual void close();
+    
+    /**
+     * Allows other sockets to bind to the same port.  Must be called before
+     * open().
+     * @param reuse true to set SO_REUSEADDR and SO_REUSEPORT
+     */
+    virtual void set_reuse(bool reuse);
+    
+    /**
+     * Attaches a kernel filter so that this socket only receives the block
+     * messages whose number is index modulo count.  Non-block messages are
+     * only received by the socket with index 0.  Must be called after
+     * open().
+     * @param index the index of this socket
+     * @param count the number of sockets sharing the port
+     * @throw string if the filter can't be attached
+     */
+    virtual void set_block_filter(unsigned int index, unsigned int count);
+    
+    /**
+     * Attaches a kernel filter so that this socket only receives the given
+     * message types.  Must be called after open().
+     * @param types a mask with bit (1 << type) set for each message type to
+     * receive, or 0 to receive every type
+     * @throw string if the filter can't be attached
+     */
+    virtual void set_type_filter(unsigned int types);
+    
+    /**
+     * Attaches a kernel filter so that this socket only receives messages
+     * sent by one session.  File information from other senders is still
+     * received, so that a new session can be found.  Must be called after
+     * open().
+     * @param sender the host ID of the session's server
+     * @param peers true to also receive repair requests and blocks sent by
+     * other clients.  Their blocks are never dropped as already received,
+     * so that a client waiting to repair the same block sees them.
+     * @throw string if the filter can't be attached
+     */
+    virtual void set_session_filter(unsigned int sender, bool peers);
+    
+    /**
+     * Attaches a kernel filter that drops the blocks in a range that has
+     * already been received.  Only the low 32 bits of block numbers are
+     * checked, so the range is clipped to the first 2^32 blocks.  Must be
+     * called after open().
+     * @param start the first block to drop
+     * @param end the block after the last block to drop
+     * @throw string if the filter can't be attached
+     */
+    virtual void set_received_filter(uint64_t start, uint64_t end);
     
     /**
      * Sets the timeout length, in milliseconds.
@@ -107,14 +159,241 @@ public:
      */
     void set_timeout(long timeout);
     
-private:
+    /**
+     * Emulates the given network conditions on the traffic this socket
+     * receives.  Must be called before open().  The socket draws from its
+     * own random sequence, derived from the profile's seed, the group and
+     * port, and its index from set_block_filter().
+     * @param profile the conditions to emulate
+     */
+    void set_impairment(const ImpairmentProfile& profile);
+    
+    /**
+     * Asks the kernel for the time each sent packet is handed to the
+     * device, and records how long packets took to get there.  Must be
+     * called before open().  The times come back on the socket's error
+     * queue, which makes the socket poll as having an error, so this
+     * should only be enabled on sockets that are not read from.
+     * @param enabled true to time sent packets
+     */
+    virtual void set_send_timestamps(bool enabled);
+    
+    /**
+     * Uses UDP segmentation offload for the runs of messages passed to
+     * send(), and receive offload so that runs of packets that arrive
+     * together are read in one call and split back into messages.  The
+     * kernel's filters only see the first packet of a coalesced run, so
+     * set_received_filter() has no effect, blocks are steered by
+     * set_block_filter() a run at a time, and a dropped run is counted as
+     * one drop.  Must be called before open().  Falls back to single
+     * packets where the kernel or device can't segment.
+     * @param enabled true to use offload
+     */
+    virtual void set_offload(bool enabled);
+    
+    /**
+     * Sizes the socket's send and receive buffers to hold
+     * SOCKET_BUFFER_TIME of traffic at the given rate, and at least
+     * SOCKET_BUFFER_PACKETS packets.  Uses SO_RCVBUFFORCE and
+     * SO_SNDBUFFORCE where the process is allowed to, so that the buffers
+     * can exceed the system's limits.  Must be called before open().
+     * @param rate the expected rate in bytes per second, or 0 if unknown
+     * @param packet_size the size of a typical packet, including headers
+     */
+    virtual void set_buffer_size(unsigned long rate, unsigned int packet_size);
+    
+    /**
+     * Returns the number of packets the kernel dropped because the
+     * socket's receive buffer was full, as counted with SO_RXQ_OVFL.  The
+     * kernel also counts the packets a socket filter rejects, so drops
+     * aren't counted while a block filter is attached, and are only
+     * counted while the buffer is filling up if other filters are.
+     * @return the number of packets dropped
+     */
+    virtual uint64_t get_receive_drops() const;
+    
+    /**
+     * Returns the underlying socket.  Messages held back by an emulated
+     * network, or left from a coalesced read, don't make it readable.
+     * @return the socket, or -1 if it isn't open
+     */
+    virtual int get_descriptor();
+    
+    /**
+     * Sets the network conditions emulated by every socket created after
+     * this call, so that a whole client or server can be tested without
+     * touching the network.  Hosts in the same process that bind the same
+     * ports should be given different seeds through their factories.
+     * @param profile the conditions to emulate
+     */
+    static void set_default_impairment(const ImpairmentProfile& profile);
+    
+protected:
+#ifndef WINDOWS
+    /**
+     * Reads the ancillary data a packet was received with: the time the
+     * kernel received it, which is recorded along with how long it waited
+     * to be read, and the number of packets the kernel has dropped.
+     * @param message the message that was read, or null to only count
+     * drops
+     * @param header the header it was read with
+     */
+    void read_control(Message* message, msghdr& header);
+#endif
+    
+    /**
+     * Counts a message that has been read, and checks its length.
+     * @param message the message, with the packet at the front of its
+     * buffer
+     * @param bytes the length of the packet
+     * @throw string if the packet is empty or its length is wrong
+     */
+    void finish_read(Message& message, int bytes);
+    
     int sock;
-    sockaddr_in group;
     sockaddr_in from;
+    Logger& logger;
+    ImpairmentProfile impairment_profile;
+    bool coalescing;
+    size_t segment_size;
+
+private:
+    /**
+     * Moves the packets waiting in the kernel into the impairment.
+     * @throw string if the operation fails
+     */
+    void drain_impaired();
+    
+    /**
+     * Reads the transmit times waiting on the error queue and records how
+     * long after being sent each packet was transmitted.
+     */
+    void read_send_timestamps();
+    
+    /**
+     * Sends a run of messages in one call, to be cut into packets by the
+     * kernel.
+     * @param messages the messages
+     * @param count the number of messages, at most SEGMENT_LIMIT
+     * @param size the length of each packet but the last
+     * @param total the length of the run
+     * @return false if the kernel can't segment, in which case nothing
+     * was sent and segmentation is turned off
+     * @throw string if the send fails for another reason
+     */
+    bool send_segments(const Message* messages, size_t count, size_t size, size_t total);
+    
+    /**
+     * Keeps the time a packet was sent until the kernel reports when it
+     * was transmitted.
+     * @param sent the time the packet was sent, or 0 if not timed
+     */
+    void stamp_sent(uint64_t sent);
+    
+    /**
+     * Reads the next message from a coalesced run of packets, reading a
+     * new run once the last has been used up.  Every message of a run
+     * gets the time the run arrived.
+     * @param message the message to read into
+     * @return the length of the message, or the result of the failed read
+     */
+    int read_coalesced(Message& message);
+    
+    /**
+     * Sets the size of one of the socket's buffers, forcing it past the
+     * system's limit if allowed.
+     * @param option the option that sets the size
+     * @param force the option that sets the size past the limit, or 0
+     * @param bytes the size wanted
+     * @param name the name of the buffer to log
+     */
+    void size_buffer(int option, int force, uint64_t bytes, const char* name);
+    
+    /**
+     * Returns true if the socket's receive buffer is at least half full,
+     * or if that can't be told.
+     * @return true if the buffer is filling up
+     */
+    bool receive_buffer_full();
+    
+    /**
+     * Starts emulating the impairment profile, if it is enabled, with a
+     * seed that identifies this socket.
+     */
+    void impair();
+    
+
+    /**
+     * Compiles the filter settings into a socket filter and attaches it,
+     * replacing any filter already attached.
+     * @throw string if the filter can't be attached
+     */
+    void attach_filter();
+
+    sockaddr_in group;
 	sockaddr_in to;
     long timeout;
-    Logger& logger;
 	unsigned short port;
+    bool reuse;
+    unsigned int filter_index;
+    unsigned int filter_count;
+    unsigned int filter_types;
+    unsigned int filter_sender;
+    bool has_filter_sender;
+    bool filter_peers;
+    uint32_t received_start;
+    uint32_t received_end;
+    std::tr1::shared_ptr<Impairment> impairment;
+    std::vector<char> impaired_buffer;
+    bool send_timestamps;
+    std::vector<uint64_t> send_stamps;
+    uint32_t send_count;
+    uint64_t last_arrival;
+    unsigned long buffer_rate;
+    unsigned int buffer_packet_size;
+    uint32_t drop_counter;
+    std::atomic<uint64_t> receive_drops;
+    bool offload;
+    bool segmenting;
+    std::vector<char> coalesced_buffer;
+    size_t segment_offset;
+    size_t segment_end;
+    uint64_t segment_stamp;
+    static ImpairmentProfile default_impairment;
+};
+
+/**
+ * Creates block sockets, and follows the system's steady clock.
+ */
+class BlockSocketFactory : public TransportFactory {
+public:
+    BlockSocketFactory();
+    
+    virtual Transport* create(const std::string& group, unsigned short port, Logger& logger);
+    virtual Clock::time_point now();
+    virtual void sleep_until(Clock::time_point when);
+    
+    /**
+     * Emulates the given network conditions on the sockets this factory
+     * creates, instead of the default ones.  Giving each host in a process
+     * its own seed keeps their losses independent.
+     * @param profile the conditions to emulate
+     */
+    void set_impairment(const ImpairmentProfile& profile);
+
+    static BlockSocketFactory Default;
+
+protected:
+    /**
+     * Applies the factory's settings to a socket it has created.
+     * @param socket the new socket
+     * @return the socket
+     */
+    BlockSocket* prepare(BlockSocket* socket);
+
+private:
+    ImpairmentProfile impairment;
+    bool impaired;
 };
 
 }
@@ -0,0 +1,39 @@
+#ifndef BYTEORDER_HPP
+#define BYTEORDER_HPP
+
+#ifdef WINDOWS
+#include <winsock2.h>
+#else
+#include <netinet/in.h>
+#endif
+
+#include <stdint.h>
+
+namespace Msync {
+
+/**
+ * Converts a 64-bit value from host to network byte order.
+ * @param value the value in host byte order
+ * @return the value in network byte order
+ */
+inline uint64_t hton64(uint64_t value)
+{
+    if (htonl(1) == 1) {
+        return value;
+    }
+    return ((uint64_t)htonl((uint32_t)value) << 32) | htonl((uint32_t)(value >> 32));
+}
+
+/**
+ * Converts a 64-bit value from network to host byte order.
+ * @param value the value in network byte order
+ * @return the value in host byte order
+ */
+inline uint64_t ntoh64(uint64_t value)
+{
+    return hton64(value);
+}
+
+}
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef CATCHUPRECEIVER_HPP
+#define CATCHUPRECEIVER_HPP
+
+#include "catchupsender.hpp"
+#include "syncstatus.hpp"
+#include "logger.hpp"
+#include <string>
+#include <vector>
+
+namespace Msync {
+
+/**
+ * Fetches a file's missing blocks from a CatchupSender over TCP, writing
+ * them straight into the file being synced.
+ */
+class CatchupReceiver {
+public:
+
+    /**
+     * Connects to a catch-up sender.
+     * @param host the server's address
+     * @param port the port it offered
+     * @param id this client's host ID, which the offer was made to
+     * @param logger the logger to use
+     * @throw string if the connection fails
+     */
+    CatchupReceiver(const std::string& host, unsigned short port, unsigned int id, Logger& logger = Logger::Default);
+    
+    /**
+     * Closes the connection.
+     */
+    ~CatchupReceiver();
+    
+    /**
+     * Asks for every block that is still missing and writes the blocks as
+     * they arrive.
+     * @param status the status of the file
+     * @return the number of blocks received
+     * @throw string if the stream fails
+     */
+    uint64_t receive(SyncStatus& status);
+
+private:
+    CatchupReceiver(const CatchupReceiver&);
+    CatchupReceiver& operator=(const CatchupReceiver&);
+
+    /**
+     * Reads exactly the given number of bytes.
+     * @param data the buffer to read into
+     * @param length the number of bytes
+     * @throw string if the connection fails or closes early
+     */
+    void read_fully(char* data, size_t length);
+    
+    /**
+     * Writes exactly the given number of bytes.
+     * @param data the buffer to write
+     * @param length the number of bytes
+     * @throw string if the connection fails
+     */
+    void write_fully(const char* data, size_t length);
+
+    int sock;
+    unsigned int id;
+    Logger& logger;
+};
+
+}
+
+#endif
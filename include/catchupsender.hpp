@@ -0,0 +1,163 @@
+#ifndef CATCHUPSENDER_HPP
+#define CATCHUPSENDER_HPP
+
+#include "fileinfo.hpp"
+#include "extent.hpp"
+#include "logger.hpp"
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <set>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+
+#ifdef WINDOWS
+#include <winsock2.h>
+#else
+#include <netinet/in.h>
+#endif
+
+// Maximum number of ranges a client may ask for in one catch-up stream
+#define CATCHUP_MAX_RANGES 1048576
+
+// Time a catch-up connection may stall before it is dropped, in seconds
+#define CATCHUP_TIMEOUT 10
+
+namespace Msync {
+
+/**
+ * Metadata of a catch-up offer: the TCP port the client should connect to
+ * for its missing blocks.
+ */
+struct CatchupInfo {
+    CatchupInfo(const FileInfo& info, unsigned short port) :
+        file_info(info),
+        port(htonl(port))
+    {
+    }
+    
+    unsigned short get_port() const { return (unsigned short)ntohl(port); }
+
+    FileInfo file_info;
+    uint32_t port;
+};
+
+/**
+ * Header of each range in a catch-up stream, followed by length bytes of
+ * the file starting at block start.  The length is shorter than count
+ * blocks only at the end of the file.
+ */
+struct CatchupRange {
+    CatchupRange(uint64_t start, uint64_t count, uint64_t length);
+    
+    uint64_t get_start() const;
+    uint64_t get_count() const;
+    uint64_t get_length() const;
+
+    uint64_t start;
+    uint64_t count;
+    uint64_t length;
+};
+
+/**
+ * Serves a file's missing blocks to straggling clients over TCP.  A client
+ * that has been offered a stream connects, sends its host ID and the
+ * number of ranges it wants followed by the ranges as extents, and receives
+ * each range as a CatchupRange header followed by the data, sent straight
+ * from the file with sendfile() where available.  Each connection is served
+ * by its own thread.
+ */
+class CatchupSender {
+public:
+
+    /**
+     * Creates a new sender for the given file.
+     * @param source the path to the file to serve
+     * @param logger the logger to use
+     */
+    CatchupSender(const std::string& source, Logger& logger = Logger::Default);
+    
+    /**
+     * Stops accepting connections and waits for the open ones to finish.
+     */
+    ~CatchupSender();
+    
+    /**
+     * Starts listening on an ephemeral port and accepting connections.
+     * @return the port number
+     * @throw string if the socket can't be opened
+     */
+    unsigned short start();
+    
+    /**
+     * Lets a client connect once.  Connections from hosts that haven't
+     * been offered a stream are closed straight away.
+     * @param id the client's host ID
+     * @param host the client's IP address
+     */
+    void offer(unsigned int id, const std::string& host);
+    
+    /**
+     * Determines whether a client has connected for the stream it was
+     * offered.
+     * @param id the client's host ID
+     * @return true if the client has connected
+     */
+    bool connected(unsigned int id);
+    
+    /**
+     * Returns the number of blocks sent on the streams that have finished.
+     * @return the block count
+     */
+    uint64_t get_blocks_sent() const;
+
+private:
+    CatchupSender(const CatchupSender&);
+    CatchupSender& operator=(const CatchupSender&);
+
+    /**
+     * Accept thread: accepts connections until the sender is destroyed.
+     */
+    void accept_connections();
+    
+    /**
+     * Joins the connection threads that have finished.
+     */
+    void join_finished();
+    
+    /**
+     * Connection thread: reads a client's ranges and sends them.
+     * @param sock the connected socket
+     * @param host the client's IP address
+     */
+    void serve(int sock, std::string host);
+    
+    /**
+     * Sends part of the file to a socket.
+     * @param sock the socket
+     * @param file the file descriptor
+     * @param offset the offset in the file
+     * @param length the number of bytes to send
+     * @throw string if the operation fails
+     */
+    void send_file(int sock, int file, uint64_t offset, uint64_t length);
+
+    std::string source;
+    Logger& logger;
+    int listener;
+    std::atomic<bool> stopped;
+    std::thread acceptor;
+    std::mutex mutex;
+    std::list<std::thread> connections;
+    std::set<std::thread::id> finished;
+    std::map<unsigned int, std::string> offers;
+    std::set<unsigned int> connected_hosts;
+    std::atomic<uint64_t> blocks_sent;
+};
+
+}
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef ERROR_HPP
+#define ERROR_HPP
+
+namespace Msync {
+
+/**
+ * The errors returned by the calls that don't throw, such as those that
+ * drive a BlockClient from another program's event loop.  A description
+ * of the last error is kept alongside the code.
+ */
+enum Error {
+    ERROR_NONE,
+    
+    // The call was made before the object was opened, or after it failed
+    ERROR_STATE,
+    
+    // The transport has no descriptor that can be polled
+    ERROR_UNSUPPORTED,
+    
+    // A socket couldn't be opened, read or written
+    ERROR_NETWORK,
+    
+    // A message couldn't be handled, such as when a block can't be
+    // written to its file
+    ERROR_TRANSFER
+};
+
+}
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef EXTENT_HPP
+#define EXTENT_HPP
+
+#include "byteorder.hpp"
+
+namespace Msync {
+
+/**
+ * A run of consecutive blocks, stored in network byte order so that arrays
+ * of extents can be sent as the body of a message.
+ */
+struct Extent {
+
+    /**
+     * Creates a new extent.
+     * @param start the first block in the run
+     * @param count the number of blocks in the run
+     */
+    Extent(uint64_t start = 0, uint64_t count = 0) :
+        start(hton64(start)),
+        count(hton64(count))
+    {
+    }
+
+    /**
+     * Returns the first block in the run.
+     * @return the first block
+     */
+    uint64_t get_start() const { return ntoh64(start); }
+
+    /**
+     * Returns the number of blocks in the run.
+     * @return the block count
+     */
+    uint64_t get_count() const { return ntoh64(count); }
+
+    uint64_t start;
+    uint64_t count;
+};
+
+}
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef EXTENTSET_HPP
+#define EXTENTSET_HPP
+
+#include <map>
+#include <cstddef>
+#include <stdint.h>
+
+namespace Msync {
+
+/**
+ * Set of blocks kept as disjoint runs.  Runs that overlap or touch are
+ * merged as they are added, so asking for the same blocks again doesn't
+ * grow the set, and each block is taken from it at most once.
+ */
+class ExtentSet {
+public:
+
+    /**
+     * Creates an empty set.
+     */
+    ExtentSet();
+
+    /**
+     * Adds a run of blocks, merging it with the runs it overlaps or
+     * touches.
+     * @param start the first block
+     * @param count the number of blocks
+     */
+    void add(uint64_t start, uint64_t count);
+
+    /**
+     * Removes the lowest block from the set.
+     * @param block receives the removed block
+     * @return false if the set is empty
+     */
+    bool pop(uint64_t& block);
+
+    /**
+     * Returns true if the set is empty.
+     * @return true if there are no blocks
+     */
+    bool empty() const;
+
+    /**
+     * Returns the number of runs in the set.
+     * @return the number of runs
+     */
+    size_t size() const;
+
+    /**
+     * Returns the number of blocks in the set.
+     * @return the number of blocks
+     */
+    uint64_t blocks() const;
+
+    /**
+     * Removes every block.
+     */
+    void clear();
+
+private:
+    // End of each run, one past its last block, keyed by its first block
+    std::map<uint64_t, uint64_t> runs;
+    uint64_t total;
+};
+
+}
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef FILEINFO_HPP
 #define FILEINFO_HPP
 
+#include "byteorder.hpp"
 #include <string>
 
 namespace Msync {
@@ -32,7 +33,7 @@ public:
      * Returns the number of blocks in the file.
      * @return the number of blocks
      */
-    unsigned int get_block_count() const;
+    uint64_t get_block_count() const;
     
     /**
      * Returns a pointer to the digest.
@@ -43,7 +44,7 @@ public:
 
 private:
     char digest[33];
-    unsigned int num_blocks;
+    uint64_t num_blocks;
 };
 
 }
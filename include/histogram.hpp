@@ -0,0 +1,102 @@
+#ifndef HISTOGRAM_HPP
+#define HISTOGRAM_HPP
+
+#include <atomic>
+#include <stdint.h>
+
+// Number of bits of each value that are kept; values are recorded to
+// within one part in 2^HISTOGRAM_PRECISION, about 3%
+#define HISTOGRAM_PRECISION 5
+
+// Values of 2^HISTOGRAM_RANGE and over are counted in the top bucket
+#define HISTOGRAM_RANGE 40
+
+namespace Msync {
+
+/**
+ * A histogram with buckets spaced logarithmically, in the manner of an HDR
+ * histogram: every value from zero to 2^HISTOGRAM_RANGE is recorded with
+ * the same relative precision, so the tail is as accurate as the median.
+ * Only one thread may record into a histogram, without locking or atomic
+ * read-modify-write instructions; other threads may read it at any time.
+ * Threads that record the same latency keep one histogram each and merge
+ * them when they are read.
+ */
+class Histogram {
+public:
+
+    /**
+     * Creates a new, empty histogram.
+     */
+    Histogram();
+
+    /**
+     * Records a value.
+     * @param value the value
+     */
+    void record(uint64_t value);
+
+    /**
+     * Adds the values recorded in another histogram, from the thread that
+     * records into this one.
+     * @param other the histogram to add
+     */
+    void merge(const Histogram& other);
+
+    /**
+     * Returns the number of values recorded.
+     * @return the count
+     */
+    uint64_t get_count() const;
+
+    /**
+     * Returns the sum of the values recorded.
+     * @return the sum
+     */
+    uint64_t get_sum() const;
+
+    /**
+     * Returns the largest value recorded.
+     * @return the maximum, or 0 if nothing was recorded
+     */
+    uint64_t get_max() const;
+
+    /**
+     * Returns a value that the given fraction of the recorded values are
+     * less than or equal to.  The value is the top of its bucket, so it
+     * is never an underestimate.
+     * @param quantile the fraction, from 0 to 1
+     * @return the value, or 0 if nothing was recorded
+     */
+    uint64_t get_quantile(double quantile) const;
+
+private:
+    Histogram(const Histogram&);
+    Histogram& operator=(const Histogram&);
+
+    static const unsigned int SUB_BUCKETS = 1U << HISTOGRAM_PRECISION;
+    static const unsigned int BUCKETS = SUB_BUCKETS * (HISTOGRAM_RANGE - HISTOGRAM_PRECISION + 1);
+
+    /**
+     * Returns the bucket a value is counted in.
+     * @param value the value
+     * @return the bucket index
+     */
+    static unsigned int index(uint64_t value);
+
+    /**
+     * Returns the largest value counted in a bucket.
+     * @param index the bucket index
+     * @return the value
+     */
+    static uint64_t highest(unsigned int index);
+
+    std::atomic<uint64_t> counts[BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+};
+
+}
+
+#endif
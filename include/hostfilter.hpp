@@ -0,0 +1,91 @@
+#ifndef HOSTFILTER_HPP
+#define HOSTFILTER_HPP
+
+#include "fileinfo.hpp"
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+// Size of one filter segment; each segment is sent in its own message
+#define FILTER_SEGMENT_BYTES 512
+
+// Filter bits per host; with 7 probes this gives about 1% false positives
+#define FILTER_BITS_PER_HOST 10
+#define FILTER_PROBES 7
+
+namespace Msync {
+
+/**
+ * Metadata of a server goodbye carrying one segment of a host filter.
+ */
+struct GoodbyeInfo {
+    GoodbyeInfo(const FileInfo& info, uint32_t segment, uint32_t segments) :
+        file_info(info),
+        segment(htonl(segment)),
+        segments(htonl(segments))
+    {
+    }
+
+    FileInfo file_info;
+    uint32_t segment;
+    uint32_t segments;
+};
+
+/**
+ * Blocked Bloom filter of host IDs, used to acknowledge many clients in a
+ * few packets.  Each host hashes to one fixed-size segment and all of its
+ * bits are in that segment, so a client only needs the one packet that
+ * carries its segment to see whether it is in the set.
+ */
+class HostFilter {
+public:
+
+    /**
+     * Creates an empty filter sized for the given number of hosts.
+     * @param hosts the expected number of hosts
+     */
+    HostFilter(size_t hosts);
+
+    /**
+     * Adds a host to the filter.
+     * @param id the host ID
+     */
+    void insert(unsigned int id);
+
+    /**
+     * Returns the number of segments in the filter.
+     * @return the segment count
+     */
+    uint32_t get_segment_count() const;
+
+    /**
+     * Returns the bits of one segment.
+     * @param segment the segment index
+     * @return FILTER_SEGMENT_BYTES bytes of filter bits
+     */
+    const char* get_segment(uint32_t segment) const;
+
+    /**
+     * Returns the segment a host hashes to.
+     * @param id the host ID
+     * @param segments the number of segments in the filter
+     * @return the segment index
+     */
+    static uint32_t segment_of(unsigned int id, uint32_t segments);
+
+    /**
+     * Checks whether a host may be in the filter, given the segment it
+     * hashes to.  False positives are possible; false negatives are not.
+     * @param bits the bits of the host's segment
+     * @param id the host ID
+     * @return true if the host is probably in the filter
+     */
+    static bool segment_contains(const char* bits, unsigned int id);
+
+private:
+    std::vector<char> bits;
+};
+
+}
+
+#endif
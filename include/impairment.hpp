@@ -0,0 +1,148 @@
+#ifndef IMPAIRMENT_HPP
+#define IMPAIRMENT_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <random>
+#include <stdint.h>
+
+#ifdef WINDOWS
+#include <winsock2.h>
+#else
+#include <netinet/in.h>
+#endif
+
+// Default time a packet chosen for reordering is held back, in milliseconds
+#define REORDER_DELAY 10
+
+// Maximum time a packet may wait for the emulated link when a bandwidth
+// cap is set; packets that would wait longer are dropped, in milliseconds
+#define IMPAIRMENT_BACKLOG 1000
+
+namespace Msync {
+
+/**
+ * Describes the network conditions to emulate on received traffic.  Every
+ * probability is between 0 and 1.
+ */
+struct ImpairmentProfile {
+    ImpairmentProfile();
+
+    /**
+     * Parses a profile from a comma-separated list of settings:
+     *
+     *   loss=P            drop each packet with probability P
+     *   burst=P:R[:H[:K]] Gilbert-Elliott loss: move from the good state
+     *                     to the bad state with probability P and back
+     *                     with probability R, dropping packets with
+     *                     probability H in the bad state (default 1) and
+     *                     K in the good state (default 0)
+     *   reorder=P[:MS]    hold a packet back MS milliseconds (default
+     *                     REORDER_DELAY) with probability P
+     *   dup=P             deliver a packet twice with probability P
+     *   delay=MS[:JITTER] delay every packet by MS plus or minus up to
+     *                     JITTER milliseconds
+     *   rate=BYTES        limit the link to BYTES per second, with an
+     *                     optional K, M or G suffix
+     *   seed=N            seed for the random number generators
+     *
+     * Probabilities may also be written as percentages, such as 1%.
+     * @param spec the settings
+     * @return the profile
+     * @throw string if the settings can't be parsed
+     */
+    static ImpairmentProfile parse(const std::string& spec);
+
+    /**
+     * Returns true if the profile changes the traffic at all.
+     * @return true if any impairment is set
+     */
+    bool enabled() const;
+
+    double loss;
+    double burst_enter;
+    double burst_leave;
+    double burst_loss;
+    double good_loss;
+    double reorder;
+    unsigned long reorder_delay;
+    double duplicate;
+    unsigned long delay;
+    unsigned long jitter;
+    uint64_t rate;
+    unsigned int seed;
+    std::string spec;
+};
+
+/**
+ * Applies an impairment profile to the packets received on one socket.
+ * Packets go in as they arrive and come out when they are due, which may
+ * be never, twice, or in a different order.  The same seed always gives
+ * the same decisions for the same sequence of packets.
+ */
+class Impairment {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    /**
+     * Creates a new impairment.
+     * @param profile the conditions to emulate
+     * @param seed the seed for this socket's random number generator
+     */
+    Impairment(const ImpairmentProfile& profile, unsigned int seed);
+
+    /**
+     * Passes a received packet through the emulated network.
+     * @param data the packet
+     * @param length the length of the packet
+     * @param from the sender's address
+     * @param now the time the packet arrived
+     */
+    void push(const char* data, size_t length, const sockaddr_in& from, Clock::time_point now);
+
+    /**
+     * Removes the next packet that is due.
+     * @param data receives the packet
+     * @param from receives the sender's address
+     * @param now the current time
+     * @return false if no packet is due
+     */
+    bool pop(std::vector<char>& data, sockaddr_in& from, Clock::time_point now);
+
+    /**
+     * Returns the time until the next packet is due.
+     * @param now the current time
+     * @return the time in milliseconds, rounded up, 0 if a packet is due,
+     * or -1 if no packets are waiting
+     */
+    long next_due(Clock::time_point now) const;
+
+private:
+    struct Packet {
+        std::vector<char> data;
+        sockaddr_in from;
+    };
+
+    /**
+     * Returns true with the given probability.
+     */
+    bool chance(double probability);
+
+    /**
+     * Decides whether the next packet is lost, advancing the burst loss
+     * state.
+     */
+    bool lost();
+
+    ImpairmentProfile profile;
+    std::minstd_rand random;
+    bool bad_state;
+    Clock::time_point link_free;
+    std::multimap<Clock::time_point, Packet> pending;
+};
+
+}
+
+#endif
@@ -2,56 +2,179 @@
 #define LOGGER_HPP
 
 #include <iostream>
+#include <atomic>
+#include <stdint.h>
+
+// Messages below this level are compiled out: 0 keeps every level, 1 drops
+// FINEST, 2 drops FINE as well, and so on
+#ifndef MSYNC_LOG_LEVEL
+#define MSYNC_LOG_LEVEL 0
+#endif
+
+// Maximum number of messages a second logged from one rate-limited
+// statement
+#define LOG_RATE_LIMIT 10
+
+/**
+ * Starts a log message at the given level, such as
+ * MSYNC_LOG(logger, INFO) << "Received " << count << " blocks\n".  If the
+ * level is compiled out or below the logger's level, the rest of the
+ * statement isn't evaluated.
+ */
+#define MSYNC_LOG(logger, level) \
+    if (Msync::Logger::level < MSYNC_LOG_LEVEL || !(logger).enabled(Msync::Logger::level)) ; \
+    else (logger) << Msync::Logger::level
+
+/**
+ * Starts a log message, as MSYNC_LOG() does, for statements that can run
+ * for every packet.  At most LOG_RATE_LIMIT messages a second are logged
+ * from the statement; the first message after others were dropped says
+ * how many.
+ */
+#define MSYNC_LOG_LIMITED(logger, level) \
+    if (Msync::Logger::level < MSYNC_LOG_LEVEL || !(logger).enabled(Msync::Logger::level) || \
+        !Msync::log_limiter<__LINE__>().allow()) ; \
+    else (logger) << Msync::Logger::level << Msync::log_limiter<__LINE__>()
 
 namespace Msync {
 
+/**
+ * Limits the rate of the messages from one statement.
+ */
+class LogLimiter {
+public:
+    LogLimiter();
+
+    /**
+     * Returns true if another message can be logged this second.
+     * @return true to log the message
+     */
+    bool allow();
+
+    /**
+     * Returns the number of messages dropped since the last one that was
+     * logged, and resets it.
+     * @return the number of messages dropped
+     */
+    uint64_t take_dropped();
+
+private:
+    std::atomic<uint64_t> second;
+    std::atomic<unsigned int> count;
+    std::atomic<uint64_t> dropped;
+};
+
+namespace {
+
+/**
+ * Returns the limiter of one rate-limited statement.
+ */
+template <int line>
+LogLimiter& log_limiter()
+{
+    static LogLimiter limiter;
+    return limiter;
+}
+
+}
+
+/**
+ * Writes log messages to an output stream.  Messages are formatted into a
+ * buffer belonging to the calling thread, and handed to a background
+ * thread through a bounded, lock-free queue, so logging never waits for
+ * the stream.  If the queue is full the message is dropped, and the
+ * writer reports how many were dropped.  Messages longer than
+ * LOG_RECORD_SIZE are truncated.
+ */
 class Logger {
 public:
 
-    enum Level { FINEST, FINE, INFO, WARNING, ERR }; 
+    enum Level { FINEST, FINE, INFO, WARNING, ERR };
+
+    /**
+     * A message being formatted.  The message is queued when the record is
+     * destroyed, at the end of the statement that logged it.
+     */
+    class Record {
+    public:
+        Record(const Logger& logger, Level level);
+        Record(const Record& other);
+        ~Record();
+
+        template <typename T>
+        Record& operator<<(const T& object);
+
+        /**
+         * Notes how many messages the statement's limiter dropped, if any.
+         * @param limiter the limiter
+         */
+        Record& operator<<(LogLimiter& limiter);
+
+    private:
+        Record& operator=(const Record&);
+
+        /**
+         * Returns the calling thread's format buffer.
+         * @return the stream to format into
+         */
+        static std::ostream& stream();
+
+        const Logger* logger;
+        Level level;
+        uint64_t time;
+        mutable bool active;
+    };
 
     /**
      * Creates a new logger with the given output stream.
      * @param output the output stream
      */
     Logger(std::ostream& output);
-    
-    /**
-     * Logs a message to the output stream.
-     * @param message the message to log
-     */
-    template <typename T>
-    Logger& operator<<(const T object);
-    
+
     /**
-     * Changes the log level of messages written to the output stream.
+     * Starts a message at the given level.  Use MSYNC_LOG() rather than
+     * calling this directly, so that the message isn't formatted if the
+     * level is disabled.
      * @param level the log level
+     * @return the message
      */
-    Logger& operator<<(const Level& level);
-    
-    
+    Record operator<<(const Level& level) const;
+
     /**
      * Sets the level of the logger.  All messages below the given level will
      * be discarded.
      * @param level the log level
      */
     void set_level(const Level& level);
-    
+
+    /**
+     * Returns true if messages at the given level are written.
+     * @param level the log level
+     * @return true if the level is enabled
+     */
+    bool enabled(Level level) const
+    {
+        return level >= output_level;
+    }
+
+    /**
+     * Waits until every message queued so far has been written.
+     */
+    static void flush();
+
     static Logger Default;
-    
+
 private:
-    std::ostream& output; 
+    std::ostream* output;
     Level output_level;
-    Level message_level;  
 };
 
 
 template <typename T>
-Logger& Logger::operator<<(const T object)
+Logger::Record& Logger::Record::operator<<(const T& object)
 {
-    if (message_level >= output_level) {
-        output << object;
-        output.flush();
+    if (active) {
+        stream() << object;
     }
     return *this;
 }
@@ -0,0 +1,121 @@
+#ifndef LOGWRITER_HPP
+#define LOGWRITER_HPP
+
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstddef>
+#include <stdint.h>
+
+// Maximum length of a log message, including the newline
+#define LOG_RECORD_SIZE 512
+
+// Number of messages that can wait to be written; more are dropped
+#define LOG_QUEUE_SIZE 2048
+
+namespace Msync {
+
+/**
+ * The background thread that writes log messages.  Loggers hand messages
+ * over through a bounded queue of preallocated slots, which any number of
+ * threads can add to without locking; the queue takes
+ * LOG_QUEUE_SIZE * LOG_RECORD_SIZE bytes however much is logged.  The
+ * writer sleeps while the queue is empty, and a message only takes the
+ * lock to wake it.  The thread is started by the first message, and again
+ * in the child after a fork, with the queue emptied.
+ */
+class LogWriter {
+public:
+
+    /**
+     * Queues a message.
+     * @param output the stream to write to
+     * @param level the log level
+     * @param time the time the message was logged, in microseconds since
+     * the epoch
+     * @param text the message
+     * @param length the length of the message
+     * @return false if the queue was full and the message was dropped
+     */
+    static bool push(std::ostream* output, int level, uint64_t time, const char* text, size_t length);
+
+    /**
+     * Waits until every message queued so far has been written.
+     */
+    static void flush();
+
+private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        std::ostream* output;
+        int level;
+        uint64_t time;
+        size_t length;
+        char text[LOG_RECORD_SIZE];
+    };
+
+    /**
+     * Starts the writer thread if it isn't running in this process.
+     */
+    static void start();
+
+    /**
+     * Registers the fork handlers when the library is loaded, so that a
+     * fork can't come between a thread taking the lock in start() and the
+     * handlers being registered.
+     * @return true
+     */
+    static bool add_fork_handlers();
+
+    /**
+     * Takes the lock before a fork, so that the child doesn't inherit it
+     * held by a thread it won't have.
+     */
+    static void forking();
+
+    /**
+     * Releases the lock in the parent after a fork.
+     */
+    static void resumed();
+
+    /**
+     * Forgets the writer thread in the child of a fork, which doesn't
+     * inherit it, and empties the queue, whose messages are the parent's
+     * to write.
+     */
+    static void forked();
+
+    /**
+     * Writer thread.
+     */
+    static void run();
+
+    /**
+     * Returns true if the message at the front of the queue can be
+     * written.  Only called from the writer thread.
+     * @return true if there is a message to write
+     */
+    static bool ready();
+
+    /**
+     * Writes the messages at the front of the queue.
+     * @return the number of messages written
+     */
+    static size_t drain();
+
+    static Slot slots[LOG_QUEUE_SIZE];
+    static std::atomic<size_t> head;
+    static std::atomic<size_t> tail;
+    static std::atomic<uint64_t> dropped;
+    static std::atomic<bool> running;
+    static std::atomic<bool> sleeping;
+    static std::mutex mutex;
+    static std::condition_variable* wakeup;
+    static bool fork_handlers;
+};
+
+}
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef MEMORYBUS_HPP
+#define MEMORYBUS_HPP
+
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <stdint.h>
+#include "transport.hpp"
+
+// Wakeups within this many milliseconds of the earliest one are merged into
+// a single jump of the virtual clock, so that thousands of staggered timers
+// don't each need their own jump
+#define BUS_TIMER_SLACK 10
+
+// First port handed out to transports that bind to port 0
+#define BUS_EPHEMERAL_PORT 32768
+
+namespace Msync {
+
+class MemoryTransport;
+
+/**
+ * An in-memory network for simulating a whole fleet in one process.  Each
+ * transport created by the bus is given its own host address; messages
+ * sent to a multicast group are delivered to every transport that joined
+ * it, and other messages to the transport bound to the address.  Messages
+ * arrive after a fixed latency.
+ *
+ * With a virtual clock, time stands still while anything is happening on
+ * the bus, and only jumps to the next timer once every attached thread is
+ * waiting on the bus and no message is left to read, so that heartbeats,
+ * goodbye rounds and leases cost no real time.  Work done between bus calls
+ * is treated as instantaneous.  Threads are attached with
+ * TransportFactory::attach_thread(); BlockServer and BlockClient attach
+ * their own, and a thread driving clients with BlockClient::step() attaches
+ * itself.  When every client is stepped from one thread, the clock no
+ * longer depends on how the threads are scheduled.
+ */
+class MemoryBus : public TransportFactory {
+public:
+
+    /**
+     * Creates a new bus.
+     * @param latency the delay before each message arrives, in
+     * milliseconds
+     * @param virtual_time true to skip ahead while every user is waiting
+     */
+    MemoryBus(unsigned long latency = 0, bool virtual_time = true);
+
+    virtual Transport* create(const std::string& group, unsigned short port, Logger& logger);
+    virtual Clock::time_point now();
+    virtual void sleep_until(Clock::time_point when);
+    virtual void attach_thread();
+    virtual void detach_thread();
+
+    /**
+     * Waits until a message has been delivered to any transport on the
+     * bus, or the given time, for a thread that drives several clients
+     * with step() and can't wait on their descriptors.
+     * @param seen the number of deliveries the caller has already seen;
+     * updated to the current number on return
+     * @param when the time to wait until
+     */
+    void wait_for_delivery(uint64_t& seen, Clock::time_point when);
+
+    /**
+     * Returns the number of messages of one type sent on the bus.
+     * @param type the message type
+     * @return the message count
+     */
+    uint64_t get_messages_sent(unsigned int type);
+
+    /**
+     * Returns the number of copies of messages delivered to transports,
+     * after filtering.
+     * @return the delivery count
+     */
+    uint64_t get_deliveries();
+
+    /**
+     * Returns the number of bytes sent on the bus.
+     * @return the byte count
+     */
+    uint64_t get_bytes_sent();
+
+private:
+    friend class MemoryTransport;
+    typedef std::pair<uint32_t, unsigned short> Key;
+
+    /**
+     * Attaches a transport to the bus.  Called with the lock held.
+     * @param transport the transport
+     * @param group the group to join, or 0 for none
+     * @param port the port to bind, or 0 for an ephemeral port
+     */
+    void attach(MemoryTransport* transport, uint32_t group, unsigned short port);
+
+    /**
+     * Detaches a transport from the bus.  Called with the lock held.
+     * @param transport the transport
+     */
+    void detach(MemoryTransport* transport);
+
+    /**
+     * Delivers a message.
+     * @param from the sending transport
+     * @param to the destination address
+     * @param data the message
+     */
+    void send(MemoryTransport* from, const Key& to, const std::vector<char>& data);
+
+    /**
+     * Waits with the lock held until the condition is signalled or the
+     * given virtual time passes.
+     * @param lock the bus lock
+     * @param condition the condition to wait on
+     * @param when the time to wait until, or the epoch to wait forever
+     */
+    void wait(std::unique_lock<std::mutex>& lock, std::condition_variable& condition, Clock::time_point when);
+
+    /**
+     * Moves the virtual clock to the next timer if every attached thread
+     * is waiting and no message is left to read.  Called with the lock
+     * held.
+     * @return true if the clock moved
+     */
+    bool advance();
+
+    /**
+     * Wakes every waiting user so that it sees the new time.  Called with
+     * the lock held.
+     */
+    void wake_all();
+
+    std::mutex mutex;
+    std::condition_variable sleepers;
+    std::condition_variable delivered;
+    std::multimap<Key, MemoryTransport*> groups;
+    std::map<Key, MemoryTransport*> hosts;
+    std::set<MemoryTransport*> transports;
+    std::multiset<Clock::time_point> timers;
+    std::map<std::thread::id, unsigned int> members;
+    Clock::duration latency;
+    Clock::time_point epoch;
+    std::atomic<int64_t> elapsed;
+    bool virtual_time;
+    size_t waiting;
+    uint64_t generation;
+    uint32_t next_host;
+    unsigned short next_port;
+    uint64_t queued;
+    std::vector<uint64_t> sent;
+    uint64_t deliveries;
+    uint64_t bytes;
+};
+
+}
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef MEMORYTRANSPORT_HPP
+#define MEMORYTRANSPORT_HPP
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <condition_variable>
+#include <tr1/memory>
+#include "transport.hpp"
+#include "memorybus.hpp"
+
+namespace Msync {
+
+/**
+ * A transport on a MemoryBus.  The kernel filters of BlockSocket are
+ * applied in software when a message is delivered, so that a simulated
+ * client sees the same traffic as a real one.
+ */
+class MemoryTransport : public Transport {
+public:
+
+    /**
+     * Creates a new transport on a bus.
+     * @param bus the bus
+     * @param group the multicast group to join, or a host address
+     * @param port the port number, or 0 for an ephemeral port
+     * @param logger the logger to use
+     */
+    MemoryTransport(MemoryBus& bus, const std::string& group, unsigned short port, Logger& logger);
+
+    /**
+     * Detaches the transport from the bus.
+     */
+    virtual ~MemoryTransport();
+
+    virtual void open();
+    virtual Status select(long timeout, bool poll_write = false);
+    virtual MemoryTransport& operator>>(Message& message);
+    virtual MemoryTransport& operator<<(const Message& message);
+    virtual MemoryTransport& operator>>(Address& address);
+    virtual MemoryTransport& operator<<(const Address& address);
+    virtual void close();
+    virtual void set_reuse(bool reuse);
+    virtual void set_block_filter(unsigned int index, unsigned int count);
+    virtual void set_type_filter(unsigned int types);
+    virtual void set_session_filter(unsigned int sender, bool peers);
+    virtual void set_received_filter(uint64_t start, uint64_t end);
+
+private:
+    friend class MemoryBus;
+
+    struct Delivery {
+        std::tr1::shared_ptr<const std::vector<char> > data;
+        MemoryBus::Key from;
+        TransportFactory::Clock::time_point due;
+        uint64_t round;
+    };
+
+    /**
+     * Returns true if the filters let a message through.  Called with the
+     * bus lock held.
+     * @param data the message
+     * @return true to deliver the message
+     */
+    bool accepts(const std::vector<char>& data) const;
+
+    /**
+     * Returns true if the next message can be read.  Called with the bus
+     * lock held.
+     * @param now the bus time
+     * @return true if a message is ready
+     */
+    bool readable(TransportFactory::Clock::time_point now) const;
+
+    /**
+     * Returns the time to wait until for the next message.  Called with
+     * the bus lock held.
+     * @param now the bus time
+     * @return when the next message falls due, or the epoch to wait for
+     * the bus to wake the transport
+     */
+    TransportFactory::Clock::time_point next_arrival(TransportFactory::Clock::time_point now) const;
+
+    MemoryBus& bus;
+    Logger& logger;
+    uint32_t group;
+    unsigned short port;
+    MemoryBus::Key local;
+    MemoryBus::Key to;
+    MemoryBus::Key from;
+    bool attached;
+    std::deque<Delivery> queue;
+    std::condition_variable arrived;
+    unsigned int filter_index;
+    unsigned int filter_count;
+    unsigned int filter_types;
+    unsigned int filter_sender;
+    bool has_filter_sender;
+    bool filter_peers;
+    uint64_t received_start;
+    uint64_t received_end;
+};
+
+}
+
+#endif
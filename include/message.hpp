@@ -30,7 +30,12 @@ enum MessageType {
     MESSAGE_TYPE_GETINFO,
     MESSAGE_TYPE_CGOODBYE,
     MESSAGE_TYPE_SGOODBYE,
-    MESSAGE_TYPE_CHELLO
+    MESSAGE_TYPE_CHELLO,
+    MESSAGE_TYPE_EXTENTS,
+    MESSAGE_TYPE_GETRANGES,
+    MESSAGE_TYPE_HEARTBEAT,
+    MESSAGE_TYPE_CATCHUP,
+    MESSAGE_TYPE_SHELLO
 };
 
 struct Header {
@@ -64,6 +69,8 @@ public:
     enum Direction { OUTPUT, INPUT };
 
     friend class BlockSocket;
+    friend class UringSocket;
+    friend class MemoryTransport;
     friend std::ostream& ::operator<<(std::ostream& stream, const Message& message);
     friend std::istream& ::operator>>(std::istream& stream, Message& message);
     
@@ -131,12 +138,46 @@ public:
     template <typename M>
     const M& get_metadata() const;
     
+    /**
+     * Returns the message's metadata for changing, such as to set a
+     * timestamp just before the message is sent.
+     * @return the message metadata
+     */
+    template <typename M>
+    M& get_metadata();
+    
     /**
      * Returns the message's type
      * @return the message type
      */  
     unsigned int get_type() const;
     
+    /**
+     * Returns the ID of the message's sender
+     * @return the sender ID
+     */  
+    unsigned int get_sender() const;
+    
+    /**
+     * Changes the ID of the message's sender, so that a relay can forward
+     * the message as its own.
+     * @param sender the new sender ID
+     */
+    void set_sender(unsigned int sender);
+    
+    /**
+     * Returns the time the message was queued or received.  The time
+     * isn't sent with the message.
+     * @return the time in microseconds, or 0 if it wasn't recorded
+     */
+    uint64_t get_stamp() const;
+    
+    /**
+     * Records the time the message was queued or received.
+     * @param stamp the time in microseconds
+     */
+    void set_stamp(uint64_t stamp);
+    
     /**
      * Returns the message's length, not including the headers.
      * @return the message length
@@ -160,13 +201,15 @@ public:
     
 private:
     std::vector<char> buffer;
-    const Direction direction;
+    Direction direction;
+    uint64_t stamp;
 };
 
 template <typename M>
 Message::Message(unsigned int sender, unsigned int type, const M& metadata) :
     buffer(sizeof(MetadataHeader<M>)),
-    direction(OUTPUT)
+    direction(OUTPUT),
+    stamp(0)
 {
     MetadataHeader<M>* header = (MetadataHeader<M>*)&buffer.front();
     header->type = htonl(type);
@@ -179,7 +222,8 @@ Message::Message(unsigned int sender, unsigned int type, const M& metadata) :
 template <typename M>
 Message::Message(unsigned int sender, unsigned int type, const M& metadata, unsigned int reserve) :
     buffer(reserve + sizeof(MetadataHeader<M>)),
-    direction(OUTPUT)
+    direction(OUTPUT),
+    stamp(0)
 {
     MetadataHeader<M>* header = (MetadataHeader<M>*)&buffer.front();
     header->type = htonl(type);
@@ -192,7 +236,8 @@ Message::Message(unsigned int sender, unsigned int type, const M& metadata, unsi
 template <typename M>
 Message::Message(unsigned int sender, unsigned int type, const M& metadata, const std::string& text) :
     buffer(text.length() + sizeof(MetadataHeader<M>)),
-    direction(OUTPUT)
+    direction(OUTPUT),
+    stamp(0)
 {
     MetadataHeader<M>* header = (MetadataHeader<M>*)&buffer.front();
     header->type = htonl(type);
@@ -219,6 +264,12 @@ const M& Message::get_metadata() const
     return header->metadata;
 }
 
+template <typename M>
+M& Message::get_metadata()
+{
+    return const_cast<M&>(static_cast<const Message&>(*this).get_metadata<M>());
+}
+
 template <typename T>
 const Array<T> Message::get_array() const
 {
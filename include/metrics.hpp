@@ -0,0 +1,166 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <string>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <stdint.h>
+#include "histogram.hpp"
+
+namespace Msync {
+
+/**
+ * The metrics kept by the library.  Counters only go up; gauges go up and
+ * down, and are kept as the sum of the changes made to them.
+ */
+enum Metric {
+    METRIC_PACKETS_SENT,
+    METRIC_BYTES_SENT,
+    METRIC_PACKETS_RECEIVED,
+    METRIC_BYTES_RECEIVED,
+    METRIC_SEND_WOULDBLOCK,
+    METRIC_REPAIR_REQUESTS,
+    METRIC_REPAIRS_SENT,
+    METRIC_BLOCKS_RECEIVED,
+    METRIC_DUPLICATE_BLOCKS,
+    METRIC_DISK_WRITES,
+    METRIC_DISK_WRITE_MICROSECONDS,
+    METRIC_RING_WRITE_MICROSECONDS,
+    METRIC_RECEIVE_BUFFER_DROPS,
+    METRIC_BLOCKS_LOST,
+    METRIC_SEND_QUEUE_DEPTH,
+    METRIC_MISSING_BLOCKS,
+    METRIC_HOSTS,
+    METRIC_JITTER_MICROSECONDS,
+    METRIC_COUNT
+};
+
+/**
+ * The stages of a block's journey whose latency is recorded, in
+ * microseconds.
+ */
+enum Stage {
+    STAGE_BLOCK_READ,
+    STAGE_SEND_QUEUE,
+    STAGE_NETWORK,
+    STAGE_WRITE,
+    STAGE_TRANSMIT,
+    STAGE_RECEIVE_QUEUE,
+    STAGE_ARRIVAL_GAP,
+    STAGE_COUNT
+};
+
+struct ThreadMetrics;
+
+/**
+ * A process-wide registry of counters and gauges.  Each thread updates its
+ * own copy of every metric without locking or atomic read-modify-write
+ * instructions, so updating a metric costs about as much as incrementing
+ * a local variable; the copies are only added up when the metrics are
+ * read.  The totals of threads that have exited are kept.  Latencies are
+ * recorded the same way, in one histogram per stage in each thread that
+ * records the stage, merged when they are read.
+ */
+class Metrics {
+public:
+
+    /**
+     * Adds to a metric.
+     * @param metric the metric
+     * @param value the amount to add; negative values are only meaningful
+     * for gauges
+     */
+    static void add(Metric metric, int64_t value = 1);
+
+    /**
+     * Returns the current value of a metric, summed over every thread.
+     * @param metric the metric
+     * @return the value
+     */
+    static int64_t get(Metric metric);
+
+    /**
+     * Returns the name a metric is exported under.
+     * @param metric the metric
+     * @return the name
+     */
+    static const char* get_name(Metric metric);
+
+    /**
+     * Records the latency of a stage.
+     * @param stage the stage
+     * @param microseconds the latency
+     */
+    static void record(Stage stage, uint64_t microseconds);
+
+    /**
+     * Adds up the latency histograms of a stage over every thread.
+     * @param stage the stage
+     * @param histogram an empty histogram to add them to
+     */
+    static void get_histogram(Stage stage, Histogram& histogram);
+
+    /**
+     * Returns the name a stage's histogram is exported under.
+     * @param stage the stage
+     * @return the name
+     */
+    static const char* get_name(Stage stage);
+
+    /**
+     * Returns the wall clock time that latencies are measured with.  Times
+     * taken on different hosts can be compared if their clocks are
+     * synchronized.
+     * @return the time in microseconds since the epoch
+     */
+    static uint64_t now();
+
+    /**
+     * Formats every metric in the Prometheus text exposition format.
+     * @return the formatted metrics
+     */
+    static std::string format();
+
+private:
+    friend struct ThreadMetrics;
+
+    struct Description {
+        const char* name;
+        const char* type;
+        const char* help;
+    };
+
+    /**
+     * Registers a thread's copy of the metrics.
+     * @param metrics the thread's metrics
+     */
+    static void attach(ThreadMetrics* metrics);
+
+    /**
+     * Gives a thread's copy of the metrics its histogram for a stage, the
+     * first time the thread records the stage.
+     * @param metrics the thread's metrics
+     * @param stage the stage
+     * @return the histogram
+     */
+    static Histogram* add_histogram(ThreadMetrics* metrics, Stage stage);
+
+    /**
+     * Unregisters a thread's copy of the metrics when the thread exits,
+     * keeping its totals.
+     * @param metrics the thread's metrics
+     */
+    static void detach(ThreadMetrics* metrics);
+
+    static const Description descriptions[METRIC_COUNT];
+    static const Description stages[STAGE_COUNT];
+    static std::mutex mutex;
+    static std::set<ThreadMetrics*> threads;
+    static int64_t retired[METRIC_COUNT];
+    static Histogram retired_histograms[STAGE_COUNT];
+};
+
+}
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef METRICSEXPORTER_HPP
+#define METRICSEXPORTER_HPP
+
+#include <string>
+#include <thread>
+#include <atomic>
+#include "logger.hpp"
+
+// Default interval between exports, in milliseconds
+#define METRICS_EXPORT_INTERVAL 10000
+
+// Prefix of export targets that are UNIX socket paths rather than files
+#define METRICS_SOCKET_PREFIX "unix:"
+
+namespace Msync {
+
+/**
+ * Exports the metrics in the Prometheus text format from a background
+ * thread.  A file target is rewritten on every interval, by writing a
+ * temporary file and renaming it over the target, so that a collector such
+ * as the node exporter's textfile collector never sees a partial file.  A
+ * UNIX socket target is listened on, and each connection is sent the
+ * current metrics and closed.
+ */
+class MetricsExporter {
+public:
+
+    /**
+     * Creates a new exporter and starts exporting.
+     * @param target the path of the file to write, or "unix:" followed by
+     * the path of the socket to listen on
+     * @param interval the interval between file exports, in milliseconds
+     * @param logger the logger to use
+     * @throw string error if the socket can't be created
+     */
+    MetricsExporter(const std::string& target, unsigned long interval = METRICS_EXPORT_INTERVAL, Logger& logger = Logger::Default);
+
+    /**
+     * Stops exporting.  A file target is written one last time, and a
+     * socket is removed.
+     */
+    ~MetricsExporter();
+
+private:
+    MetricsExporter(const MetricsExporter&);
+    MetricsExporter& operator=(const MetricsExporter&);
+
+    /**
+     * Writes the metrics to the target file.
+     */
+    void write_file();
+
+    /**
+     * Export thread.
+     */
+    void run();
+
+    std::string path;
+    unsigned long interval;
+    Logger& logger;
+    int listener;
+    std::atomic<bool> stopped;
+    std::thread thread;
+};
+
+}
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef PATHMONITOR_HPP
+#define PATHMONITOR_HPP
+
+#include <mutex>
+#include <vector>
+#include <tr1/memory>
+#include <stdint.h>
+#include "byteorder.hpp"
+
+// Length of the intervals that the lowest transit time is kept for, in
+// microseconds
+#define BASE_DELAY_INTERVAL 10000000
+
+// Number of intervals the base delay is the lowest transit time of, so
+// that it follows a route or clock that changes, as LEDBAT does
+#define BASE_DELAY_HISTORY 6
+
+namespace Msync {
+
+/**
+ * A client's measurements of the path from its server, sent in the body of
+ * its heartbeats.  Stored in network byte order.  All times are in
+ * microseconds.
+ */
+struct PathReport {
+
+    /**
+     * Creates a new report.
+     * @param delay the smoothed one-way delay
+     * @param queueing the smoothed delay above the base delay
+     * @param jitter the interarrival jitter
+     */
+    PathReport(uint32_t delay = 0, uint32_t queueing = 0, uint32_t jitter = 0) :
+        delay(htonl(delay)),
+        queueing(htonl(queueing)),
+        jitter(htonl(jitter))
+    {
+    }
+
+    /**
+     * Returns the smoothed one-way delay.  Only meaningful if the clocks of
+     * the server and client are synchronized.
+     * @return the delay
+     */
+    uint32_t get_delay() const { return ntohl(delay); }
+
+    /**
+     * Returns how far the smoothed delay is above the base delay, the
+     * lowest delay seen in the last few intervals, which is how long
+     * blocks are spending in queues along the path.
+     * Doesn't depend on the clocks being synchronized.
+     * @return the queueing delay
+     */
+    uint32_t get_queueing() const { return ntohl(queueing); }
+
+    /**
+     * Returns the interarrival jitter, as defined for RTP.
+     * @return the jitter
+     */
+    uint32_t get_jitter() const { return ntohl(jitter); }
+
+    uint32_t delay;
+    uint32_t queueing;
+    uint32_t jitter;
+};
+
+/**
+ * Tracks the one-way delay and jitter of the blocks arriving from a
+ * server, from the time each block was sent and the time the kernel
+ * received it.  Each transport blocks are read from keeps its own
+ * measurements, updated without locking by the one thread that reads it;
+ * they are only merged when a report is made.
+ */
+class PathMonitor {
+public:
+    PathMonitor();
+
+    /**
+     * Withdraws the monitor's jitter from the jitter gauge.
+     */
+    ~PathMonitor();
+
+    /**
+     * Makes room for the measurements of the given number of transports.
+     * Must be called before any block arrives.
+     * @param count the number of transports
+     */
+    void set_sources(size_t count);
+
+    /**
+     * Records the arrival of a block.  Only one thread at a time may
+     * record blocks for a source.
+     * @param source the index of the transport the block was read from
+     * @param sent the time the server sent the block, in microseconds
+     * since the epoch
+     * @param received the time the block was received
+     */
+    void arrived(size_t source, uint64_t sent, uint64_t received);
+
+    /**
+     * Forgets the measurements, such as when blocks start coming from a
+     * server with a different clock.  Each source starts afresh with its
+     * next block.  Safe to call from any thread.
+     */
+    void reset();
+
+    /**
+     * Returns the measurements of every source, merged, and updates the
+     * jitter gauge with them.  Safe to call from any thread.
+     * @return the report
+     */
+    PathReport get_report();
+
+    /**
+     * Returns true once any block has been measured.  Safe to call from
+     * any thread.
+     * @return true if the report is meaningful
+     */
+    bool has_report();
+
+private:
+    PathMonitor(const PathMonitor&);
+    PathMonitor& operator=(const PathMonitor&);
+
+    struct Source;
+
+    std::mutex mutex;
+    std::vector<std::tr1::shared_ptr<Source> > sources;
+    int64_t reported_jitter;
+};
+
+}
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef RINGBUFFER_HPP
+#define RINGBUFFER_HPP
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+// Size of a cache line in bytes
+#define CACHE_LINE 64
+
+namespace Msync {
+
+/**
+ * Fixed-size, lock-free queue for exactly one producer thread and one
+ * consumer thread.  Slots are preallocated and reused, so once the ring has
+ * warmed up, copying a message into a slot doesn't allocate.
+ */
+template <typename T>
+class RingBuffer {
+public:
+
+    /**
+     * Creates a new ring buffer.
+     * @param capacity the minimum number of slots; rounded up to a power of 2
+     * @param prototype the value used to initialize each slot
+     */
+    RingBuffer(size_t capacity, const T& prototype = T());
+
+    /**
+     * Adds a value to the back of the ring.  Must only be called from the
+     * producer thread.
+     * @param value the value to add
+     * @return false if the ring is full
+     */
+    bool push(const T& value);
+
+    /**
+     * Removes the value at the front of the ring.  Must only be called from
+     * the consumer thread.
+     * @param value receives the removed value
+     * @return false if the ring is empty
+     */
+    bool pop(T& value);
+
+    /**
+     * Returns true if the ring is empty.
+     * @return true if there is nothing to pop
+     */
+    bool empty() const;
+
+    /**
+     * Returns the number of values currently in the ring.
+     * @return the number of values
+     */
+    size_t size() const;
+
+private:
+    RingBuffer(const RingBuffer&);
+    RingBuffer& operator=(const RingBuffer&);
+
+    std::vector<T> slots;
+    const size_t mask;
+
+    // The producer and consumer indices are kept on separate cache lines,
+    // each next to the other side's index as last seen, so that the two
+    // threads only touch each other's lines when the ring looks full/empty.
+    // They are padded rather than aligned, since new doesn't honour
+    // extended alignment before C++17.
+    char tail_padding[CACHE_LINE];
+    std::atomic<size_t> tail;
+    size_t cached_head;
+    char head_padding[CACHE_LINE];
+    std::atomic<size_t> head;
+    size_t cached_tail;
+    char end_padding[CACHE_LINE];
+};
+
+inline size_t ring_capacity(size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    return size;
+}
+
+template <typename T>
+RingBuffer<T>::RingBuffer(size_t capacity, const T& prototype) :
+    slots(ring_capacity(capacity), prototype),
+    mask(ring_capacity(capacity) - 1),
+    tail(0),
+    cached_head(0),
+    head(0),
+    cached_tail(0)
+{
+}
+
+template <typename T>
+bool RingBuffer<T>::push(const T& value)
+{
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t - cached_head > mask) {
+        cached_head = head.load(std::memory_order_acquire);
+        if (t - cached_head > mask) {
+            return false;
+        }
+    }
+    slots[t & mask] = value;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+}
+
+template <typename T>
+bool RingBuffer<T>::pop(T& value)
+{
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == cached_tail) {
+        cached_tail = tail.load(std::memory_order_acquire);
+        if (h == cached_tail) {
+            return false;
+        }
+    }
+    value = slots[h & mask];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+}
+
+template <typename T>
+bool RingBuffer<T>::empty() const
+{
+    return size() == 0;
+}
+
+template <typename T>
+size_t RingBuffer<T>::size() const
+{
+    return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+}
+
+}
+
+#endif
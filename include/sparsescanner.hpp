@@ -0,0 +1,57 @@
+#ifndef SPARSESCANNER_HPP
+#define SPARSESCANNER_HPP
+
+#include <string>
+#include <cstddef>
+#include <stdint.h>
+
+namespace Msync {
+
+class SparseScanner {
+public:
+
+    /**
+     * Creates a new scanner for finding holes in the given file.
+     * @param path the path to the file to scan
+     * @param block_size the size of one block in bytes
+     */
+    SparseScanner(const std::string& path, unsigned int block_size);
+
+    /**
+     * Closes the underlying file descriptor.
+     */
+    ~SparseScanner();
+
+    /**
+     * Returns the first block at or after the given block that may contain
+     * data.  Blocks between the two lie entirely inside a hole.  If the
+     * platform or file system can't report holes, the given block is
+     * returned unchanged.  The end of the run of data found is remembered,
+     * so the file is only asked again for blocks past it.
+     * @param block the block to start searching from
+     * @param count the number of blocks in the file
+     * @return the next block that may contain data, or count if none do
+     */
+    uint64_t next_data(uint64_t block, uint64_t count);
+
+    /**
+     * Checks whether the given buffer contains only zero bytes.
+     * @param data the buffer to check
+     * @param length the length of the buffer
+     * @return true if every byte is zero
+     */
+    static bool is_zero(const char* data, size_t length);
+
+private:
+    SparseScanner(const SparseScanner&);
+    SparseScanner& operator=(const SparseScanner&);
+
+    int fd;
+    unsigned int block_size;
+    uint64_t data_start;
+    uint64_t data_end;
+};
+
+}
+
+#endif
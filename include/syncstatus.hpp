@@ -5,40 +5,165 @@
 #include "fileinfo.hpp"
 #include "blockserver.hpp"
 #include "message.hpp"
+#include "blockbitmap.hpp"
 #include <string>
 #include <vector>
-#include <fstream>
+#include <mutex>
+#include <atomic>
 
-#ifdef WINDOWS
-#include <memory>
-#else
-#include <tr1/memory>
-#endif
+// Maximum number of runs of received blocks examined when looking for the
+// longest one
+#define RUN_SCAN_LIMIT 1024
 
 namespace Msync {
 
+/**
+ * The phases of a file's sync on a client.  Blocks are received until the
+ * server's first goodbye, and repaired after it until every block has
+ * arrived.  The client then says goodbye until the server acknowledges it.
+ * A sync whose server goes quiet before the file is complete fails.
+ */
+enum Phase {
+    PHASE_RECEIVING,
+    PHASE_REPAIRING,
+    PHASE_LEAVING,
+    PHASE_DONE,
+    PHASE_FAILED
+};
+
 class SyncStatus { 
 public:
     /**
      * Creates a new sync status object from the given file information.
      * @param info the file information.
 	 * @param server_address the server address
+     * @param drops the packets the client's receive buffers had dropped
+     * when the sync began
      */
-    SyncStatus(const FileInfo& info, const Address& server_address);
+    SyncStatus(const FileInfo& info, const Address& server_address, uint64_t drops = 0);
+    
+    /**
+     * Closes the temporary file if the transfer didn't complete.
+     */
+    ~SyncStatus();
     
     /**
      * Marks the given block as complete, and writes the block if it hasn't
-     * already been written.
+     * already been written.  Safe to call from several threads at once.
      * @param info the block info
      * @param message the message containing the block
+     * @return true if the block was new
+     */
+    bool write_block(uint64_t block, const Message& message);
+    
+    /**
+     * Writes a block's data and marks it as complete, as write_block()
+     * does, for blocks that don't arrive in a message.
+     * @param block the block number
+     * @param data the block's data
+     * @param length the length of the data
+     * @return true if the block was new
+     */
+    bool write_data(uint64_t block, const char* data, size_t length);
+    
+    /**
+     * Registers a write of a block that completes later, such as one
+     * submitted to a transport.  The file isn't moved into place until the
+     * write is finished with end_write(), and until then the block isn't
+     * written again.  Safe to call from several threads at once.
+     * @param block the block number
+     * @return false if the block has already been received or is being
+     * written, in which case end_write() mustn't be called
+     */
+    bool begin_write(uint64_t block);
+    
+    /**
+     * Finishes a write registered with begin_write(), marking the block as
+     * complete if it was written.  A block that wasn't written can be
+     * written again.  Safe to call from several threads at once.
+     * @param block the block number
+     * @param message the message containing the block
+     * @param written true if the whole block was written
+     * @return true if the block was new
+     */
+    bool end_write(uint64_t block, const Message& message, bool written);
+    
+    /**
+     * Returns the descriptor of the partial file, for writes registered
+     * with begin_write().
+     * @return the descriptor
+     */
+    int get_descriptor() const;
+    
+    /**
+     * Marks a run of empty blocks as complete without writing them.  The
+     * blocks are left as a hole in the output file.
+     * @param start the first empty block
+     * @param count the number of empty blocks
+     */
+    void mark_empty(uint64_t start, uint64_t count);
+    
+    /**
+     * Returns the number of blocks that haven't been received yet.
+     * @return the number of missing blocks
+     */
+    uint64_t get_remaining_blocks() const;
+    
+    /**
+     * Encodes runs of missing blocks as extents, for a repair request.
+     * @param block the block to start from
+     * @param extents receives the runs of missing blocks
+     * @param max the maximum number of extents to add
+     * @return the block to continue from, or the block count if every
+     * missing block was encoded
+     */
+    uint64_t encode_missing(uint64_t block, std::vector<Extent>& extents, size_t max) const;
+    
+    /**
+     * Finds the longest run of received blocks, looking at no more than
+     * RUN_SCAN_LIMIT runs.
+     * @param start receives the first block of the run
+     * @param end receives the block after the end of the run; equal to
+     * start if no blocks have been received
+     */
+    void get_received_run(uint64_t& start, uint64_t& end) const;
+    
+    /**
+     * Reads a received block back from the partial file, so that it can be
+     * sent to a peer that is missing it.  The last block isn't served,
+     * since its length isn't known until the file is complete.  Works
+     * after the file has been moved into place.
+     * @param block the block to read
+     * @param data receives the block's data
+     * @return false if the block hasn't been received or can't be read
+     */
+    bool read_block(uint64_t block, std::string& data) const;
+    
+    /**
+     * Returns true if the given block has been received.
+     * @param block the block number
+     * @return true if the block has been received
      */
-    void write_block(unsigned long block, const Message& message);
+    bool has_block(uint64_t block) const;
     
     /**
      * Sets the path to write the block to.
      * @param path the path
      */
     void set_path(const std::string& path);
+    
+    /**
+     * Returns true once the destination path is known.
+     * @return true if the file information has arrived
+     */
+    bool has_path();
+    
+    /**
+     * Returns the path of the partial file that blocks are written to.  The
+     * file is renamed to the destination path once the transfer completes.
+     * @return the temporary path
+     */
+    const std::string& get_temp_path() const;
 	
 	/**
 	 * Gets the server address associated with this status.
@@ -47,30 +172,89 @@ public:
 	const Address& get_server_address();
     
     /**
-     * Returns true if the sync is complete.
-     * @return boolean true if the sync is complete
+     * Returns the phase the sync is in.
+     * @return the phase
      */
-    bool transfer_complete();
-	
-	/**
-     * Returns true if the client and server have both acknowledged that the
-	 * sync has completed.
-	 * @return true if the sync is complete
-	 */
-	bool sync_complete();
+    Phase get_phase();
+    
+    /**
+     * Moves from receiving to repairing, when the server's first goodbye
+     * arrives with blocks still missing.
+     * @return true if this call began the repairs
+     */
+    bool begin_repair();
+    
+    /**
+     * Moves the partial file to the destination path and starts leaving,
+     * once every block has arrived and the path is known.
+     * @return true if this call moved the file into place
+     */
+    bool complete();
+    
+    /**
+     * Finishes the sync once the server has acknowledged the client's
+     * goodbye.
+     * @return true if this call finished the sync
+     */
+    bool acknowledge();
+    
+    /**
+     * Abandons a sync whose file isn't complete, and removes the partial
+     * file.  Blocks that are still being written go to the removed file.
+     * @return true if this call abandoned the sync
+     */
+    bool fail();
+    
+    /**
+     * Records that the server was heard from.  Safe to call from several
+     * threads at once.
+     * @param now the time, in milliseconds
+     */
+    void touch(uint64_t now);
+    
+    /**
+     * Returns the last time the server was heard from.
+     * @return the time, in milliseconds
+     */
+    uint64_t get_heard() const;
     
     /**
-     * This method is called when a goodbye is received from the server.
+     * Returns the packets the client's receive buffers had dropped when
+     * the sync began.
+     * @return the number of packets dropped
      */
-    void set_goodbye_received();
+    uint64_t get_start_drops() const;
 
 private:
+    SyncStatus(const SyncStatus&);
+    SyncStatus& operator=(const SyncStatus&);
+
+    /**
+     * Marks a block that has been written as complete, and unregisters
+     * its writer.
+     * @param block the block number
+     * @return true if the block was new
+     */
+    bool mark_written(uint64_t block);
+
+    /**
+     * Records how long a block took from arriving to being written.
+     * @param block the block number
+     * @param message the message containing the block
+     */
+    static void record_write(uint64_t block, const Message& message);
+
+    std::mutex mutex;
     std::string temp;
     std::string path;
-    std::vector<bool> block_array;
-    unsigned long remaining_blocks;
-    std::tr1::shared_ptr<std::ofstream> output;
-    bool goodbye_received;
+    BlockBitmap block_array;
+    std::vector<std::atomic<uint64_t> > pending;
+    std::atomic<int> writers;
+    int output;
+    int input;
+    Phase phase;
+    std::atomic<uint64_t> heard;
+    uint64_t start_drops;
 	Address server_address;
 };
 
@@ -0,0 +1,60 @@
+#ifndef TIMERWHEEL_HPP
+#define TIMERWHEEL_HPP
+
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+namespace Msync {
+
+/**
+ * Hashed timer wheel for large numbers of timeouts that are usually pushed
+ * back before they fire, such as client leases.  Scheduling is constant
+ * time; advancing the wheel only visits the slots for the ticks that have
+ * passed.  Timers can't be cancelled; the owner should check whether a
+ * timer that fires is still current.
+ */
+class TimerWheel {
+public:
+
+    /**
+     * Creates a new timer wheel.
+     * @param tick the length of one slot, in milliseconds
+     * @param slots the number of slots in the wheel
+     * @param now the current time, in milliseconds
+     */
+    TimerWheel(uint64_t tick, size_t slots, uint64_t now);
+
+    /**
+     * Schedules a timer.
+     * @param id the ID to report when the timer fires
+     * @param when the time the timer fires, in milliseconds
+     */
+    void schedule(unsigned int id, uint64_t when);
+
+    /**
+     * Advances the wheel to the given time and collects every timer that
+     * has fired.
+     * @param now the current time, in milliseconds
+     * @param expired receives the ID and due time of each fired timer
+     */
+    void advance(uint64_t now, std::vector<std::pair<unsigned int, uint64_t> >& expired);
+
+    /**
+     * Returns the number of scheduled timers.
+     * @return the number of timers
+     */
+    size_t size() const;
+
+private:
+    typedef std::pair<unsigned int, uint64_t> Timer;
+
+    std::vector<std::vector<Timer> > slots;
+    uint64_t tick;
+    uint64_t current;
+    size_t count;
+};
+
+}
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef TRACER_HPP
+#define TRACER_HPP
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <stdint.h>
+
+// By default one block in this many is traced
+#define TRACE_SAMPLE_INTERVAL 10000
+
+// Maximum number of events kept before the trace is written; later events
+// are dropped
+#define TRACE_EVENT_LIMIT 100000
+
+namespace Msync {
+
+/**
+ * Records the stages of a sample of blocks as a Chrome trace, which can be
+ * loaded into chrome://tracing or Perfetto.  Blocks are sampled by number,
+ * so servers and clients trace the same blocks, and their traces can be
+ * concatenated.  Times are taken from Metrics::now().
+ */
+class Tracer {
+public:
+
+    /**
+     * Starts tracing.
+     * @param path the file to write the trace to
+     * @param interval the sampling interval; block numbers that are a
+     * multiple of it are traced
+     */
+    static void start(const std::string& path, uint64_t interval = TRACE_SAMPLE_INTERVAL);
+
+    /**
+     * Stops tracing and writes the trace.
+     * @throw string error if the trace can't be written
+     */
+    static void stop();
+
+    /**
+     * Returns true if a block is being traced.
+     * @param block the block number
+     * @return true if the block's stages should be recorded
+     */
+    static bool sampled(uint64_t block)
+    {
+        uint64_t every = interval.load(std::memory_order_relaxed);
+        return every && block % every == 0;
+    }
+
+    /**
+     * Records a stage of a block.
+     * @param name the name of the stage
+     * @param block the block number
+     * @param start the start of the stage, in microseconds
+     * @param end the end of the stage, in microseconds
+     */
+    static void span(const char* name, uint64_t block, uint64_t start, uint64_t end);
+
+private:
+    struct Event {
+        const char* name;
+        uint64_t block;
+        uint64_t start;
+        uint64_t duration;
+        size_t thread;
+    };
+
+    static std::atomic<uint64_t> interval;
+    static std::mutex mutex;
+    static std::string path;
+    static std::vector<Event> events;
+};
+
+}
+
+#endif
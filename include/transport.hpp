@@ -0,0 +1,315 @@
+#ifndef TRANSPORT_HPP
+#define TRANSPORT_HPP
+
+#include <string>
+#include <chrono>
+#include <tr1/memory>
+#include <stdint.h>
+#include "message.hpp"
+#include "logger.hpp"
+
+namespace Msync {
+
+struct Address {
+	Address(const std::string& ip_address, unsigned short port) :
+		ip_address(ip_address),
+		port(port)
+    {
+	}
+
+	Address() {}
+
+	std::string ip_address;
+	unsigned short port;
+};
+
+/**
+ * A write to a file handed to Transport::submit_write(), so that it
+ * completes in the same loop as the transport's receives.  The transport
+ * keeps the write until it completes, and the data must stay valid until
+ * then; subclasses usually own it.
+ */
+class FileWrite {
+public:
+    FileWrite() :
+        descriptor(-1),
+        offset(0),
+        data(NULL),
+        length(0)
+    {
+    }
+
+    virtual ~FileWrite() {}
+
+    /**
+     * Called once the write has completed, on the thread that submitted
+     * it.
+     * @param result the number of bytes written, or a negative error number
+     */
+    virtual void completed(int result) = 0;
+
+    int descriptor;
+    uint64_t offset;
+    const char* data;
+    size_t length;
+};
+
+/**
+ * A datagram endpoint that servers and clients send and receive messages
+ * through.  BlockSocket is the implementation for real networks.  The
+ * kernel filters are optional; a transport that can't filter may deliver
+ * everything, since the handlers ignore messages they don't expect.
+ */
+class Transport {
+public:
+
+    enum Status { READ, WRITE, BOTH, NONE };
+
+    virtual ~Transport() {}
+
+    /**
+     * Binds the endpoint to its port, and joins the group if it is a
+     * multicast address.
+     * @throw string error if the operation fails
+     */
+    virtual void open() = 0;
+
+    /**
+     * Waits for activity on the endpoint.
+     * @param timeout the timeout in milliseconds, or -1 to wait forever
+     * @param poll_write whether to poll for write events
+     * @throw string error if the operation fails
+     * @return the status of the endpoint
+     */
+    virtual Status select(long timeout, bool poll_write = false) = 0;
+
+    /**
+     * Reads a message.
+     * @param message the message to read into
+     * @throw string error if the operation fails
+     */
+    virtual Transport& operator>>(Message& message) = 0;
+
+    /**
+     * Sends a message to the current destination.
+     * @param message the message to send
+     * @throw string error if the operation fails
+     */
+    virtual Transport& operator<<(const Message& message) = 0;
+
+    /**
+     * Sends several messages to the current destination.  Transports that
+     * can hand a run of messages to the kernel at once do so; others send
+     * them one at a time.
+     * @param messages the messages
+     * @param count the number of messages
+     * @throw string error if the operation fails
+     */
+    virtual void send(const Message* messages, size_t count)
+    {
+        for (size_t k = 0; k < count; k++) {
+            *this << messages[k];
+        }
+    }
+
+    /**
+     * Gets the address the last message came from.
+     * @param address receives the address
+     */
+    virtual Transport& operator>>(Address& address) = 0;
+
+    /**
+     * Sets the destination of the messages sent after this call.
+     * @param address the destination
+     */
+    virtual Transport& operator<<(const Address& address) = 0;
+
+    /**
+     * Closes the endpoint.  It can be reopened with open().
+     */
+    virtual void close() = 0;
+
+    /**
+     * Allows other endpoints to bind to the same port.  Must be called
+     * before open().
+     * @param reuse true to share the port
+     */
+    virtual void set_reuse(bool reuse) = 0;
+
+    /**
+     * Only receives the block messages whose number is index modulo count;
+     * see BlockSocket::set_block_filter().
+     * @param index the index of this endpoint
+     * @param count the number of endpoints sharing the port
+     * @throw string if the filter can't be set
+     */
+    virtual void set_block_filter(unsigned int index, unsigned int count) = 0;
+
+    /**
+     * Only receives the given message types.
+     * @param types a mask with bit (1 << type) set for each message type to
+     * receive, or 0 to receive every type
+     * @throw string if the filter can't be set
+     */
+    virtual void set_type_filter(unsigned int types) = 0;
+
+    /**
+     * Only receives messages from one session, and file information from
+     * any session.
+     * @param sender the host ID of the session's server
+     * @param peers true to also receive repair requests and blocks sent by
+     * other clients, which carry their own host IDs
+     * @throw string if the filter can't be set
+     */
+    virtual void set_session_filter(unsigned int sender, bool peers) = 0;
+
+    /**
+     * Drops the blocks in a range that has already been received.
+     * @param start the first block to drop
+     * @param end the block after the last block to drop
+     * @throw string if the filter can't be set
+     */
+    virtual void set_received_filter(uint64_t start, uint64_t end) = 0;
+
+    /**
+     * Asks for the time each sent packet leaves the host, where the
+     * transport can tell.  Must be called before open().  Only useful on
+     * endpoints that mostly send, since reading the times back competes
+     * with reading messages.
+     * @param enabled true to time sent packets
+     */
+    virtual void set_send_timestamps(bool enabled) {}
+
+    /**
+     * Lets the kernel cut runs of sent messages into packets, and
+     * coalesce runs of received packets, where the transport can.  Must be
+     * called before open().
+     * @param enabled true to use offload
+     */
+    virtual void set_offload(bool enabled) {}
+
+    /**
+     * Sizes the endpoint's buffers to hold a burst of traffic at the given
+     * rate.  Must be called before open().
+     * @param rate the expected rate in bytes per second, or 0 if unknown
+     * @param packet_size the size of a typical packet, including headers
+     */
+    virtual void set_buffer_size(unsigned long rate, unsigned int packet_size) {}
+
+    /**
+     * Returns the number of packets dropped because the endpoint's receive
+     * buffer was full, where the transport can tell.
+     * @return the number of packets dropped
+     */
+    virtual uint64_t get_receive_drops() const { return 0; }
+
+    /**
+     * Returns a descriptor that polls as readable when the endpoint has a
+     * message to read, and as writable when it can send.  Transports that
+     * receive in the background start doing so for the calling thread, so
+     * this should be called from the thread that will read.
+     * @return the descriptor, or -1 if the transport has none
+     */
+    virtual int get_descriptor() { return -1; }
+
+    /**
+     * Returns true if the transport can take a write to a file now, so that
+     * it completes alongside its receives.
+     * @return true if submit_write() would take a write
+     */
+    virtual bool can_submit_write() { return false; }
+
+    /**
+     * Submits a write to a file, if the transport can take it.  Must be
+     * called from the thread that reads the transport; the write completes
+     * during a later select() or read on that thread.
+     * @param write the write
+     * @throw string error if the write can't be submitted
+     * @return false if the transport didn't take the write, and the caller
+     * should write the data itself
+     */
+    virtual bool submit_write(const std::tr1::shared_ptr<FileWrite>& write) { return false; }
+};
+
+/**
+ * Creates transports, and keeps the time that their users should follow.
+ * Servers and clients take all of their timing from their factory, so a
+ * simulated network can also simulate the passing of time.
+ */
+class TransportFactory {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    virtual ~TransportFactory() {}
+
+    /**
+     * Creates a new, unopened transport.
+     * @param group the group or host address
+     * @param port the port number
+     * @param logger the logger to use
+     * @return the transport, owned by the caller
+     */
+    virtual Transport* create(const std::string& group, unsigned short port, Logger& logger) = 0;
+
+    /**
+     * Returns the current time.
+     * @return the time
+     */
+    virtual Clock::time_point now() = 0;
+
+    /**
+     * Waits until the given time.
+     * @param when the time to wait for
+     */
+    virtual void sleep_until(Clock::time_point when) = 0;
+
+    /**
+     * Returns the current time in milliseconds.
+     * @return the time
+     */
+    uint64_t now_ms()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(now().time_since_epoch()).count();
+    }
+
+    /**
+     * Counts the calling thread as one that sends and receives through
+     * this factory's transports until detach_thread() is called, so that a
+     * simulated network only lets time pass while every such thread is
+     * waiting on it.  Does nothing by default.
+     */
+    virtual void attach_thread() {}
+
+    /**
+     * Stops counting the calling thread.
+     */
+    virtual void detach_thread() {}
+};
+
+/**
+ * Attaches the calling thread to a transport factory for as long as the
+ * object lives.
+ */
+class TransportThread {
+public:
+    TransportThread(TransportFactory& factory) :
+        factory(factory)
+    {
+        factory.attach_thread();
+    }
+
+    ~TransportThread()
+    {
+        factory.detach_thread();
+    }
+
+private:
+    TransportThread(const TransportThread&);
+    TransportThread& operator=(const TransportThread&);
+
+    TransportFactory& factory;
+};
+
+}
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef URINGSOCKET_HPP
+#define URINGSOCKET_HPP
+
+#include <string>
+#include <tr1/memory>
+#include "blocksocket.hpp"
+
+namespace Msync {
+
+/**
+ * A block socket that receives through an io_uring.  One multishot
+ * receive stays armed on the socket, and the kernel writes each packet
+ * into the next free buffer of a ring registered with it, so reading a
+ * message that has already arrived takes no system call.  A buffer holds
+ * a coalesced run of packets, which are read from it one at a time.
+ * Writes to files can be submitted to the same ring, and complete in the
+ * loop that reads the socket.  Everything else is done as by BlockSocket.  Where the kernel
+ * has no io_uring, or the socket emulates network conditions, the socket
+ * receives as a BlockSocket does.
+ */
+class UringSocket : public BlockSocket {
+public:
+
+    /**
+     * Creates a new socket with the given attributes.
+     * @param group the multicast group address
+     * @param port the port number to listen to
+     */
+    UringSocket(const std::string& group, unsigned short port, Logger& logger = Logger::Default);
+
+    /**
+     * Closes the ring and the socket.
+     */
+    virtual ~UringSocket();
+
+    /**
+     * Opens the socket as BlockSocket::open() does, and sets up its ring.
+     * The receive is armed by the first thread to wait for a message, or to
+     * ask for the descriptor, since the kernel completes it on that thread.
+     * @throw string error if the operation fails
+     */
+    virtual void open();
+
+    /**
+     * Waits until a message has arrived in the ring, or the socket is
+     * writable if asked.
+     * @param timeout the timeout in milliseconds, or -1 to wait forever
+     * @param poll_write whether to poll for write events
+     * @throw string error if the operation fails
+     * @return the status of the socket
+     */
+    virtual Status select(long timeout, bool poll_write = false);
+
+    /**
+     * Takes the next message from the ring, waiting for one if there are
+     * none, and hands its buffer back to the kernel.
+     * @param message the message to read into
+     * @throw string error if the operation fails
+     */
+    virtual UringSocket& operator>>(Message& message);
+
+    using BlockSocket::operator>>;
+
+    /**
+     * Closes the ring and the socket.  The socket can be reopened with
+     * open().
+     */
+    virtual void close();
+
+    /**
+     * Returns a descriptor that polls as readable when messages are
+     * waiting in the ring, and arms the receive if it isn't armed.
+     * @return the descriptor, or -1 if the socket isn't open
+     */
+    virtual int get_descriptor();
+
+    /**
+     * Returns true if the socket has a ring that isn't already running as
+     * many writes as it has room to complete.  Writes that have finished
+     * are reaped first, without waiting for any.
+     * @return true if submit_write() would take a write
+     * @throw string error if the receive can't be armed again
+     */
+    virtual bool can_submit_write();
+
+    /**
+     * Submits a write to the ring, if can_submit_write() allows.
+     * @param write the write
+     * @throw string error if the write can't be submitted
+     * @return false if the caller should write the data itself
+     */
+    virtual bool submit_write(const std::tr1::shared_ptr<FileWrite>& write);
+
+private:
+    struct Ring;
+
+    /**
+     * Submits the multishot receive, unless it is already armed.
+     * @throw string if the receive can't be submitted
+     */
+    void arm();
+
+    /**
+     * Takes every completion the kernel has posted, finishing the writes
+     * among them, and arms the receive again if it has stopped and none of
+     * its packets are waiting.
+     * @return true if a packet, or an error from the receive, is waiting
+     * @throw string if the receive can't be armed again
+     */
+    bool reap();
+
+    std::tr1::shared_ptr<Ring> ring;
+};
+
+/**
+ * Creates sockets that receive through an io_uring, and follows the
+ * system's steady clock.
+ */
+class UringSocketFactory : public BlockSocketFactory {
+public:
+    virtual Transport* create(const std::string& group, unsigned short port, Logger& logger);
+
+    static UringSocketFactory Default;
+};
+
+}
+
+#endif
@@ -0,0 +1,248 @@
+#include "blockbitmap.hpp"
+
+using namespace Msync;
+
+static const uint64_t FULL = ~(uint64_t)0;
+
+static inline unsigned int popcount(uint64_t word)
+{
+#ifdef __GNUC__
+    return __builtin_popcountll(word);
+#else
+    unsigned int bits = 0;
+    for (; word; word &= word - 1) {
+        bits++;
+    }
+    return bits;
+#endif
+}
+
+static inline unsigned int lowest_bit(uint64_t word)
+{
+#ifdef __GNUC__
+    return __builtin_ctzll(word);
+#else
+    unsigned int bit = 0;
+    for (; !(word & 1); word >>= 1) {
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+static inline uint64_t range_mask(unsigned int first, unsigned int last)
+{
+    // Bits [first, last) of a word
+    uint64_t high = last == 64 ? FULL : (((uint64_t)1 << last) - 1);
+    return high & ~(((uint64_t)1 << first) - 1);
+}
+
+BlockBitmap::BlockBitmap(uint64_t count) :
+    leaves((count + 63) / 64),
+    summary((leaves.size() + 63) / 64),
+    occupied(summary.size()),
+    count(count),
+    missing(count)
+{
+    for (uint64_t i = 0; i < leaves.size(); i++) {
+        leaves[i].store(0, std::memory_order_relaxed);
+    }
+    for (uint64_t i = 0; i < summary.size(); i++) {
+        summary[i].store(0, std::memory_order_relaxed);
+        occupied[i].store(0, std::memory_order_relaxed);
+    }
+    
+    // Bits past the end of the file are permanently set, so that the last
+    // leaf and summary word can be full like any other.  They also make
+    // the last leaf occupied, which searches for received blocks allow for.
+    if (count % 64) {
+        leaves.back().store(range_mask(count % 64, 64), std::memory_order_relaxed);
+        occupied.back().store((uint64_t)1 << ((leaves.size() - 1) % 64), std::memory_order_relaxed);
+    }
+    if (leaves.size() % 64) {
+        summary.back().store(range_mask(leaves.size() % 64, 64), std::memory_order_relaxed);
+    }
+}
+
+unsigned int BlockBitmap::set_bits(uint64_t word, uint64_t mask)
+{
+    uint64_t old = leaves[word].fetch_or(mask);
+    unsigned int added = popcount(mask & ~old);
+    if (added && !old) {
+        occupied[word / 64].fetch_or((uint64_t)1 << (word % 64));
+    }
+    if (added && (old | mask) == FULL) {
+        summary[word / 64].fetch_or((uint64_t)1 << (word % 64));
+    }
+    return added;
+}
+
+bool BlockBitmap::set(uint64_t block)
+{
+    if (block >= count) {
+        return false;
+    }
+    if (!set_bits(block / 64, (uint64_t)1 << (block % 64))) {
+        return false;
+    }
+    missing--;
+    return true;
+}
+
+uint64_t BlockBitmap::set_range(uint64_t start, uint64_t count)
+{
+    uint64_t end = (start < this->count && count < this->count - start) ? start + count : this->count;
+    uint64_t added = 0;
+    
+    // Set whole words at a time, masking off the ends of the range
+    for (uint64_t block = start; block < end;) {
+        uint64_t word = block / 64;
+        unsigned int first = block % 64;
+        unsigned int last = (end - word * 64) < 64 ? (unsigned int)(end - word * 64) : 64;
+        added += set_bits(word, range_mask(first, last));
+        block = word * 64 + last;
+    }
+    missing -= added;
+    return added;
+}
+
+bool BlockBitmap::test(uint64_t block) const
+{
+    if (block >= count) {
+        return false;
+    }
+    return (leaves[block / 64].load() >> (block % 64)) & 1;
+}
+
+uint64_t BlockBitmap::size() const
+{
+    return count;
+}
+
+uint64_t BlockBitmap::remaining() const
+{
+    return missing;
+}
+
+uint64_t BlockBitmap::next_missing(uint64_t block) const
+{
+    if (block >= count) {
+        return count;
+    }
+    
+    // Check the rest of the starting leaf
+    uint64_t word = block / 64;
+    uint64_t holes = ~leaves[word].load() & range_mask(block % 64, 64);
+    if (holes) {
+        return word * 64 + lowest_bit(holes);
+    }
+    
+    // Then use the summary to skip over full leaves
+    word++;
+    while (word < leaves.size()) {
+        uint64_t index = word / 64;
+        uint64_t open = ~summary[index].load() & range_mask(word % 64, 64);
+        if (!open) {
+            word = (index + 1) * 64;
+            continue;
+        }
+        word = index * 64 + lowest_bit(open);
+        holes = ~leaves[word].load();
+        if (holes) {
+            return word * 64 + lowest_bit(holes);
+        }
+        
+        // The leaf filled up after the summary was read
+        word++;
+    }
+    return count;
+}
+
+uint64_t BlockBitmap::next_present(uint64_t block) const
+{
+    if (block >= count) {
+        return count;
+    }
+    
+    // Check the rest of the starting leaf
+    uint64_t word = block / 64;
+    uint64_t bits = leaves[word].load() & range_mask(block % 64, 64);
+    if (bits) {
+        uint64_t present = word * 64 + lowest_bit(bits);
+        return present < count ? present : count;
+    }
+    
+    // Then use the summary to skip over empty leaves
+    word++;
+    while (word < leaves.size()) {
+        uint64_t index = word / 64;
+        uint64_t used = occupied[index].load() & range_mask(word % 64, 64);
+        if (!used) {
+            word = (index + 1) * 64;
+            continue;
+        }
+        word = index * 64 + lowest_bit(used);
+        bits = leaves[word].load();
+        if (bits) {
+            uint64_t present = word * 64 + lowest_bit(bits);
+            return present < count ? present : count;
+        }
+        word++;
+    }
+    return count;
+}
+
+uint64_t BlockBitmap::count_missing(uint64_t start, uint64_t count) const
+{
+    uint64_t end = (start < this->count && count < this->count - start) ? start + count : this->count;
+    uint64_t holes = 0;
+    
+    for (uint64_t block = start; block < end;) {
+        uint64_t word = block / 64;
+        unsigned int first = block % 64;
+        unsigned int last = (end - word * 64) < 64 ? (unsigned int)(end - word * 64) : 64;
+        
+        // Whole summary words that are full or empty cover 64 leaves at
+        // once, and full or empty leaves don't have to be read
+        uint64_t index = word / 64;
+        if (first == 0 && word % 64 == 0 && end - block >= 64 * 64) {
+            if (summary[index].load() == FULL) {
+                block += 64 * 64;
+                continue;
+            }
+            if (!occupied[index].load()) {
+                holes += 64 * 64;
+                block += 64 * 64;
+                continue;
+            }
+        }
+        if (first == 0 && last == 64) {
+            uint64_t bit = (uint64_t)1 << (word % 64);
+            if (summary[index].load() & bit) {
+                block += 64;
+                continue;
+            }
+            if (!(occupied[index].load() & bit)) {
+                holes += 64;
+                block += 64;
+                continue;
+            }
+        }
+        holes += popcount(~leaves[word].load() & range_mask(first, last));
+        block = word * 64 + last;
+    }
+    return holes;
+}
+
+uint64_t BlockBitmap::encode_missing(uint64_t block, std::vector<Extent>& extents, size_t max) const
+{
+    for (size_t added = 0; added < max; added++) {
+        uint64_t start = next_missing(block);
+        if (start >= count) {
+            return count;
+        }
+        block = next_present(start);
+        extents.push_back(Extent(start, block - start));
+    }
+    return next_missing(block);
+}
@@ -1,7 +1,11 @@
 #include "blockclient.hpp"
 #include "blockinfo.hpp"
 #include "fileinfo.hpp"
-#include "blockclient.hpp"
+#include "extent.hpp"
+#include "hostfilter.hpp"
+#include "catchupreceiver.hpp"
+#include "metrics.hpp"
+#include "tracer.hpp"
 
 
 #ifdef WINDOWS
@@ -11,51 +15,718 @@
 #include <unistd.h>
 #endif
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include <cstring>
+#include <cerrno>
+
+// Size of a block in bytes; can be overridden at build time
+#ifndef BLOCKSIZE
 #define BLOCKSIZE 1024
+#endif
+
+// Size of the buffer incoming messages are read into; large enough for a
+// block and its metadata
+#define RECEIVE_BUFFER (BLOCKSIZE + 1024 > 4096 ? BLOCKSIZE + 1024 : 4096)
+
+// Maximum number of repair requests sent after each server goodbye
+#define REPAIR_MESSAGES_PER_ROUND 8
+
+// Interval between heartbeats while a sync is in progress, in milliseconds
+#define HEARTBEAT_INTERVAL 1000
+
+// Default maximum delay before hello, goodbye and repair messages, in
+// milliseconds
+#define JITTER 500
+
+// Interval at which the main loop checks for messages queued by the receive
+// threads, in milliseconds
+#define QUEUE_POLL_INTERVAL 50
+
+// Maximum number of messages read from each socket by one call to step()
+#define STEP_MESSAGE_LIMIT 64
+
+// Maximum delay before answering a peer's repair request, in milliseconds
+#define PEER_REPAIR_DELAY 200
+
+// Maximum number of peer repairs waiting to be sent
+#define PEER_REPAIR_LIMIT 1024
+
+// Message types that receive sockets accept from the group; everything else
+// is dropped by the kernel
+#define SESSION_TYPES ((1 << MESSAGE_TYPE_INFO) | (1 << MESSAGE_TYPE_BLOCK) | \
+    (1 << MESSAGE_TYPE_SGOODBYE) | (1 << MESSAGE_TYPE_EXTENTS))
+
 
 using namespace Msync;
 
+static unsigned int make_host_id()
+{
+    // Process IDs alone collide across machines booted from the same
+    // image, so mix in some randomness
+    std::random_device random;
+    return random() ^ (unsigned int)getpid();
+}
+
 BlockClient::BlockClient(const std::string& group, unsigned short port, Logger& logger) :
-    info(getpid()),
+    info(make_host_id()),
     logger(logger),
-    socket(group, port)
+    group(group),
+    port(port),
+    transport(&BlockSocketFactory::Default),
+    socket(transport->create("0.0.0.0", 0, logger)),
+    server_id(0),
+    has_server(false),
+    joined(false),
+    filtered_id(0),
+    filtered_start(0),
+    filtered_end(0),
+    sessions(SESSION_TICK, SESSION_SLOTS, transport->now_ms()),
+    next_session(0),
+    session_timeout(SESSION_TIMEOUT),
+    peer_repair(false),
+    receive_offload(false),
+    peer_remaining(0),
+    jitter(JITTER),
+    random(info.get_id()),
+    id(info.get_id()),
+    stripe_count(1),
+    receive_threads(1),
+    rate(0),
+    stopped(false),
+    catching_up(false),
+    listener(0),
+    driven(false),
+    poller(-1),
+    polling_write(false)
 {
-    logger << Logger::FINE << "Host ID is " << info.get_id() << "\n";
+    MSYNC_LOG(logger, FINE) << "Host ID is " << info.get_id() << "\n";
 	handlers[MESSAGE_TYPE_INFO] = &BlockClient::handle_info;
-	handlers[MESSAGE_TYPE_BLOCK] = &BlockClient::handle_block;
+	handlers[MESSAGE_TYPE_EXTENTS] = &BlockClient::handle_extents;
 	handlers[MESSAGE_TYPE_SGOODBYE] = &BlockClient::handle_sgoodbye;
+	handlers[MESSAGE_TYPE_SHELLO] = &BlockClient::handle_shello;
+	handlers[MESSAGE_TYPE_GETRANGES] = &BlockClient::handle_getranges;
+	handlers[MESSAGE_TYPE_CATCHUP] = &BlockClient::handle_catchup;
+}
+
+BlockClient::PeerRepair::PeerRepair(const FileInfo& info, const std::tr1::shared_ptr<SyncStatus>& status,
+        TransportFactory::Clock::time_point due) :
+    info(info),
+    status(status),
+    due(due)
+{
+}
+
+/**
+ * A block's write submitted to the transport it arrived on.  The block is
+ * handled once the write completes, as it would have been after writing
+ * it at once.
+ */
+class BlockClient::BlockWrite : public FileWrite {
+public:
+    BlockWrite(BlockClient& client, const std::tr1::shared_ptr<SyncStatus>& status, const FileInfo& info,
+            uint64_t block, const Message& message) :
+        client(client),
+        status(status),
+        info(info),
+        block(block),
+        message(message),
+        start(std::chrono::steady_clock::now())
+    {
+        Array<char> array = this->message.get_array<char>();
+        descriptor = status->get_descriptor();
+        offset = (uint64_t)BLOCKSIZE * block;
+        data = array.data;
+        length = array.length;
+    }
+
+    virtual void completed(int result)
+    {
+        // The completion is only reaped when the receive loop next looks, so
+        // this is longer than the write itself
+        Metrics::add(METRIC_RING_WRITE_MICROSECONDS, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+        
+        // A block that couldn't be written is still missing, and is asked
+        // for again
+        bool written = result >= 0 && (size_t)result == length;
+        if (!written) {
+            MSYNC_LOG(client.logger, ERR) << "Could not write data block to file: "
+                << (result < 0 ? strerror(-result) : "short write") << "\n";
+            status->end_write(block, message, false);
+            return;
+        }
+        client.block_stored(message, info, *status, status->end_write(block, message, true));
+    }
+
+private:
+    BlockClient& client;
+    std::tr1::shared_ptr<SyncStatus> status;
+    FileInfo info;
+    uint64_t block;
+    Message message;
+    std::chrono::steady_clock::time_point start;
+};
+
+BlockClient::~BlockClient()
+{
+    stopped = true;
+    for (unsigned int k = 0; k < threads.size(); k++) {
+        threads[k].join();
+    }
+    if (catchup_thread.joinable()) {
+        catchup_thread.join();
+    }
+#ifdef __linux__
+    if (poller >= 0) {
+        ::close(poller);
+    }
+#endif
 }
 
 void BlockClient::start()
 {
-    socket.open();
+    TransportThread attached(*transport);
+    open_sockets(true);
+    MSYNC_LOG(logger, INFO) << "Sending hello message\n";
+    enqueue_later(Message(id, MESSAGE_TYPE_CHELLO, info));
+    hello = transport->now() + std::chrono::milliseconds(jitter + HELLO_INTERVAL);
+    
+    // Keep our lease with the server alive while there is a sync in
+    // progress
+    heartbeat = transport->now();
+    while (!stopped) {
+        long next = run_timers();
+        
+        // Messages queued by the receive threads, such as the hello once
+        // the server is found and the answers to its goodbyes, don't wake
+        // this thread, so check for them often.  Peer requests also arrive
+        // on the receive threads and must be answered on time.
+        if (next > QUEUE_POLL_INTERVAL) {
+            next = QUEUE_POLL_INTERVAL;
+        }
+        select(next);
+    }
+}
+
+Error BlockClient::open()
+{
+#ifdef __linux__
+    if (driven) {
+        return fail(ERROR_STATE, "Client is already open");
+    }
+    try {
+        open_sockets(false);
+    } catch (std::string& message) {
+        return fail(ERROR_NETWORK, message);
+    }
+    driven = true;
+    
+    // One descriptor stands for all of the sockets, so that the caller
+    // only has to watch one per client.  Each socket is tagged with its
+    // index, the control socket being 0.  Simulated transports have no
+    // descriptors, and step() checks each of them in turn instead.
+    bool descriptors = socket->get_descriptor() >= 0;
+    for (size_t k = 0; k < receivers.size(); k++) {
+        descriptors = descriptors && receivers[k]->get_descriptor() >= 0;
+    }
+    if (descriptors) {
+        poller = epoll_create1(EPOLL_CLOEXEC);
+        if (poller < 0) {
+            return fail(ERROR_NETWORK, std::string("Could not create poller: ") + strerror(errno));
+        }
+    }
+    for (size_t k = 0; k <= receivers.size() && descriptors; k++) {
+        Transport& member = k == 0 ? *socket : *receivers[k - 1];
+        epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.u32 = (uint32_t)k;
+        if (epoll_ctl(poller, EPOLL_CTL_ADD, member.get_descriptor(), &event) < 0) {
+            return fail(ERROR_NETWORK, std::string("Could not poll socket: ") + strerror(errno));
+        }
+    }
+    polling_write = false;
+    
+    MSYNC_LOG(logger, INFO) << "Sending hello message\n";
+    enqueue_later(Message(id, MESSAGE_TYPE_CHELLO, info));
+    hello = transport->now() + std::chrono::milliseconds(jitter + HELLO_INTERVAL);
+    heartbeat = transport->now();
+    next_step = heartbeat;
+    return ERROR_NONE;
+#else
+    return fail(ERROR_UNSUPPORTED, "Event loop interface is only supported on Linux");
+#endif
+}
+
+int BlockClient::get_descriptor() const
+{
+    return poller;
+}
+
+long BlockClient::get_timeout()
+{
+    TransportFactory::Clock::time_point now = transport->now();
+    if (next_step <= now) {
+        return 0;
+    }
+    return std::chrono::duration_cast<std::chrono::milliseconds>(next_step - now).count() + 1;
+}
+
+Error BlockClient::step()
+{
+#ifdef __linux__
+    if (!driven) {
+        return fail(ERROR_STATE, "Client is not open");
+    }
+    
+    // The sockets are level-triggered, so any left unread after this call
+    // keep the descriptor readable
+    bool more = false;
+    if (poller >= 0) {
+        epoll_event events[64];
+        int ready = epoll_wait(poller, events, 64, 0);
+        if (ready < 0 && errno != EINTR) {
+            return fail(ERROR_NETWORK, std::string("Could not poll sockets: ") + strerror(errno));
+        }
+        for (int k = 0; k < ready; k++) {
+            uint32_t index = events[k].data.u32;
+            if (!(events[k].events & (EPOLLIN | EPOLLERR))) {
+                continue;
+            }
+            Error result = step_socket(index == 0 ? *socket : *receivers[index - 1], more);
+            if (result != ERROR_NONE) {
+                return result;
+            }
+        }
+    } else {
+        for (size_t k = 0; k <= receivers.size(); k++) {
+            Error result = step_socket(k == 0 ? *socket : *receivers[k - 1], more);
+            if (result != ERROR_NONE) {
+                return result;
+            }
+        }
+    }
+    
+    // A timer that fails, such as when a socket filter can't be attached
+    // or a block can't be read for a peer, stops the transfer; after the
+    // timers, only sending can fail
+    long next;
+    Error code = ERROR_TRANSFER;
+    try {
+        next = run_timers();
+        
+        // Messages left from a coalesced read don't make the descriptor
+        // readable, so a socket that hit the limit is stepped again at once
+        if (more) {
+            next = 0;
+        }
+        code = ERROR_NETWORK;
+        for (unsigned int k = 0; k < STEP_MESSAGE_LIMIT && output_pending(); k++) {
+            Transport::Status status = socket->select(0, true);
+            if (status != Transport::WRITE && status != Transport::BOTH) {
+                break;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!group_queue.empty()) {
+                *socket << group_queue.front().first << group_queue.front().second;
+                group_queue.pop_front();
+            } else {
+                *socket << server << message_queue.front();
+                message_queue.pop_front();
+            }
+        }
+    } catch (std::string& message) {
+        return fail(code, message);
+    }
+    
+    // Only wait for the control socket to become writable while there is
+    // something to send, or the descriptor would always be ready
+    bool pending = output_pending();
+    if (poller >= 0 && pending != polling_write) {
+        epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = pending ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        event.data.u32 = 0;
+        if (epoll_ctl(poller, EPOLL_CTL_MOD, socket->get_descriptor(), &event) < 0) {
+            return fail(ERROR_NETWORK, std::string("Could not poll socket: ") + strerror(errno));
+        }
+        polling_write = pending;
+    }
+    next_step = transport->now() + std::chrono::milliseconds(next);
+    return ERROR_NONE;
+#else
+    return fail(ERROR_UNSUPPORTED, "Event loop interface is only supported on Linux");
+#endif
+}
+
+Error BlockClient::step_socket(Transport& receiver, bool& more)
+{
+    unsigned int k;
+    for (k = 0; k < STEP_MESSAGE_LIMIT; k++) {
+        Message message(RECEIVE_BUFFER);
+        Address address;
+        try {
+            Transport::Status status = receiver.select(0);
+            if (status != Transport::READ && status != Transport::BOTH) {
+                break;
+            }
+            receiver >> message >> address;
+        } catch (std::string& description) {
+            return fail(ERROR_NETWORK, description);
+        }
+        try {
+            dispatch(message, address, receiver);
+        } catch (std::string& description) {
+            return fail(ERROR_TRANSFER, description);
+        }
+    }
+    if (k == STEP_MESSAGE_LIMIT) {
+        more = true;
+    }
+    return ERROR_NONE;
+}
+
+bool BlockClient::is_complete()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return sync_set.empty() && !finished.empty();
+}
+
+const std::string& BlockClient::get_error() const
+{
+    return error;
+}
+
+Error BlockClient::fail(Error code, const std::string& description)
+{
+    MSYNC_LOG(logger, ERR) << description << "\n";
+    error = description;
+    return code;
+}
+
+bool BlockClient::output_pending()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return !group_queue.empty() || (has_server && !message_queue.empty());
+}
+
+long BlockClient::run_timers()
+{
+    typedef TransportFactory::Clock clock;
+    clock::time_point now = transport->now();
+    if (now >= heartbeat) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!sync_set.empty()) {
+                // Tell the server how the path from it is doing, so
+                // that it can slow down if blocks are queueing
+                if (path.has_report()) {
+                    PathReport report = path.get_report();
+                    message_queue.push_back(Message(id, MESSAGE_TYPE_HEARTBEAT, info, std::string((char*)&report, sizeof(report))));
+                } else {
+                    message_queue.push_back(Message(id, MESSAGE_TYPE_HEARTBEAT, info));
+                }
+            }
+        }
+        heartbeat = now + std::chrono::milliseconds(HEARTBEAT_INTERVAL);
+        update_filters();
+        check_timeouts();
+    }
+    long next = std::chrono::duration_cast<std::chrono::milliseconds>(heartbeat - now).count();
     
-    logger << Logger::INFO << "Sending hello message\n";
-    message_queue.push_back(Message(id, MESSAGE_TYPE_CHELLO, info));   
+    // The hello is repeated until the server acknowledges it, since a
+    // client the server doesn't know about is left out of the session
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!joined) {
+            if (now >= hello) {
+                if (has_server) {
+                    message_queue.push_back(Message(id, MESSAGE_TYPE_CHELLO, info));
+                }
+                hello = now + std::chrono::milliseconds(HELLO_INTERVAL);
+            }
+            long until = std::chrono::duration_cast<std::chrono::milliseconds>(hello - now).count();
+            if (until < next) {
+                next = until;
+            }
+        }
+    }
+    long delay = release_delayed();
+    if (delay >= 0 && delay < next) {
+        next = delay;
+    }
+    delay = release_peer_repairs();
+    if (delay >= 0 && delay < next) {
+        next = delay;
+    }
+    return next;
+}
+
+void BlockClient::check_timeouts()
+{
+    uint64_t now = transport->now_ms();
+    std::vector<std::pair<unsigned int, uint64_t> > expired;
+    std::vector<std::pair<FileInfo, std::tr1::shared_ptr<SyncStatus> > > quiet;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        sessions.advance(now, expired);
+        for (size_t k = 0; k < expired.size(); k++) {
+            std::map<unsigned int, FileInfo>::iterator t = session_timers.find(expired[k].first);
+            if (t == session_timers.end()) {
+                continue;
+            }
+            
+            // Timers for syncs that have finished are forgotten when they
+            // fire; the others are moved to the last time the server was
+            // heard from
+            std::map<FileInfo, std::tr1::shared_ptr<SyncStatus> >::iterator i = sync_set.find(t->second);
+            if (i == sync_set.end()) {
+                session_timers.erase(t);
+                continue;
+            }
+            uint64_t expiry = i->second->get_heard() + session_timeout;
+            if (expiry > now) {
+                sessions.schedule(t->first, expiry);
+                continue;
+            }
+            quiet.push_back(*i);
+            finished.insert(i->first);
+            sync_set.erase(i);
+            session_timers.erase(t);
+        }
+    }
+    for (size_t k = 0; k < quiet.size(); k++) {
+        if (quiet[k].second->fail()) {
+            MSYNC_LOG(logger, WARNING) << "Server went quiet; abandoning file with " 
+                << quiet[k].second->get_remaining_blocks() << " blocks missing\n";
+            if (listener) {
+                listener->file_failed(quiet[k].first);
+            }
+        } else {
+            MSYNC_LOG(logger, WARNING) << "Server went quiet before acknowledging our goodbye\n";
+        }
+    }
+}
+
+void BlockClient::open_sockets(bool threaded)
+{
+    // Control messages go to the server, and replies meant only for this
+    // client come back, by unicast on their own socket, so that they don't
+    // wake up the rest of the group.  Multicast traffic is read by a
+    // thread per receiver, unless the caller drives the client.  The
+    // group's ports are always shared, so that several clients can run on
+    // one machine.
+    socket->open();
+    bool shared = receive_threads > 1;
+    for (unsigned int s = 0; s < stripe_count; s++) {
+        for (unsigned int k = 0; k < receive_threads; k++) {
+            std::tr1::shared_ptr<Transport> receiver(transport->create(group, port + s, logger));
+            receiver->set_reuse(true);
+            receiver->set_buffer_size(rate / stripe_count, sizeof(Header) + sizeof(BlockInfo) + BLOCKSIZE);
+            receiver->set_offload(receive_offload);
+            receiver->open();
+            receiver->set_type_filter(peer_repair ? SESSION_TYPES | (1 << MESSAGE_TYPE_GETRANGES) : SESSION_TYPES);
+            if (shared) {
+                receiver->set_block_filter(k, receive_threads);
+            }
+            receivers.push_back(receiver);
+        }
+    }
     
-    while (true) {
-        select(-1);
+    // Each socket measures the path on its own, indexed as for the poller,
+    // so every socket is known before the threads start reading
+    path.set_sources(receivers.size() + 1);
+    for (size_t k = 0; k < receivers.size() && threaded; k++) {
+        threads.push_back(std::thread(&BlockClient::receive, this, receivers[k].get()));
     }
 }
 
+void BlockClient::set_transport(TransportFactory& factory)
+{
+    transport = &factory;
+    socket.reset(transport->create("0.0.0.0", 0, logger));
+    sessions = TimerWheel(SESSION_TICK, SESSION_SLOTS, transport->now_ms());
+}
+
+void BlockClient::stop()
+{
+    stopped = true;
+}
+
+void BlockClient::set_stripes(unsigned int count)
+{
+    stripe_count = count ? count : 1;
+}
+
+void BlockClient::set_receive_threads(unsigned int count)
+{
+    receive_threads = count ? count : 1;
+}
+
+void BlockClient::set_jitter(unsigned long jitter)
+{
+    this->jitter = jitter;
+}
+
+void BlockClient::set_rate(unsigned long rate)
+{
+    this->rate = rate;
+}
+
+void BlockClient::set_session_timeout(unsigned long timeout)
+{
+    session_timeout = timeout;
+}
+
+void BlockClient::set_listener(BlockListener* listener)
+{
+    this->listener = listener;
+}
+
+void BlockClient::set_peer_repair(bool enabled)
+{
+    peer_repair = enabled;
+}
+
+void BlockClient::set_receive_offload(bool enabled)
+{
+    receive_offload = enabled;
+}
+
+void BlockClient::set_server(const Address& address, unsigned int sender)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (has_server && sender != server_id) {
+        path.reset();
+        joined = false;
+    }
+    server = address;
+    server_id = sender;
+    has_server = true;
+}
+
+void BlockClient::update_filters()
+{
+    unsigned int sender;
+    uint64_t start = 0;
+    uint64_t end = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!has_server) {
+            return;
+        }
+        sender = server_id;
+        
+        // Block numbers don't say which file they belong to, so only drop
+        // received blocks while a single file is being synced
+        if (sync_set.size() == 1) {
+            sync_set.begin()->second->get_received_run(start, end);
+        }
+    }
+    if (sender != filtered_id) {
+        MSYNC_LOG(logger, FINE) << "Filtering on session " << sender << "\n";
+        for (size_t k = 0; k < receivers.size(); k++) {
+            receivers[k]->set_session_filter(sender, peer_repair);
+        }
+        filtered_id = sender;
+    }
+    if (start != filtered_start || end != filtered_end) {
+        MSYNC_LOG(logger, FINE) << "Filtering out received blocks " << start << " to " << end << "\n";
+        for (size_t k = 0; k < receivers.size(); k++) {
+            receivers[k]->set_received_filter(start, end);
+        }
+        filtered_start = start;
+        filtered_end = end;
+    }
+}
+
+void BlockClient::enqueue_later(const Message& message, bool to_group)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    unsigned long delay = jitter ? random() % (jitter + 1) : 0;
+    TransportFactory::Clock::time_point when = transport->now() + std::chrono::milliseconds(delay);
+    delayed.insert(std::make_pair(when, std::make_pair(to_group, message)));
+}
+
+long BlockClient::release_delayed()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    TransportFactory::Clock::time_point now = transport->now();
+    while (!delayed.empty() && delayed.begin()->first <= now) {
+        const std::pair<bool, Message>& message = delayed.begin()->second;
+        if (message.first) {
+            group_queue.push_back(std::make_pair(Address(group, port), message.second));
+        } else {
+            message_queue.push_back(message.second);
+        }
+        delayed.erase(delayed.begin());
+    }
+    if (delayed.empty()) {
+        return -1;
+    }
+    return std::chrono::duration_cast<std::chrono::milliseconds>(delayed.begin()->first - now).count() + 1;
+}
+
 void BlockClient::select(long timeout)
 {
+    bool poll_write = output_pending();
+    
     // Read/write any oustanding messages
-    BlockSocket::Status status = socket.select(timeout, !message_queue.empty());
-    if (status == BlockSocket::READ || status == BlockSocket::BOTH) {
-        process_message();
+    Transport::Status status = socket->select(timeout, poll_write);
+    if (status == Transport::READ || status == Transport::BOTH) {
+        process_message(*socket);
     } 
-    if (status == BlockSocket::WRITE || status == BlockSocket::BOTH) {
-        socket << message_queue.front();
-        message_queue.pop_front();
+    if (status == Transport::WRITE || status == Transport::BOTH) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!group_queue.empty()) {
+            *socket << group_queue.front().first << group_queue.front().second;
+            group_queue.pop_front();
+        } else {
+            *socket << server << message_queue.front();
+            message_queue.pop_front();
+        }
     }
 }
 
-void BlockClient::process_message()
+void BlockClient::receive(Transport* receiver)
+{
+    TransportThread attached(*transport);
+    try {
+        while (!stopped) {
+            Transport::Status status = receiver->select(100);
+            if (status == Transport::READ || status == Transport::BOTH) {
+                process_message(*receiver);
+            }
+        }
+    } catch (std::string& message) {
+        MSYNC_LOG(logger, ERR) << "Receive failed: " << message << "\n";
+    }
+}
+
+void BlockClient::process_message(Transport& socket)
 {    
-    Message message(4096);
+    Message message(RECEIVE_BUFFER);
 	Address address;
     socket >> message >> address;
+    
+    dispatch(message, address, socket);
+}
+
+void BlockClient::dispatch(Message& message, const Address& address, Transport& receiver)
+{
+    // Transports that know when the packet arrived have already stamped it
+    if (!message.get_stamp()) {
+        message.set_stamp(Metrics::now());
+    }
+    
+    // Blocks are written through the transport they were read from, which
+    // may complete the write alongside its receives
+    if (message.get_type() == MESSAGE_TYPE_BLOCK) {
+        handle_block(message, address, receiver);
+        return;
+    }
 
 	typedef std::map<unsigned int, message_handler> handler_map;
 	handler_map::iterator i = handlers.find(message.get_type());
@@ -64,66 +735,396 @@ void BlockClient::process_message()
 		message_handler handler = i->second;
 		(this->*handler)(message, address);
 	} else {
-		logger << Logger::WARNING << "Unknown message type\n";
+		MSYNC_LOG(logger, WARNING) << "Unknown message type\n";
 	}
 }
 
 void BlockClient::handle_info(const Message& message, const Address& address)
 {
 	const FileInfo& info = message.get_metadata<FileInfo>();
-    SyncStatus& status = get_sync_status(info, address);
-    logger << Logger::INFO << "Received file information for " << message.get_text() << "\n";
-    status.set_path(message.get_text());
-
-	if (status.sync_complete()) {
-        sync_set.erase(info);
+    std::tr1::shared_ptr<SyncStatus> status = get_sync_status(info, address);
+    if (!status) {
+        return;
     }
+    MSYNC_LOG(logger, INFO) << "Received file information for " << message.get_text() << "\n";
+    set_server(address, message.get_sender());
+    std::string path = message.get_text();
+    if (listener) {
+        listener->file_started(info, path, status->get_temp_path());
+    }
+    status->set_path(path);
+    check_sync_status(info, *status);
 }
 
-void BlockClient::handle_block(const Message& message, const Address& address)
+void BlockClient::handle_block(const Message& message, const Address& address, Transport& receiver)
 {
 	// Look up the current status of the file by using the file
     // info object
     const BlockInfo& block = message.get_metadata<BlockInfo>();
     const FileInfo& info = block.get_file_info();
-    SyncStatus& status = get_sync_status(info, address);
-    logger << Logger::INFO << "Received block #" << block << " (" << message.get_length() << " bytes)\n";
-    status.write_block(block, message);
+    if (peer_repair && !from_session(message, info)) {
+        return;
+    }
+    std::tr1::shared_ptr<SyncStatus> status = get_sync_status(info, address);
+    if (!status) {
+        return;
+    }
+    MSYNC_LOG_LIMITED(logger, FINE) << "Received block #" << block << " (" << message.get_length() << " bytes)\n";
+    
+    // Blocks from a server carry the time they were sent; the delay is
+    // only meaningful if the clocks of both hosts are synchronized
+    uint64_t sent = block.get_sent();
+    if (sent) {
+        path.arrived(get_source(receiver), sent, message.get_stamp());
+    }
+    if (sent && message.get_stamp() >= sent) {
+        Metrics::record(STAGE_NETWORK, message.get_stamp() - sent);
+        if (Tracer::sampled(block)) {
+            Tracer::span("network", block, sent, message.get_stamp());
+        }
+    }
+    
+    // A new block is written by the transport if it can, and is handled
+    // once the write completes.  A block whose write is still running is
+    // a duplicate.
+    if (receiver.can_submit_write() && status->begin_write(block)) {
+        std::tr1::shared_ptr<FileWrite> write(new BlockWrite(*this, status, info, block, message));
+        bool submitted;
+        try {
+            submitted = receiver.submit_write(write);
+        } catch (std::string&) {
+            status->end_write(block, message, false);
+            throw;
+        }
+        if (submitted) {
+            return;
+        }
+        status->end_write(block, message, false);
+    }
+    block_stored(message, info, *status, status->write_block(block, message));
+}
 
-	if (status.sync_complete()) {
-        sync_set.erase(info);
+size_t BlockClient::get_source(const Transport& receiver) const
+{
+    for (size_t k = 0; k < receivers.size(); k++) {
+        if (receivers[k].get() == &receiver) {
+            return k + 1;
+        }
     }
+    return 0;
 }
 
-void BlockClient::handle_sgoodbye(const Message& message, const Address& address)
+void BlockClient::block_stored(const Message& message, const FileInfo& info, SyncStatus& status, bool stored)
+{
+    if (stored) {
+        if (listener) {
+            listener->block_received(message);
+            listener->file_progress(info, status.get_remaining_blocks(), info.get_block_count());
+        }
+    } else {
+        Metrics::add(METRIC_DUPLICATE_BLOCKS);
+        if (peer_repair) {
+            // Someone else has sent the block, so there's no need for us to
+            const BlockInfo& block = message.get_metadata<BlockInfo>();
+            std::lock_guard<std::mutex> lock(mutex);
+            peer_repairs.erase(block);
+        }
+    }
+    check_sync_status(info, status);
+}
+
+void BlockClient::handle_extents(const Message& message, const Address& address)
 {
-    // Get the list of clients the server has marked as finished
+    // The server found runs of empty blocks; they are never sent, so mark
+    // them as received and leave them as holes in the output file
     const FileInfo& info = message.get_metadata<FileInfo>();
-	SyncStatus& status = get_sync_status(info, address);
-	logger << Logger::INFO << "Received server goodbye\n";
-			
-	if (status.transfer_complete()) {
-		Array<unsigned> clients = message.get_array<unsigned>();
-		for(unsigned i = 0; i < clients.length; i++) {
-			if (clients.data[i] == id) {
-				status.set_goodbye_received();
-				message_queue.push_back(Message(id, MESSAGE_TYPE_CGOODBYE));
-			}
-		}
-	} else {
-		// TODO: Send a request for missing blocks!!
-	}
+    std::tr1::shared_ptr<SyncStatus> status = get_sync_status(info, address);
+    if (!status) {
+        return;
+    }
+    Array<Extent> extents = message.get_array<Extent>();
+    for (unsigned i = 0; i < extents.length; i++) {
+        status->mark_empty(extents.data[i].get_start(), extents.data[i].get_count());
+    }
+    MSYNC_LOG(logger, INFO) << "Received " << extents.length << " empty extents\n";
+    if (listener) {
+        listener->block_received(message);
+    }
+    check_sync_status(info, *status);
+}
 
-	if (status.sync_complete()) {
-        sync_set.erase(info);
+void BlockClient::handle_sgoodbye(const Message& message, const Address& address)
+{
+    // Each server goodbye carries one segment of a filter of the clients
+    // whose goodbyes the server has received
+    const GoodbyeInfo& goodbye = message.get_metadata<GoodbyeInfo>();
+    const FileInfo& info = goodbye.file_info;
+	std::tr1::shared_ptr<SyncStatus> status = get_sync_status(info, address);
+    if (!status) {
+        return;
     }
+    set_server(address, message.get_sender());
+    uint32_t segment = ntohl(goodbye.segment);
+	MSYNC_LOG(logger, FINE) << "Received server goodbye " << segment << "\n";
+    
+    // A file whose last block was still being written when it arrived may
+    // be ready to move into place now
+    check_sync_status(info, *status);
+    switch (status->get_phase()) {
+    case PHASE_RECEIVING:
+    case PHASE_REPAIRING:
+        // Only the first segment of a round asks for repairs
+        if (segment == 0) {
+            request_missing(info, *status);
+        }
+        break;
+    case PHASE_LEAVING:
+        if (segment == HostFilter::segment_of(id, ntohl(goodbye.segments))) {
+            Array<char> bits = message.get_array<char>();
+            if (bits.length == FILTER_SEGMENT_BYTES && HostFilter::segment_contains(bits.data, id)) {
+                status->acknowledge();
+                check_sync_status(info, *status);
+            } else {
+                // Keep saying goodbye until the server acknowledges it.  A
+                // client that is leaving mustn't rejoin with its hello.
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    joined = true;
+                }
+                enqueue_later(Message(id, MESSAGE_TYPE_CGOODBYE));
+            }
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void BlockClient::handle_shello(const Message& message, const Address& address)
+{
+    // The server has added us to its session
+    std::lock_guard<std::mutex> lock(mutex);
+    if (has_server && message.get_sender() == server_id) {
+        joined = true;
+    }
+}
+
+bool BlockClient::from_session(const Message& message, const FileInfo& info)
+{
+    // Blocks from other clients are only kept for files that are already
+    // being synced, so that they can't start a sync of their own
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!has_server || message.get_sender() == server_id) {
+        return true;
+    }
+    return sync_set.count(info) > 0;
 }
 
-SyncStatus& BlockClient::get_sync_status(const FileInfo& info, const Address& address)
+std::tr1::shared_ptr<SyncStatus> BlockClient::get_sync_status(const FileInfo& info, const Address& address)
 {
-    std::map<FileInfo, SyncStatus>::iterator i = sync_set.find(info);
+    uint64_t now = transport->now_ms();
+    std::lock_guard<std::mutex> lock(mutex);
+    if (finished.count(info)) {
+        return std::tr1::shared_ptr<SyncStatus>();
+    }
+    std::map<FileInfo, std::tr1::shared_ptr<SyncStatus> >::iterator i = sync_set.find(info);
     if (i == sync_set.end()) {
-        i = sync_set.insert(i, std::pair<FileInfo, SyncStatus>(info, SyncStatus(info, address)));
+        std::tr1::shared_ptr<SyncStatus> status(new SyncStatus(info, address, get_receive_drops()));
+        i = sync_set.insert(i, std::make_pair(info, status));
+        if (session_timeout) {
+            session_timers.insert(std::make_pair(next_session, info));
+            sessions.schedule(next_session++, now + session_timeout);
+        }
     }
+    i->second->touch(now);
     return i->second;   
 }
+
+void BlockClient::handle_getranges(const Message& message, const Address& address)
+{
+    // A peer is missing blocks.  Offer the ones we have after a random
+    // delay, unless another client sends them first.
+    if (!peer_repair) {
+        return;
+    }
+    const FileInfo& info = message.get_metadata<FileInfo>();
+    Array<Extent> extents = message.get_array<Extent>();
+    TransportFactory::Clock::time_point now = transport->now();
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<FileInfo, std::tr1::shared_ptr<SyncStatus> >::iterator i = sync_set.find(info);
+    if (i == sync_set.end()) {
+        return;
+    }
+    
+    // Bound the work done for one request as well as the number waiting
+    unsigned int scanned = 0;
+    for (unsigned int k = 0; k < extents.length && scanned < PEER_REPAIR_LIMIT; k++) {
+        uint64_t start = extents.data[k].get_start();
+        uint64_t count = extents.data[k].get_count();
+        for (uint64_t block = start; block - start < count && scanned < PEER_REPAIR_LIMIT; block++, scanned++) {
+            if (peer_repairs.size() >= PEER_REPAIR_LIMIT) {
+                return;
+            }
+            if (i->second->has_block(block) && !peer_repairs.count(block)) {
+                TransportFactory::Clock::time_point due = now + std::chrono::milliseconds(random() % (PEER_REPAIR_DELAY + 1));
+                peer_repairs.insert(std::make_pair(block, PeerRepair(info, i->second, due)));
+            }
+        }
+    }
+}
+
+void BlockClient::handle_catchup(const Message& message, const Address& address)
+{
+    // The server would rather send us our missing blocks over TCP than
+    // multicast them to everyone
+    const CatchupInfo& offer = message.get_metadata<CatchupInfo>();
+    std::tr1::shared_ptr<SyncStatus> status;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::map<FileInfo, std::tr1::shared_ptr<SyncStatus> >::iterator i = sync_set.find(offer.file_info);
+        if (i == sync_set.end() || catching_up) {
+            return;
+        }
+        status = i->second;
+    }
+    
+    // A client driven by another program's loop can't start a thread, and
+    // falls back to ordinary repairs
+    if (driven) {
+        MSYNC_LOG(logger, FINE) << "Declining catch-up stream\n";
+        return;
+    }
+    if (catchup_thread.joinable()) {
+        catchup_thread.join();
+    }
+    catching_up = true;
+    catchup_thread = std::thread(&BlockClient::catch_up, this, offer.file_info, status, address.ip_address, offer.get_port());
+}
+
+void BlockClient::catch_up(FileInfo info, std::tr1::shared_ptr<SyncStatus> status, std::string host, unsigned short port)
+{
+    // If the stream fails, whatever is still missing is requested as usual
+    // after the next server goodbye
+    try {
+        CatchupReceiver receiver(host, port, id, logger);
+        receiver.receive(*status);
+    } catch (std::string& message) {
+        MSYNC_LOG(logger, WARNING) << "Catch-up failed: " << message << "\n";
+    }
+    catching_up = false;
+    check_sync_status(info, *status);
+}
+
+uint64_t BlockClient::get_receive_drops() const
+{
+    uint64_t dropped = 0;
+    for (size_t k = 0; k < receivers.size(); k++) {
+        dropped += receivers[k]->get_receive_drops();
+    }
+    return dropped;
+}
+
+void BlockClient::request_missing(const FileInfo& info, SyncStatus& status)
+{
+    // A client that joined after the file information was sent has to ask
+    // for it
+    if (!status.has_path()) {
+        enqueue_later(Message(id, MESSAGE_TYPE_GETINFO, info));
+    }
+    
+
+    // Ask the peers first, and the server if the peers couldn't help last
+    // time
+    uint64_t remaining = status.get_remaining_blocks();
+    if (remaining == 0) {
+        return;
+    }
+    
+    // The blocks missing after the first pass were either dropped by our
+    // own receive buffers or lost on the way here.  Only the drops since
+    // the file began count against it.
+    if (status.begin_repair()) {
+        uint64_t drops = get_receive_drops();
+        uint64_t dropped = drops > status.get_start_drops() ? drops - status.get_start_drops() : 0;
+        uint64_t lost = remaining > dropped ? remaining - dropped : 0;
+        Metrics::add(METRIC_BLOCKS_LOST, lost);
+        MSYNC_LOG(logger, INFO) << remaining << " blocks missing after the first pass; " << dropped 
+            << " packets dropped by this host, " << lost << " blocks lost on the way\n";
+    }
+    if (catching_up) {
+        return;
+    }
+    bool peers = false;
+    if (peer_repair) {
+        std::lock_guard<std::mutex> lock(mutex);
+        peers = peer_remaining == 0 || remaining < peer_remaining;
+        peer_remaining = peers ? remaining : 0;
+    }
+    
+    // Ask for a bounded number of missing ranges per round; whatever is
+    // left is requested after the next server goodbye
+    std::vector<Extent> extents;
+    uint64_t block = 0;
+    for (unsigned int i = 0; i < REPAIR_MESSAGES_PER_ROUND && block < info.get_block_count(); i++) {
+        extents.clear();
+        block = status.encode_missing(block, extents, EXTENTS_PER_MESSAGE);
+        if (extents.empty()) {
+            break;
+        }
+        std::string body((const char*)&extents.front(), extents.size() * sizeof(Extent));
+        enqueue_later(Message(id, MESSAGE_TYPE_GETRANGES, info, body), peers);
+    }
+    MSYNC_LOG(logger, INFO) << "Requesting " << remaining << " missing blocks from " << (peers ? "peers" : "server") << "\n";
+}
+
+long BlockClient::release_peer_repairs()
+{
+    std::vector<std::pair<uint64_t, PeerRepair> > due;
+    TransportFactory::Clock::time_point now = transport->now();
+    long next = -1;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::map<uint64_t, PeerRepair>::iterator i = peer_repairs.begin();
+        while (i != peer_repairs.end()) {
+            if (i->second.due <= now) {
+                due.push_back(*i);
+                peer_repairs.erase(i++);
+            } else {
+                long delay = std::chrono::duration_cast<std::chrono::milliseconds>(i->second.due - now).count() + 1;
+                next = next < 0 || delay < next ? delay : next;
+                i++;
+            }
+        }
+    }
+    
+    // Blocks are sent to the stripe they belong to, under our own ID so
+    // that the other clients can tell them from the server's
+    std::string data;
+    for (size_t k = 0; k < due.size(); k++) {
+        uint64_t block = due[k].first;
+        if (due[k].second.status->read_block(block, data)) {
+            Message message(id, MESSAGE_TYPE_BLOCK, BlockInfo(due[k].second.info, block), data);
+            std::lock_guard<std::mutex> lock(mutex);
+            group_queue.push_back(std::make_pair(Address(group, port + block % stripe_count), message));
+        }
+    }
+    if (!due.empty()) {
+        MSYNC_LOG(logger, FINE) << "Sent " << due.size() << " blocks to peers\n";
+    }
+    return next;
+}
+
+void BlockClient::check_sync_status(const FileInfo& info, SyncStatus& status)
+{
+    // Move the file into place as soon as the last block arrives, rather
+    // than waiting for the server's goodbye; a client that joined a
+    // carousel late is done after one full cycle
+    if (status.complete() && listener) {
+        listener->file_finished(info);
+    }
+	if (status.get_phase() == PHASE_DONE) {
+        std::lock_guard<std::mutex> lock(mutex);
+        sync_set.erase(info);
+        finished.insert(info);
+    }
+}
@@ -9,9 +9,10 @@
 
 using namespace Msync;
 
-BlockInfo::BlockInfo(const FileInfo& info, unsigned int block) :
+BlockInfo::BlockInfo(const FileInfo& info, uint64_t block) :
     file_info(info),
-    block_num(htonl(block))
+    block_num(hton64(block)),
+    sent_time(0)
 {
 }
 
@@ -22,20 +23,30 @@ bool BlockInfo::operator==(const BlockInfo& other) const
 
 void BlockInfo::operator++(int)
 {
-    block_num = htonl(ntohl(block_num) + 1);
+    block_num = hton64(ntoh64(block_num) + 1);
 }
 
-BlockInfo::operator unsigned int() const
+BlockInfo::operator uint64_t() const
 {
-    return ntohl(block_num);
+    return ntoh64(block_num);
 }
 
-unsigned int BlockInfo::get_block() const
+uint64_t BlockInfo::get_block() const
 {
-    return ntohl(block_num);
+    return ntoh64(block_num);
 }
 
 const FileInfo& BlockInfo::get_file_info() const
 {
     return file_info;
 }
+
+uint64_t BlockInfo::get_sent() const
+{
+    return ntoh64(sent_time);
+}
+
+void BlockInfo::set_sent(uint64_t time)
+{
+    sent_time = hton64(time);
+}
@@ -0,0 +1,64 @@
+#include "blockreader.hpp"
+#include "blockserver.hpp"
+
+using namespace Msync;
+
+BlockReader::BlockReader(const std::string& source, const FileInfo& info, unsigned int sender) :
+    input(source.c_str(), std::ios::binary),
+    scanner(source, BLOCKSIZE),
+    file_info(info),
+    sender(sender)
+{
+}
+
+uint64_t BlockReader::next_data(uint64_t block)
+{
+    uint64_t count = file_info.get_block_count();
+    return count ? scanner.next_data(block, count - 1) : block;
+}
+
+bool BlockReader::read(const BlockInfo& block, Message& message)
+{
+    message = Message(sender, MESSAGE_TYPE_BLOCK, block, BLOCKSIZE);
+    input.clear();
+    input.seekg((std::streamoff)BLOCKSIZE * block);
+    input >> message;
+    
+    // Zero blocks are announced as extents instead of being sent, except
+    // for the last block, which determines the length of the file
+    Array<char> data = message.get_array<char>();
+    if (block + 1 < file_info.get_block_count() && SparseScanner::is_zero(data.data, data.length)) {
+        add_empty(block, 1);
+        return false;
+    }
+    return true;
+}
+
+void BlockReader::add_empty(uint64_t start, uint64_t count)
+{
+    if (!extents.empty()) {
+        const Extent& last = extents.back();
+        if (last.get_start() + last.get_count() == start) {
+            extents.back() = Extent(last.get_start(), last.get_count() + count);
+            return;
+        }
+    }
+    extents.push_back(Extent(start, count));
+}
+
+bool BlockReader::extents_full() const
+{
+    return extents.size() >= EXTENTS_PER_MESSAGE;
+}
+
+bool BlockReader::flush(Message& message)
+{
+    if (extents.empty()) {
+        return false;
+    }
+    
+    std::string body((const char*)&extents.front(), extents.size() * sizeof(Extent));
+    message = Message(sender, MESSAGE_TYPE_EXTENTS, file_info, body);
+    extents.clear();
+    return true;
+}
@@ -0,0 +1,95 @@
+#include "blockrelay.hpp"
+
+using namespace Msync;
+
+BlockRelay::BlockRelay(const std::string& upstream_group, unsigned short upstream_port,
+        const std::string& downstream_group, unsigned short downstream_port, Logger& logger) :
+    logger(logger),
+    group(downstream_group),
+    port(downstream_port),
+    rate(0),
+    finished(true),
+    client(upstream_group, upstream_port, logger)
+{
+    client.set_listener(this);
+}
+
+BlockRelay::~BlockRelay()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (server) {
+        server->stop();
+    }
+    if (serving.joinable()) {
+        serving.join();
+    }
+}
+
+void BlockRelay::start()
+{
+    client.start();
+}
+
+void BlockRelay::set_rate(unsigned long rate)
+{
+    this->rate = rate;
+}
+
+BlockClient& BlockRelay::get_client()
+{
+    return client;
+}
+
+void BlockRelay::file_started(const FileInfo& info, std::string& path, const std::string& temp)
+{
+    // The file information is repeated, so ignore it while the file is
+    // already being served
+    std::lock_guard<std::mutex> lock(mutex);
+    if (server && server->get_file_info() == info) {
+        return;
+    }
+    if (!finished) {
+        MSYNC_LOG(logger, WARNING) << "Not relaying " << path << " until the current file is finished\n";
+        return;
+    }
+    if (serving.joinable()) {
+        serving.join();
+    }
+    
+    // Serve the partial file; blocks are forwarded as they arrive and
+    // repairs read it once it is complete
+    MSYNC_LOG(logger, INFO) << "Relaying " << path << " to " << group << ":" << port << "\n";
+    server.reset(new BlockServer(info, temp, path, group, port, logger));
+    server->set_relay();
+    server->set_rate(rate);
+    finished = false;
+    serving = std::thread(&BlockRelay::serve, this, server.get());
+}
+
+void BlockRelay::block_received(const Message& message)
+{
+    const FileInfo& info = message.get_type() == MESSAGE_TYPE_BLOCK ?
+        message.get_metadata<BlockInfo>().get_file_info() : message.get_metadata<FileInfo>();
+    std::lock_guard<std::mutex> lock(mutex);
+    if (server && !finished && server->get_file_info() == info) {
+        server->relay(message);
+    }
+}
+
+void BlockRelay::file_finished(const FileInfo& info)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (server && server->get_file_info() == info) {
+        server->end_relay();
+    }
+}
+
+void BlockRelay::serve(BlockServer* server)
+{
+    try {
+        server->start();
+    } catch (std::string& message) {
+        MSYNC_LOG(logger, ERR) << "Relay failed: " << message << "\n";
+    }
+    finished = true;
+}
@@ -1,5 +1,8 @@
 #include "blockserver.hpp"
 #include "blockinfo.hpp"
+#include "metrics.hpp"
+#include "tracer.hpp"
+#include "pathmonitor.hpp"
 
 #ifndef INVALID_SOCKET
 #define INVALID_SOCKET -1
@@ -17,68 +20,667 @@
 #include <cstring>
 #include <cstdlib>
 #include <string>
+#include <chrono>
+#include <random>
+#include <algorithm>
 
 using namespace Msync;
 
 BlockServer::BlockServer(const std::string& source, const std::string& path, 
         const std::string& group, unsigned short port, Logger& logger) : 
-    socket(group, 0),
-    id(rand()),
+    BlockServer(FileInfo(source), source, path, group, port, logger)
+{
+}
+
+BlockServer::BlockServer(const FileInfo& info, const std::string& source, const std::string& path, 
+        const std::string& group, unsigned short port, Logger& logger) : 
+    transport(&BlockSocketFactory::Default),
+    socket(transport->create(group, 0, logger)),
+    id(std::random_device()()),
+    source(source),
     path(path),
-    input(source.c_str(), std::ios::binary),
-    file_info(source),
-    logger(logger)
+    file_info(info),
+    repairs(source, file_info, id),
+    leases(LEASE_TICK, LEASE_SLOTS, transport->now_ms()),
+    lease_timeout(LEASE_TIMEOUT),
+    deadline(0),
+    session_end(0),
+    max_hosts(MAX_HOSTS),
+    logger(logger),
+    group(group),
+    port(port),
+    stripe_count(1),
+    reading(false),
+    stopped(false),
+    active_senders(0),
+    carousel(false),
+    prioritise(false),
+    has_wanted(false),
+    relaying(false),
+    catchup_enabled(true),
+    catchup_port(0),
+    packets_sent(0),
+    repairs_sent(0),
+    catchup_blocks(0),
+    reported_hosts(0),
+    reported_depth(0),
+    feed_closed(false),
+    feed_drops(0),
+    rate(0),
+    current_rate(0),
+    worst_queueing(0),
+    rate_adjusted(0)
 {   
-	socket << Address(group, port);
-    logger << Logger::INFO << "File " << source << " has " << file_info.get_block_count() << " blocks\n";
+	*socket << Address(group, port);
+    MSYNC_LOG(logger, INFO) << "File " << source << " has " << file_info.get_block_count() << " blocks\n";
+
+    acknowledged.push_back(std::vector<unsigned int>());
 
 	handlers[MESSAGE_TYPE_CHELLO] = &BlockServer::handle_chello;
 	handlers[MESSAGE_TYPE_GETINFO] = &BlockServer::handle_getinfo;
 	handlers[MESSAGE_TYPE_GETBLOCK] = &BlockServer::handle_getblock;
+	handlers[MESSAGE_TYPE_GETRANGES] = &BlockServer::handle_getranges;
 	handlers[MESSAGE_TYPE_CGOODBYE] = &BlockServer::handle_cgoodbye;
+	handlers[MESSAGE_TYPE_HEARTBEAT] = &BlockServer::handle_heartbeat;
+}
+
+BlockServer::~BlockServer()
+{
+    report_gauges(0, 0);
 }
 
 void BlockServer::start()
 {
-    socket.open();
+    TransportThread attached(*transport);
+    socket->open();
+    session_end = deadline ? transport->now_ms() + deadline : 0;
     
     // Send the file information
-    message_queue.push_back(Message(id, MESSAGE_TYPE_INFO, file_info, path));
-    logger << Logger::INFO << "Sending initial file information\n";
+    enqueue(Message(id, MESSAGE_TYPE_INFO, file_info, path));
+    MSYNC_LOG(logger, INFO) << "Sending initial file information\n";
     
     // Begin serving the blocks.  It doesn't matter if the clients can't
-    // get the blocks; missing blocks will be resent later.
-    for (BlockInfo i(file_info); i < file_info.get_block_count(); i++) {
+    // get the blocks; missing blocks will be resent later.  Blocks are read
+    // by one thread and sent by one thread per stripe, so that disk latency
+    // never stalls the sockets; this thread only handles control messages
+    // and repairs.
+    stripes.clear();
+    for (unsigned int k = 0; k < stripe_count; k++) {
+        stripes.push_back(std::tr1::shared_ptr<Stripe>(new Stripe(*transport, group, port + k, logger)));
+        stripes.back()->socket->set_send_timestamps(true);
+        stripes.back()->socket->set_offload(true);
+        stripes.back()->socket->set_buffer_size(rate / stripe_count, sizeof(Header) + sizeof(BlockInfo) + BLOCKSIZE);
+        stripes.back()->socket->open();
+    }
+    
+    reading = true;
+    stopped = false;
+    active_senders = stripe_count;
+    std::vector<std::thread> threads;
+    threads.push_back(std::thread(&BlockServer::read_blocks, this));
+    for (unsigned int k = 0; k < stripe_count; k++) {
+        threads.push_back(std::thread(&BlockServer::send_blocks, this, stripes[k].get()));
+    }
+    typedef TransportFactory::Clock clock;
+    clock::time_point goodbye = transport->now() + std::chrono::milliseconds(GOODBYE_INTERVAL);
+    try {
+        while (active_senders > 0) {
+        
+            // There is no end of the pass in carousel mode, so say goodbye
+            // as we go, letting finished clients leave.  Clients that join
+            // late need the file information, and learn where to send their
+            // control messages from it, so repeat that too.
+            clock::time_point now = transport->now();
+            if (carousel && now >= goodbye) {
+                enqueue(Message(id, MESSAGE_TYPE_INFO, file_info, path));
+                if (!host_info.empty() || acks_pending()) {
+                    enqueue_goodbye();
+                }
+                goodbye = now + std::chrono::milliseconds(GOODBYE_INTERVAL);
+            }
+            check_timeouts();
+            select(100);
+        }
+    } catch (...) {
+        // A simulated clock doesn't move for senders that are pacing
+        // themselves while this thread is counted as running
+        stopped = true;
+        transport->detach_thread();
+        for (unsigned int k = 0; k < threads.size(); k++) {
+            threads[k].join();
+        }
+        transport->attach_thread();
+        throw;
+    }
+    for (unsigned int k = 0; k < threads.size(); k++) {
+        threads[k].join();
+    }
+    if (!error.empty()) {
+        throw error;
+    }
+    if (stopped) {
+        return;
+    }
+    
+    // Now process remaining requests until we're finished.  Every so often
+    // tell the clients that the pass is over, so that each one either
+    // confirms that it's done or asks for the blocks it's missing.  Clients
+    // whose hello was lost repeat it, so keep saying goodbye for a little
+    // while even if nobody has joined.
+    goodbye = transport->now();
+    clock::time_point grace = goodbye + std::chrono::milliseconds(HELLO_GRACE);
+    while ((!host_info.empty() || !message_queue.empty() || !reply_queue.empty() || acks_pending() ||
+            transport->now() < grace) && !stopped) {
+        clock::time_point now = transport->now();
+        if (now >= goodbye && (!host_info.empty() || acks_pending() || now < grace)) {
+            enqueue_goodbye();
+            goodbye = now + std::chrono::milliseconds(GOODBYE_INTERVAL);
+        }
+        enqueue_repairs();
+        check_timeouts();
+        select(message_queue.empty() && reply_queue.empty() ? LEASE_TICK : -1);
+    }
+    if (catchup) {
+        catchup_blocks += catchup->get_blocks_sent();
+        catchup.reset();
+    }
+}
+
+void BlockServer::set_rate(unsigned long rate)
+{
+    this->rate = rate;
+    current_rate = rate;
+}
+
+void BlockServer::set_stripes(unsigned int count)
+{
+    stripe_count = count ? count : 1;
+}
+
+void BlockServer::set_carousel(bool enabled, bool prioritise)
+{
+    this->carousel = enabled;
+    this->prioritise = prioritise;
+}
+
+void BlockServer::set_lease_timeout(unsigned long timeout)
+{
+    lease_timeout = timeout;
+}
+
+void BlockServer::set_deadline(unsigned long deadline)
+{
+    this->deadline = deadline;
+}
+
+void BlockServer::set_max_hosts(size_t count)
+{
+    max_hosts = count;
+}
+
+void BlockServer::stop()
+{
+    stopped = true;
+}
+
+void BlockServer::set_transport(TransportFactory& factory)
+{
+    transport = &factory;
+    socket.reset(transport->create(group, 0, logger));
+    *socket << Address(group, port);
+}
+
+void BlockServer::set_catchup(bool enabled)
+{
+    catchup_enabled = enabled;
+}
+
+void BlockServer::set_relay()
+{
+    relaying = true;
+}
+
+void BlockServer::relay(const Message& message)
+{
+    std::lock_guard<std::mutex> lock(feed_mutex);
+    if (feed.size() >= RELAY_FEED_LIMIT && message.get_type() == MESSAGE_TYPE_BLOCK) {
+        feed_drops++;
+        return;
+    }
+    feed.push_back(message);
+    feed.back().set_sender(id);
+}
+
+void BlockServer::end_relay()
+{
+    std::lock_guard<std::mutex> lock(feed_mutex);
+    feed_closed = true;
+}
+
+BlockServer::Stripe::Stripe(TransportFactory& transport, const std::string& group, unsigned short port, Logger& logger) :
+    socket(transport.create(group, 0, logger)),
+    prefetched(PREFETCH_BLOCKS, Message(BLOCKSIZE))
+{
+    *socket << Address(group, port);
+}
+
+void BlockServer::read_blocks()
+{
+    if (relaying) {
+        relay_blocks();
+        return;
+    }
+    try {
+        BlockReader reader(source, file_info, id);
+        Message message(BLOCKSIZE);
+        uint64_t count = file_info.get_block_count();
+        do {
+            for (uint64_t i = 0; i < count && !stopped; i++) {
+                if (has_wanted) {
+                    prefetch_wanted(reader);
+                }
+            
+                // Skip over holes without reading them
+                uint64_t next = reader.next_data(i);
+                if (next > i) {
+                    reader.add_empty(i, next - i);
+                    i = next;
+                }
+                uint64_t start = Metrics::now();
+                if (reader.read(BlockInfo(file_info, i), message)) {
+                    uint64_t end = Metrics::now();
+                    Metrics::record(STAGE_BLOCK_READ, end > start ? end - start : 0);
+                    if (Tracer::sampled(i)) {
+                        Tracer::span("read", i, start, end);
+                    }
+                    MSYNC_LOG_LIMITED(logger, FINE) << "Enqueueing block #" << i << " (" << message.get_length() << " bytes)\n";
+                    prefetch(*stripes[i % stripes.size()], message);
+                }
+                if (reader.extents_full() && reader.flush(message)) {
+                    prefetch(*stripes.front(), message);
+                }
+            }
+            if (reader.flush(message)) {
+                prefetch(*stripes.front(), message);
+            }
+        } while (carousel && count > 0 && !stopped);
+    } catch (std::string& message) {
+        set_error(message);
+    }
+    reading = false;
+}
+
+const FileInfo& BlockServer::get_file_info() const
+{
+    return file_info;
+}
+
+uint64_t BlockServer::get_packets_sent() const
+{
+    return packets_sent;
+}
+
+uint64_t BlockServer::get_repairs_sent() const
+{
+    return repairs_sent;
+}
+
+uint64_t BlockServer::get_catchup_blocks() const
+{
+    return catchup_blocks;
+}
+
+void BlockServer::relay_blocks()
+{
+    // Blocks are forwarded as soon as they arrive rather than once the file
+    // is complete.  A block that arrives after end_relay() is left for the
+    // repair rounds.
+    std::list<Message> messages;
+    while (!stopped) {
+        bool closed;
+        {
+            std::lock_guard<std::mutex> lock(feed_mutex);
+            messages.swap(feed);
+            closed = feed_closed;
+        }
+        if (messages.empty()) {
+            if (closed) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        for (std::list<Message>::iterator i = messages.begin(); i != messages.end(); i++) {
+            if (i->get_type() == MESSAGE_TYPE_BLOCK) {
+                uint64_t block = i->get_metadata<BlockInfo>();
+                prefetch(*stripes[block % stripes.size()], *i);
+            } else {
+                prefetch(*stripes.front(), *i);
+            }
+        }
+        messages.clear();
+    }
+    {
+        std::lock_guard<std::mutex> lock(feed_mutex);
+        if (feed_drops) {
+            MSYNC_LOG(logger, INFO) << "Dropped " << feed_drops << " relayed blocks that arrived faster than they could be sent\n";
+        }
+    }
+    reading = false;
+}
+
+void BlockServer::set_error(const std::string& message)
+{
+    std::lock_guard<std::mutex> lock(error_mutex);
+    if (error.empty()) {
+        error = message;
+    }
+    stopped = true;
+}
+
+bool BlockServer::prefetch(Stripe& stripe, Message& message)
+{
+    message.set_stamp(Metrics::now());
+    while (!stripe.prefetched.push(message)) {
+        if (stopped) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+    return true;
+}
+
+void BlockServer::prefetch_wanted(BlockReader& reader)
+{
+    Message message(BLOCKSIZE);
+    for (unsigned int k = 0; k < PRIORITY_RATIO; k++) {
+        uint64_t block;
+        {
+            std::lock_guard<std::mutex> lock(wanted_mutex);
+            if (!wanted.pop(block)) {
+                has_wanted = false;
+                break;
+            }
+        }
+        if (reader.read(BlockInfo(file_info, block), message)) {
+            prefetch(*stripes[block % stripes.size()], message);
+        }
+    }
+    if (reader.flush(message)) {
+        prefetch(*stripes.front(), message);
+    }
+}
+
+void BlockServer::send_blocks(Stripe* stripe)
+{
+    TransportThread attached(*transport);
+    typedef TransportFactory::Clock clock;
+    clock::time_point deadline = transport->now();
+    std::vector<Message> batch(SEND_BATCH, Message(BLOCKSIZE));
     
-        // Make sure the message queue doesn't grow beyond size 5...we don't 
-        // want to use too much memory
-        if (message_queue.size() < 5) {
-            message_queue.push_back(Message(id, MESSAGE_TYPE_BLOCK, i, BLOCKSIZE));
-            Message& message = message_queue.back();
-            input.seekg(BLOCKSIZE * i);
-            input >> message;
+    try {
+        while (!stopped) {
+            if (!stripe->prefetched.pop(batch[0])) {
+                // Check the ring once more after the reader finishes, in
+                // case it pushed its last message after the pop above
+                if (!reading) {
+                    if (!stripe->prefetched.pop(batch[0])) {
+                        break;
+                    }
+                } else {
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+                    continue;
+                }
+            }
             
-            logger << Logger::INFO << "Enqueueing block #" << i << " (" << message.get_length() << " bytes)\n";
+            // Add the messages that are already waiting, without waiting
+            // for more.  A paced stream keeps its bursts short.
+            unsigned long stripe_rate = current_rate / stripes.size();
+            size_t limit = batch.size();
+            if (stripe_rate) {
+                limit = std::min(limit, std::max((size_t)1, (size_t)(stripe_rate / 1000 * SEND_BURST / BLOCKSIZE)));
+            }
+            size_t count = 1;
+            while (count < limit && stripe->prefetched.pop(batch[count])) {
+                count++;
+            }
+            size_t length = 0;
+            for (size_t k = 0; k < count; k++) {
+                length += batch[k].get_length();
+            }
+            
+            // Pace the stream to the current rate.  If we've fallen
+            // behind, don't try to catch up with a burst.
+            if (stripe_rate) {
+                clock::time_point now = transport->now();
+                if (deadline < now) {
+                    deadline = now;
+                } else {
+                    transport->sleep_until(deadline);
+                }
+                deadline += std::chrono::nanoseconds(length * 1000000000ULL / stripe_rate);
+            }
+            for (size_t k = 0; k < count; k++) {
+                mark_sent(batch[k]);
+            }
+            stripe->socket->send(&batch[0], count);
+            packets_sent += count;
+        }
+    } catch (std::string& message) {
+        set_error(message);
+    }
+    active_senders--;
+}
+
+void BlockServer::enqueue_repairs()
+{
+    // Nobody else needs the repairs for the last client, so don't make the
+    // rest of the group receive them
+    const Address* unicast = host_info.size() == 1 ? &host_info.begin()->second.address : 0;
+    std::list<Message> repaired;
+    Message block(BLOCKSIZE);
+    uint64_t start;
+    uint64_t blocks = 0;
+    while (message_queue.size() + reply_queue.size() + repaired.size() < REPAIR_QUEUE_DEPTH && repair_queue.pop(start)) {
+        if (repairs.read(BlockInfo(file_info, start), block)) {
+            repaired.push_back(block);
+            blocks++;
+        }
+        if ((repairs.extents_full() || repair_queue.empty()) && repairs.flush(block)) {
+            repaired.push_back(block);
+        }
+    }
+    
+    // Only resent blocks count as repairs; empty ones go out as extents
+    repairs_sent += blocks;
+    Metrics::add(METRIC_REPAIRS_SENT, blocks);
+    for (std::list<Message>::iterator i = repaired.begin(); i != repaired.end(); i++) {
+        if (unicast) {
+            reply_queue.push_back(std::make_pair(*unicast, *i));
+        } else {
+            enqueue(*i);
+        }
+    }
+}
+
+void BlockServer::enqueue_goodbye()
+{
+    size_t count = 0;
+    for (size_t i = 0; i < acknowledged.size(); i++) {
+        count += acknowledged[i].size();
+    }
+    HostFilter filter(count);
+    for (size_t i = 0; i < acknowledged.size(); i++) {
+        for (size_t k = 0; k < acknowledged[i].size(); k++) {
+            filter.insert(acknowledged[i][k]);
         }
-        select(-1);
     }
     
-    // Now process remaining requests until we're finished
-    while (!host_info.empty() || message_queue.size() > 0) {
-        select(-1);
+    uint32_t segments = filter.get_segment_count();
+    for (uint32_t i = 0; i < segments; i++) {
+        std::string body(filter.get_segment(i), FILTER_SEGMENT_BYTES);
+        enqueue(Message(id, MESSAGE_TYPE_SGOODBYE, GoodbyeInfo(file_info, i, segments), body));
+    }
+    MSYNC_LOG(logger, FINE) << "Acknowledging " << count << " hosts in " << segments << " goodbyes\n";
+    
+    // Start a new round, forgetting the oldest
+    acknowledged.push_back(std::vector<unsigned int>());
+    if (acknowledged.size() > ACK_ROUNDS) {
+        acknowledged.pop_front();
+    }
+}
+
+bool BlockServer::acks_pending() const
+{
+    for (size_t i = 0; i < acknowledged.size(); i++) {
+        if (!acknowledged[i].empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void BlockServer::touch_host(unsigned int id, const Address& address, bool join)
+{
+    uint64_t expiry = transport->now_ms() + lease_timeout;
+    std::map<HostInfo, Lease>::iterator i = host_info.find(HostInfo(id));
+    if (i != host_info.end()) {
+        // The wheel timer is left alone; when it fires it is moved to the
+        // new expiry time
+        i->second.expiry = expiry;
+        i->second.address = address;
+    } else if (join) {
+        if (host_info.size() >= max_hosts) {
+            MSYNC_LOG(logger, WARNING) << "Ignoring host " << id << "; session is full\n";
+            return;
+        }
+        Lease lease = { expiry, expiry, address };
+        host_info.insert(std::make_pair(HostInfo(id), lease));
+        leases.schedule(id, expiry);
+    }
+}
+
+bool BlockServer::offer_catchup(unsigned int id, const Address& address, uint64_t blocks)
+{
+    // Catch-up is for the tail of a session; a relay's partial file has
+    // been moved by the time the tail arrives
+    if (!catchup_enabled || carousel || relaying || reading || host_info.size() > CATCHUP_HOSTS ||
+            blocks < CATCHUP_BLOCKS) {
+        return false;
+    }
+    
+    // A client that has connected, or hasn't after a few offers, falls
+    // back to ordinary repairs
+    if ((catchup && catchup->connected(id)) || catchup_offers[id] >= CATCHUP_OFFERS) {
+        return false;
+    }
+    if (!catchup) {
+        try {
+            catchup.reset(new CatchupSender(source, logger));
+            catchup_port = catchup->start();
+        } catch (std::string& message) {
+            MSYNC_LOG(logger, WARNING) << "Could not start catch-up: " << message << "\n";
+            catchup.reset();
+            catchup_enabled = false;
+            return false;
+        }
+    }
+    
+    // Until the client connects, its requests are answered with the offer
+    // alone, so that a lost offer is made again on its next request
+    catchup_offers[id]++;
+    catchup->offer(id, address.ip_address);
+    reply_queue.push_back(std::make_pair(address, Message(this->id, MESSAGE_TYPE_CATCHUP, CatchupInfo(file_info, catchup_port))));
+    MSYNC_LOG(logger, INFO) << "Offering host " << id << " a catch-up stream for " << blocks << " blocks\n";
+    return true;
+}
+
+void BlockServer::check_timeouts()
+{
+    uint64_t now = transport->now_ms();
+    std::vector<std::pair<unsigned int, uint64_t> > expired;
+    leases.advance(now, expired);
+    for (size_t k = 0; k < expired.size(); k++) {
+        std::map<HostInfo, Lease>::iterator i = host_info.find(HostInfo(expired[k].first));
+        
+        // Ignore timers for hosts that have left, or that left and joined
+        // again with a new timer
+        if (i == host_info.end() || i->second.check != expired[k].second) {
+            continue;
+        }
+        if (i->second.expiry > now) {
+            i->second.check = i->second.expiry;
+            leases.schedule(expired[k].first, i->second.expiry);
+        } else {
+            MSYNC_LOG(logger, WARNING) << "Host " << expired[k].first << " timed out\n";
+            host_info.erase(i);
+        }
+    }
+    
+    if (session_end && now >= session_end && !stopped) {
+        MSYNC_LOG(logger, WARNING) << "Session deadline passed with " << host_info.size() << " hosts remaining\n";
+        stop();
     }
 }
 
 void BlockServer::select(long timeout)
 {
-    // Read/write any oustanding messages
-    BlockSocket::Status status = socket.select(timeout, !message_queue.empty());
-    if (status == BlockSocket::READ || status == BlockSocket::BOTH) {
+    // Read/write any oustanding messages.  Replies meant for a single
+    // host go out first, by unicast.
+    Transport::Status status = socket->select(timeout, !message_queue.empty() || !reply_queue.empty());
+    if (status == Transport::READ || status == Transport::BOTH) {
         process_message();
     } 
-    if (status == BlockSocket::WRITE || status == BlockSocket::BOTH) {
-        socket << message_queue.front();
-        message_queue.pop_front();
+    if (status == Transport::WRITE || status == Transport::BOTH) {
+        if (!reply_queue.empty()) {
+            mark_sent(reply_queue.front().second);
+            *socket << reply_queue.front().first << reply_queue.front().second << Address(group, port);
+            reply_queue.pop_front();
+        } else {
+            mark_sent(message_queue.front());
+            *socket << message_queue.front();
+            message_queue.pop_front();
+        }
+        packets_sent++;
+    }
+    report_gauges(host_info.size(), message_queue.size() + reply_queue.size() + repair_queue.size());
+}
+
+void BlockServer::enqueue(const Message& message)
+{
+    message_queue.push_back(message);
+    message_queue.back().set_stamp(Metrics::now());
+}
+
+void BlockServer::mark_sent(Message& message)
+{
+    // Blocks carry the time they were sent, so that clients can measure
+    // the one-way delay
+    uint64_t now = Metrics::now();
+    uint64_t queued = message.get_stamp();
+    if (queued) {
+        Metrics::record(STAGE_SEND_QUEUE, now > queued ? now - queued : 0);
+    }
+    if (message.get_type() == MESSAGE_TYPE_BLOCK) {
+        BlockInfo& info = message.get_metadata<BlockInfo>();
+        info.set_sent(now);
+        if (queued && Tracer::sampled(info)) {
+            Tracer::span("queued", info, queued, now);
+        }
+    }
+}
+
+void BlockServer::report_gauges(int64_t hosts, int64_t depth)
+{
+    // Gauges are kept as sums of changes, so that several servers in one
+    // process add up
+    if (hosts != reported_hosts) {
+        Metrics::add(METRIC_HOSTS, hosts - reported_hosts);
+        reported_hosts = hosts;
+    }
+    if (depth != reported_depth) {
+        Metrics::add(METRIC_SEND_QUEUE_DEPTH, depth - reported_depth);
+        reported_depth = depth;
     }
 }
 
@@ -86,7 +688,7 @@ void BlockServer::process_message()
 {
     Message message(4096);
 	Address address;
-    socket >> message >> address;
+    *socket >> message >> address;
     
 
 	typedef std::map<unsigned int, message_handler> handler_map;
@@ -95,7 +697,7 @@ void BlockServer::process_message()
 		message_handler handler = i->second;
 		(this->*handler)(message, address);
 	} else {
-		logger << Logger::FINE << "Unknown message type!\n";
+		MSYNC_LOG(logger, FINE) << "Unknown message type!\n";
 	}
 }
 
@@ -104,8 +706,12 @@ void BlockServer::handle_chello(const Message& message, const Address& address)
 {
     // The client wishes to be added to the client list
 	const HostInfo& info = message.get_metadata<HostInfo>();
-    host_info.insert(info);
-    logger << Logger::FINE << "Found host " << info.get_id() << "\n";
+    touch_host(info.get_id(), address, true);
+    
+    // Clients repeat their hello until it is acknowledged, so that a lost
+    // hello doesn't leave them out of the session
+    reply_queue.push_back(std::make_pair(address, Message(id, MESSAGE_TYPE_SHELLO, info)));
+    MSYNC_LOG(logger, FINE) << "Found host " << info.get_id() << "\n";
 }
 
 void BlockServer::handle_getinfo(const Message& message, const Address& address)
@@ -113,29 +719,125 @@ void BlockServer::handle_getinfo(const Message& message, const Address& address)
     // The client has requested information about the file served by 
     // this server instance.
 	// Add this host to the set of remaining hosts
-    host_info.insert(message.get_metadata<HostInfo>());
-    message_queue.push_back(Message(id, MESSAGE_TYPE_INFO, file_info, path)); 
-    logger << Logger::FINE << "Request from host for file information\n";
+    touch_host(message.get_sender(), address, true);
+    reply_queue.push_back(std::make_pair(address, Message(id, MESSAGE_TYPE_INFO, file_info, path)));
+    MSYNC_LOG(logger, FINE) << "Request from host for file information\n";
 }
 
 void BlockServer::handle_getblock(const Message& message, const Address& address)
 
 {
     // The client has requested a specific block from the served file.
-	host_info.insert(message.get_metadata<HostInfo>());
+	touch_host(message.get_sender(), address, true);
+    Metrics::add(METRIC_REPAIR_REQUESTS);
     const BlockInfo& i = message.get_metadata<BlockInfo>();
-    if (i.get_file_info() == file_info) {
-    	message_queue.push_back(Message(id, MESSAGE_TYPE_BLOCK, i, BLOCKSIZE));
-        input.seekg(BLOCKSIZE * i);
-        input >> message_queue.back();
+    if (i.get_file_info() == file_info && relaying && reading) {
+        // The block may not have arrived from upstream yet
+        repair_queue.add(i, 1);
+    } else if (i.get_file_info() == file_info) {
+        Message block(BLOCKSIZE);
+        if (repairs.read(i, block)) {
+            enqueue(block);
+            repairs_sent++;
+            Metrics::add(METRIC_REPAIRS_SENT);
+        }
+        if (repairs.flush(block)) {
+            enqueue(block);
+        }
+    }
+    MSYNC_LOG_LIMITED(logger, FINE) << "Request from host for block " << i << "\n";
+}
+
+void BlockServer::handle_getranges(const Message& message, const Address& address)
+{
+    // The client has requested runs of blocks it is missing.  They are
+    // queued and sent a few at a time, in between other messages.
+	touch_host(message.get_sender(), address, true);
+    Metrics::add(METRIC_REPAIR_REQUESTS);
+    const FileInfo& info = message.get_metadata<FileInfo>();
+    if (info == file_info) {
+        Array<Extent> extents = message.get_array<Extent>();
+        uint64_t count = file_info.get_block_count();
+        uint64_t blocks = 0;
+        for (unsigned int i = 0; i < extents.length; i++) {
+            blocks += extents.data[i].get_count();
+        }
+        if (offer_catchup(message.get_sender(), address, blocks)) {
+            return;
+        }
+        
+        // In carousel mode the requests either jump the queue in the
+        // reader thread or are left for the next cycle.  Either way they
+        // are merged with the ranges already queued, so that clients asking
+        // for the same blocks again don't make them be read and sent twice.
+        for (unsigned int i = 0; i < extents.length && (prioritise || !carousel); i++) {
+            uint64_t start = extents.data[i].get_start();
+            if (start < count && extents.data[i].get_count() > 0) {
+                uint64_t length = std::min(extents.data[i].get_count(), count - start);
+                if (carousel) {
+                    std::lock_guard<std::mutex> lock(wanted_mutex);
+                    wanted.add(start, length);
+                    has_wanted = true;
+                } else {
+                    repair_queue.add(start, length);
+                }
+            }
+        }
+        MSYNC_LOG(logger, FINE) << "Request from host for " << extents.length << " block ranges\n";
     }
-    logger << Logger::FINE << "Request from host for block " << i << "\n";
 }
 
 void BlockServer::handle_cgoodbye(const Message& message, const Address& address)
 {
     // The client has finished receiving all blocks, and will shut down.
-	const HostInfo& i = message.get_metadata<HostInfo>();
-    logger << Logger::INFO << "Host " << i.get_id() << " is shutting down\n";
+	HostInfo i(message.get_sender());
+    MSYNC_LOG(logger, INFO) << "Host " << i.get_id() << " is shutting down\n";
     host_info.erase(i);            
+    acknowledged.back().push_back(i.get_id());
+}
+
+void BlockServer::handle_heartbeat(const Message& message, const Address& address)
+{
+    // The client is still alive.  Heartbeats don't add hosts to the
+    // session, so a late heartbeat can't resurrect a client that left.
+    touch_host(message.get_sender(), address, false);
+    
+    // Clients that have received blocks report how the path to them is
+    // doing in the body
+    Array<PathReport> reports = message.get_array<PathReport>();
+    if (reports.length == 1) {
+        const PathReport& report = reports.data[0];
+        MSYNC_LOG(logger, FINE) << "Host " << message.get_sender() << " sees a delay of " << report.get_delay()
+            << "us, queueing of " << report.get_queueing() << "us and jitter of " << report.get_jitter() << "us\n";
+        adjust_rate(report.get_queueing());
+    }
+}
+
+void BlockServer::adjust_rate(uint32_t queueing)
+{
+    if (!rate) {
+        return;
+    }
+    
+    // React to the worst client, but only change the rate once an
+    // interval, so that every client has had a chance to report the
+    // effect of the last change
+    worst_queueing = std::max(worst_queueing, queueing);
+    uint64_t now = transport->now_ms();
+    if (now < rate_adjusted + RATE_ADJUST_INTERVAL) {
+        return;
+    }
+    unsigned long current = current_rate;
+    unsigned long adjusted = current;
+    if (worst_queueing > RATE_DELAY_TARGET) {
+        adjusted = std::max(current - current / 8, rate / RATE_FLOOR_DIVISOR);
+    } else if (worst_queueing < RATE_DELAY_TARGET / 2) {
+        adjusted = std::min(current + rate / 32, rate);
+    }
+    if (adjusted != current) {
+        MSYNC_LOG(logger, FINE) << "Queueing delay of " << worst_queueing << "us; sending at " << adjusted << " bytes/s\n";
+        current_rate = adjusted;
+    }
+    worst_queueing = 0;
+    rate_adjusted = now;
 }
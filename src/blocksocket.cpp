@@ -1,14 +1,25 @@
 #include "blocksocket.hpp"
 #include "logger.hpp"
+#include "metrics.hpp"
 
 #ifdef WINDOWS
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #else
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
 #endif
 
 #ifndef INVALID_SOCKET
@@ -29,14 +40,85 @@ const char* errmsg()
 
 #include <cerrno>
 #include <cstring>
+#include <cstddef>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <thread>
+
+// Size of the buffer packets are read into before they pass through an
+// impairment; large enough for any UDP packet
+#define IMPAIRED_BUFFER 65536
+
+// Maximum number of packets moved into an impairment at once
+#define IMPAIRED_DRAIN_LIMIT 256
+
+// Number of sent packets whose send times are kept until the kernel
+// reports when they were transmitted
+#define SEND_STAMP_SLOTS 1024
+
+// Number of packets sent between reads of the transmit times
+#define SEND_STAMP_BATCH 16
+
+// Size of the buffer that ancillary data is received into
+#define CONTROL_BUFFER 256
+
+// Socket buffers are sized to hold this much traffic at the expected rate,
+// in milliseconds, and at least SOCKET_BUFFER_PACKETS packets
+#define SOCKET_BUFFER_TIME 200
+#define SOCKET_BUFFER_PACKETS 1024
+
+// Largest socket buffer asked for, in bytes
+#define SOCKET_BUFFER_LIMIT (256 * 1024 * 1024)
+
+// Memory the kernel charges to a socket buffer for each packet on top of
+// its payload, in bytes; roughly the size of a socket buffer header plus
+// the rounding of the packet's allocation
+#define SOCKET_PACKET_OVERHEAD 1024
+
+// Maximum number of packets handed to the kernel in one segmented send;
+// the kernel's own limit
+#define SEGMENT_LIMIT 64
+
+// Largest segmented send, in bytes; the largest UDP payload
+#define SEGMENT_BYTES 65507
+
+// Size of the buffer that runs of packets coalesced by the kernel are read
+// into; large enough for any run
+#define COALESCED_BUFFER 65536
 
 using namespace Msync;
 
+ImpairmentProfile BlockSocket::default_impairment;
+
 BlockSocket::BlockSocket(const std::string& group, unsigned short port, Logger& logger) : 
     sock(INVALID_SOCKET),
+    logger(logger),
+    impairment_profile(default_impairment),
+    coalescing(false),
+    segment_size(0),
     timeout(5000),
-    logger(logger)
+    reuse(false),
+    filter_index(0),
+    filter_count(1),
+    filter_types(0),
+    filter_sender(0),
+    has_filter_sender(false),
+    filter_peers(false),
+    received_start(0),
+    received_end(0),
+    send_timestamps(false),
+    send_count(0),
+    last_arrival(0),
+    buffer_rate(0),
+    buffer_packet_size(0),
+    drop_counter(0),
+    receive_drops(0),
+    offload(false),
+    segmenting(false),
+    segment_offset(0),
+    segment_end(0),
+    segment_stamp(0)
 {
     this->group.sin_family = AF_INET;
     this->group.sin_addr.s_addr = inet_addr(group.c_str());
@@ -58,7 +140,7 @@ BlockSocket::BlockSocket(const std::string& group, unsigned short port, Logger&
 BlockSocket::~BlockSocket()
 {
     if (sock != INVALID_SOCKET) {
-        logger << Logger::INFO << "Disconnecting\n";
+        MSYNC_LOG(logger, INFO) << "Disconnecting\n";
         close();
     }
 #ifdef WINDOWS
@@ -69,40 +151,50 @@ BlockSocket::~BlockSocket()
 void BlockSocket::open()
 {
     // Create a UDP socket
-    logger << Logger::FINE << "Creating UDP socket\n";
+    MSYNC_LOG(logger, FINE) << "Creating UDP socket\n";
     sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
     if (sock == INVALID_SOCKET) {
-        logger << Logger::ERR << "Could not create socket\n";
+        MSYNC_LOG(logger, ERR) << "Could not create socket\n";
         throw std::string(errmsg());
     }
 
 	
-	/*
     // Set reuse option so that multiple sockets can bind to the same
     // port on the same machine
-
-    
-    int yes = 1;
+    if (reuse) {
+        int yes = 1;
 #ifdef SO_REUSEPORT
-    logger << Logger::FINE << "Setting SO_REUSEPORT\n";
-    if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (char*)&yes, sizeof(yes)) < 0) {
-        throw std::string(errmsg());
-    }
+        MSYNC_LOG(logger, FINE) << "Setting SO_REUSEPORT\n";
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (char*)&yes, sizeof(yes)) < 0) {
+            throw std::string(errmsg());
+        }
 #endif
-    logger << Logger::FINE << "Setting SO_REUSEADDR\n";
-    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char*)&yes, sizeof(yes)) < 0) {
-        throw std::string(errmsg());
+        MSYNC_LOG(logger, FINE) << "Setting SO_REUSEADDR\n";
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char*)&yes, sizeof(yes)) < 0) {
+            throw std::string(errmsg());
+        }
     }
-	*/
     
-    // Request membership in the multicast group
-    logger << Logger::INFO << "Joining multicast group " << inet_ntoa(group.sin_addr) << "\n";
-    ip_mreq mreq;
-    mreq.imr_multiaddr.s_addr = group.sin_addr.s_addr;
-    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
-    if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char*)&mreq, sizeof(ip_mreq)) < 0) {
+#ifdef IP_MULTICAST_ALL
+    // Only receive traffic for the groups this socket joined.  Otherwise a
+    // relay's upstream socket would also see its own downstream group.
+    int all = 0;
+    if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_ALL, (char*)&all, sizeof(all)) < 0) {
         throw std::string(errmsg());
     }
+#endif
+
+    // Request membership in the multicast group.  Unicast sockets, such as
+    // the clients' control sockets, skip this.
+    if (IN_MULTICAST(ntohl(group.sin_addr.s_addr))) {
+        MSYNC_LOG(logger, INFO) << "Joining multicast group " << inet_ntoa(group.sin_addr) << "\n";
+        ip_mreq mreq;
+        mreq.imr_multiaddr.s_addr = group.sin_addr.s_addr;
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char*)&mreq, sizeof(ip_mreq)) < 0) {
+            throw std::string(errmsg());
+        }
+    }
 
     // Bind to the given port
     sockaddr_in address;
@@ -118,11 +210,111 @@ void BlockSocket::open()
 	if (getsockname(sock, (sockaddr *)&address, &length) < 0) {
 		throw std::string(strerror(errno));
 	}
-    logger << Logger::INFO << "Bound to port " << ntohs(address.sin_port) << "\n";
+    MSYNC_LOG(logger, INFO) << "Bound to port " << ntohs(address.sin_port) << "\n";
+    
+#ifdef SO_TIMESTAMPING
+    // Have the kernel stamp each packet as it arrives, by the device if it
+    // can.  Transmit times are only asked for on sockets that send, since
+    // they are returned on the error queue.
+    int stamping = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+        SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+    if (send_timestamps) {
+        stamping |= SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+        send_stamps.assign(SEND_STAMP_SLOTS, 0);
+        send_count = 0;
+    }
+    if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &stamping, sizeof(stamping)) < 0) {
+        MSYNC_LOG(logger, FINE) << "Could not enable packet timestamps: " << errmsg() << "\n";
+        send_stamps.clear();
+    }
+#endif
+    last_arrival = 0;
+    
+#ifdef SO_RXQ_OVFL
+    // Have the kernel report how many packets it has dropped with each
+    // packet read
+    int overflow = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &overflow, sizeof(overflow)) < 0) {
+        MSYNC_LOG(logger, FINE) << "Could not enable drop counting: " << errmsg() << "\n";
+    }
+#endif
+    drop_counter = 0;
+    
+    if (buffer_packet_size) {
+        // Buffers are charged for the kernel's overhead as well as the
+        // data, so a burst of small packets fills them faster than the
+        // rate alone suggests
+        uint64_t packets = (uint64_t)buffer_rate * SOCKET_BUFFER_TIME / 1000 / buffer_packet_size;
+        packets = std::max(packets, (uint64_t)SOCKET_BUFFER_PACKETS);
+        uint64_t bytes = std::min(packets * (buffer_packet_size + SOCKET_PACKET_OVERHEAD), (uint64_t)SOCKET_BUFFER_LIMIT);
+#ifdef SO_RCVBUFFORCE
+        size_buffer(SO_RCVBUF, SO_RCVBUFFORCE, bytes, "Receive");
+        size_buffer(SO_SNDBUF, SO_SNDBUFFORCE, bytes, "Send");
+#else
+        size_buffer(SO_RCVBUF, 0, bytes, "Receive");
+        size_buffer(SO_SNDBUF, 0, bytes, "Send");
+#endif
+    }
+    
+    // Runs of packets can be handed to the kernel as one buffer, which is
+    // split into packets as late as possible, and runs that arrive
+    // together can be read in one call
+    segmenting = false;
+    coalescing = false;
+    segment_offset = segment_end = 0;
+#ifdef UDP_SEGMENT
+    segmenting = offload;
+#endif
+#ifdef UDP_GRO
+    if (offload) {
+        int gro = 1;
+        if (setsockopt(sock, IPPROTO_UDP, UDP_GRO, &gro, sizeof(gro)) < 0) {
+            MSYNC_LOG(logger, FINE) << "Could not enable receive offload: " << errmsg() << "\n";
+        } else {
+            coalescing = true;
+            coalesced_buffer.resize(COALESCED_BUFFER);
+        }
+    }
+#endif
+    
+    if (impairment_profile.enabled()) {
+        impair();
+        impaired_buffer.resize(IMPAIRED_BUFFER);
+        MSYNC_LOG(logger, INFO) << "Emulating network conditions: " << impairment_profile.spec << "\n";
+    }
+}
+
+void BlockSocket::impair()
+{
+    // Each part of the socket's identity is mixed into the seed, so that
+    // sockets sharing a port lose different packets, and the same ones on
+    // every run whatever order the sockets were opened in
+    uint32_t parts[] = { ntohl(group.sin_addr.s_addr), ntohs(group.sin_port), filter_index, filter_count };
+    uint32_t seed = impairment_profile.seed;
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        seed = (seed ^ parts[i]) * 2654435761U;
+        seed ^= seed >> 16;
+    }
+    impairment.reset(new Impairment(impairment_profile, seed));
 }
 
 BlockSocket::Status BlockSocket::select(long timeout, bool poll_read)
 {
+    // An impaired socket reads packets as soon as they arrive, but is only
+    // readable once the impairment lets one through
+    if (impairment) {
+        long due = impairment->next_due(Impairment::Clock::now());
+        if (due >= 0 && (timeout < 0 || due < timeout)) {
+            timeout = due;
+        }
+    }
+    
+    // So is a socket with packets left from a coalesced read
+    bool pending = segment_offset < segment_end;
+    if (pending) {
+        timeout = 0;
+    }
+    
     fd_set readfds;
     fd_set writefds;
     timeval time;
@@ -139,18 +331,79 @@ BlockSocket::Status BlockSocket::select(long timeout, bool poll_read)
     // If the return value is not positive, we don't have a message available
     if (ret < 0) {
         throw std::string(strerror(errno));
-    } else if (ret > 0) {
-        if (FD_ISSET(sock, &readfds) && FD_ISSET(sock, &writefds) && poll_read) {
-            return BOTH;
-        } else if (FD_ISSET(sock, &readfds)) {
-            return READ;
-        } else if (FD_ISSET(sock, &writefds)) {
-            return WRITE;
+    }
+    bool readable = ret > 0 && FD_ISSET(sock, &readfds);
+    bool writable = ret > 0 && poll_read && FD_ISSET(sock, &writefds);
+    if (impairment) {
+        if (readable) {
+            drain_impaired();
         }
+        readable = impairment->next_due(Impairment::Clock::now()) == 0;
+    }
+    readable = readable || pending;
+    
+    if (readable && writable) {
+        return BOTH;
+    } else if (readable) {
+        return READ;
+    } else if (writable) {
+        return WRITE;
     }
     return NONE;
 }
 
+void BlockSocket::drain_impaired()
+{
+    // Without non-blocking reads, only the packet that select() reported
+    // can be read safely
+#ifdef MSG_DONTWAIT
+    int flags = MSG_DONTWAIT;
+#else
+    int flags = 0;
+#endif
+    Impairment::Clock::time_point now = Impairment::Clock::now();
+    for (unsigned int k = 0; k < IMPAIRED_DRAIN_LIMIT; k++) {
+        sockaddr_in address;
+        socklen_t fromlen = sizeof(sockaddr);
+#ifndef WINDOWS
+        char control[CONTROL_BUFFER];
+        iovec vector;
+        vector.iov_base = &impaired_buffer.front();
+        vector.iov_len = impaired_buffer.size();
+        msghdr header;
+        memset(&header, 0, sizeof(header));
+        header.msg_name = &address;
+        header.msg_namelen = fromlen;
+        header.msg_iov = &vector;
+        header.msg_iovlen = 1;
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+        segment_size = 0;
+        int bytes = recvmsg(sock, &header, flags);
+        if (bytes > 0) {
+            read_control(NULL, header);
+        }
+#else
+        int bytes = recvfrom(sock, &impaired_buffer.front(), impaired_buffer.size(), flags, (sockaddr*)&address, &fromlen);
+#endif
+        if (bytes < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            throw std::string(strerror(errno));
+        }
+        
+        // The packets of a coalesced run are impaired one at a time
+        size_t size = segment_size && segment_size < (size_t)bytes ? segment_size : bytes;
+        for (size_t offset = 0; offset < (size_t)bytes; offset += size) {
+            impairment->push(&impaired_buffer[offset], std::min(size, bytes - offset), address, now);
+        }
+        if (!flags) {
+            break;
+        }
+    }
+}
+
 BlockSocket::Status BlockSocket::select()
 {
     return select(this->timeout);
@@ -160,13 +413,54 @@ BlockSocket& BlockSocket::operator>>(Message& message)
 {
     socklen_t fromlen = sizeof(sockaddr);
     
-    int bytes = recvfrom(sock, &message.buffer.front(), message.buffer.size(), 0, (sockaddr*)&from, &fromlen);
+    int bytes;
+    if (impairment) {
+        // Wait for the impairment to let a packet through
+        while (!impairment->pop(message.buffer, from, Impairment::Clock::now())) {
+            select(-1);
+        }
+        bytes = message.buffer.size();
+    } else if (coalescing) {
+        bytes = read_coalesced(message);
+    } else {
+#ifndef WINDOWS
+        // Read the time the kernel received the packet, and its count of
+        // dropped packets, along with it
+        char control[CONTROL_BUFFER];
+        iovec vector;
+        vector.iov_base = &message.buffer.front();
+        vector.iov_len = message.buffer.size();
+        msghdr header;
+        memset(&header, 0, sizeof(header));
+        header.msg_name = &from;
+        header.msg_namelen = fromlen;
+        header.msg_iov = &vector;
+        header.msg_iovlen = 1;
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+        bytes = recvmsg(sock, &header, 0);
+        if (bytes > 0) {
+            read_control(&message, header);
+        }
+#else
+        bytes = recvfrom(sock, &message.buffer.front(), message.buffer.size(), 0, (sockaddr*)&from, &fromlen);
+#endif
+    }
     if (bytes < 0) {
         throw std::string(strerror(errno));
-    } else if (bytes == 0) {
+    }
+    finish_read(message, bytes);
+	return *this;
+}
+
+void BlockSocket::finish_read(Message& message, int bytes)
+{
+    if (bytes == 0) {
         throw std::string("Received zero bytes on UDP socket");
     }
-    logger << Logger::FINE << "Received from " << inet_ntoa(from.sin_addr) << ":" << ntohs(from.sin_port) << "\n";
+    Metrics::add(METRIC_PACKETS_RECEIVED);
+    Metrics::add(METRIC_BYTES_RECEIVED, bytes);
+    MSYNC_LOG_LIMITED(logger, FINEST) << "Received from " << inet_ntoa(from.sin_addr) << ":" << ntohs(from.sin_port) << "\n";
     
     // Trim the buffer down to the size of the packet
     message.buffer.resize(bytes);   
@@ -175,37 +469,298 @@ BlockSocket& BlockSocket::operator>>(Message& message)
     // header isn't equal to the length of the whole packet
     Header* header = (Header*)&message.buffer.front();
     if (header->GetPacketLength() != (unsigned int)bytes) {
-        logger << Logger::ERR << "Expected " << header->GetPacketLength() << " bytes, but received " << bytes << "\n";
-        logger << Logger::ERR << "Data length: " << ntohl(header->length) << "\n";
-        logger << Logger::ERR << "Header length: " << ntohs(header->offset) << "\n";
+        MSYNC_LOG(logger, ERR) << "Expected " << header->GetPacketLength() << " bytes, but received " << bytes << "\n";
+        MSYNC_LOG(logger, ERR) << "Data length: " << ntohl(header->length) << "\n";
+        MSYNC_LOG(logger, ERR) << "Header length: " << ntohs(header->offset) << "\n";
         throw std::string("Invalid packet length");
     }
-	return *this;
 }
 
 BlockSocket& BlockSocket::operator<<(const Message& message)
 {
     socklen_t tolen = sizeof(sockaddr);    
-    logger << Logger::FINE << "Sending to " << inet_ntoa(to.sin_addr) << ":" << ntohs(to.sin_port) << "\n";
+    MSYNC_LOG_LIMITED(logger, FINEST) << "Sending to " << inet_ntoa(to.sin_addr) << ":" << ntohs(to.sin_port) << "\n";
+    uint64_t sent = send_stamps.empty() ? 0 : Metrics::now();
     int bytes = sendto(sock, &message.buffer.front(), message.buffer.size(), 0, (sockaddr*)&to, tolen);
     if (bytes < 0) {
+#ifndef WINDOWS
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+            Metrics::add(METRIC_SEND_WOULDBLOCK);
+        }
+#endif
         throw std::string(errmsg());
     } else if (bytes == 0) {
         throw std::string("Sent zero bytes on UDP socket");
     }
+    Metrics::add(METRIC_PACKETS_SENT);
+    Metrics::add(METRIC_BYTES_SENT, bytes);
+    stamp_sent(sent);
     
     // Return false if the size of the header plus the size reported in the
     // header isn't equal to the whole length of the packet that was sent
     Header* header = (Header*)&message.buffer.front();
     if (header->GetPacketLength() != (unsigned int)bytes) {
-        logger << Logger::ERR << "Expected " << header->GetPacketLength() << " bytes, but sent " << bytes << "\n";  
-        logger << Logger::ERR << "Data length: " << ntohl(header->length) << "\n";
-        logger << Logger::ERR << "Header length: " << ntohs(header->offset) << "\n";
+        MSYNC_LOG(logger, ERR) << "Expected " << header->GetPacketLength() << " bytes, but sent " << bytes << "\n";  
+        MSYNC_LOG(logger, ERR) << "Data length: " << ntohl(header->length) << "\n";
+        MSYNC_LOG(logger, ERR) << "Header length: " << ntohs(header->offset) << "\n";
         throw std::string("Invalid packet length");
     }
 	return *this;
 }
 
+void BlockSocket::send(const Message* messages, size_t count)
+{
+    size_t k = 0;
+    while (k < count) {
+        // The kernel cuts a segmented send into packets of the first
+        // packet's size, so a run ends after a shorter packet
+        size_t size = messages[k].buffer.size();
+        size_t run = 1;
+        size_t total = size;
+        while (segmenting && k + run < count && run < SEGMENT_LIMIT && messages[k + run - 1].buffer.size() == size &&
+                messages[k + run].buffer.size() <= size && total + messages[k + run].buffer.size() <= SEGMENT_BYTES) {
+            total += messages[k + run].buffer.size();
+            run++;
+        }
+        if (run == 1 || !send_segments(&messages[k], run, size, total)) {
+            for (size_t end = k + run; k < end; k++) {
+                *this << messages[k];
+            }
+        } else {
+            k += run;
+        }
+    }
+}
+
+bool BlockSocket::send_segments(const Message* messages, size_t count, size_t size, size_t total)
+{
+#ifdef UDP_SEGMENT
+    // The packets are gathered straight from the messages
+    iovec vectors[SEGMENT_LIMIT];
+    for (size_t k = 0; k < count; k++) {
+        vectors[k].iov_base = (void*)&messages[k].buffer.front();
+        vectors[k].iov_len = messages[k].buffer.size();
+    }
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+    memset(control, 0, sizeof(control));
+    msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_name = &to;
+    header.msg_namelen = sizeof(sockaddr);
+    header.msg_iov = vectors;
+    header.msg_iovlen = count;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+    cmsghdr* segment = CMSG_FIRSTHDR(&header);
+    segment->cmsg_level = IPPROTO_UDP;
+    segment->cmsg_type = UDP_SEGMENT;
+    segment->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t segment_size = (uint16_t)size;
+    memcpy(CMSG_DATA(segment), &segment_size, sizeof(segment_size));
+    
+    MSYNC_LOG_LIMITED(logger, FINEST) << "Sending " << count << " packets to " << inet_ntoa(to.sin_addr) << ":" << ntohs(to.sin_port) << "\n";
+    uint64_t sent = send_stamps.empty() ? 0 : Metrics::now();
+    ssize_t bytes = sendmsg(sock, &header, 0);
+    if (bytes < 0) {
+        // Kernels and devices that can't segment refuse the whole send, so
+        // nothing has been sent yet
+        if (errno == EINVAL || errno == EIO || errno == ENOPROTOOPT || errno == EOPNOTSUPP) {
+            MSYNC_LOG(logger, INFO) << "Segmentation offload unavailable: " << errmsg() << "\n";
+            segmenting = false;
+            return false;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+            Metrics::add(METRIC_SEND_WOULDBLOCK);
+        }
+        throw std::string(errmsg());
+    } else if ((size_t)bytes != total) {
+        throw std::string("Segmented send was cut short");
+    }
+    Metrics::add(METRIC_PACKETS_SENT, count);
+    Metrics::add(METRIC_BYTES_SENT, bytes);
+    
+    // The kernel stamps a segmented send once
+    stamp_sent(sent);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void BlockSocket::stamp_sent(uint64_t sent)
+{
+    // The kernel numbers the packets it stamps in the order they were
+    // sent, so the send times are kept in a ring indexed the same way
+    if (!send_stamps.empty()) {
+        send_stamps[send_count % SEND_STAMP_SLOTS] = sent;
+        if (++send_count % SEND_STAMP_BATCH == 0) {
+            read_send_timestamps();
+        }
+    }
+}
+
+int BlockSocket::read_coalesced(Message& message)
+{
+#ifndef WINDOWS
+    // Packets left from the last read arrived with the first of them
+    if (segment_offset >= segment_end) {
+        char control[CONTROL_BUFFER];
+        iovec vector;
+        vector.iov_base = &coalesced_buffer.front();
+        vector.iov_len = coalesced_buffer.size();
+        msghdr header;
+        memset(&header, 0, sizeof(header));
+        header.msg_name = &from;
+        header.msg_namelen = sizeof(sockaddr);
+        header.msg_iov = &vector;
+        header.msg_iovlen = 1;
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+        segment_size = 0;
+        int bytes = recvmsg(sock, &header, 0);
+        if (bytes <= 0) {
+            return bytes;
+        }
+        read_control(&message, header);
+        segment_stamp = message.get_stamp();
+        segment_offset = 0;
+        segment_end = bytes;
+        if (!segment_size || segment_size > (size_t)bytes) {
+            segment_size = bytes;
+        }
+    } else {
+        message.set_stamp(segment_stamp);
+    }
+    size_t length = std::min(segment_size, segment_end - segment_offset);
+    const char* data = &coalesced_buffer[segment_offset];
+    message.buffer.assign(data, data + length);
+    segment_offset += length;
+    return (int)length;
+#else
+    return -1;
+#endif
+}
+
+#ifdef SO_TIMESTAMPING
+/**
+ * Converts a kernel timestamp to microseconds.
+ */
+static uint64_t to_microseconds(const timespec& time)
+{
+    return (uint64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+#endif
+
+#ifndef WINDOWS
+void BlockSocket::read_control(Message* message, msghdr& header)
+{
+    for (cmsghdr* control = CMSG_FIRSTHDR(&header); control; control = CMSG_NXTHDR(&header, control)) {
+#ifdef UDP_GRO
+        if (control->cmsg_level == IPPROTO_UDP && control->cmsg_type == UDP_GRO) {
+            // Several packets were coalesced, and are this far apart
+            int size;
+            memcpy(&size, CMSG_DATA(control), sizeof(size));
+            segment_size = size > 0 ? size : 0;
+            continue;
+        }
+#endif
+        if (control->cmsg_level != SOL_SOCKET) {
+            continue;
+        }
+#ifdef SO_RXQ_OVFL
+        if (control->cmsg_type == SO_RXQ_OVFL) {
+            // The counter is cumulative, and also counts the packets the
+            // socket filter rejected.  A filter that steers blocks rejects
+            // most of them, so its drops can't be told apart; other
+            // filters reject little, and their rejections are only taken
+            // for overflows while the buffer is filling up.
+            uint32_t counter;
+            memcpy(&counter, CMSG_DATA(control), sizeof(counter));
+            uint32_t dropped = counter - drop_counter;
+            drop_counter = counter;
+            bool filtering = has_filter_sender || received_end > received_start;
+            if (dropped && filter_count <= 1 && (!filtering || receive_buffer_full())) {
+                receive_drops += dropped;
+                Metrics::add(METRIC_RECEIVE_BUFFER_DROPS, dropped);
+            }
+            continue;
+        }
+#endif
+#ifdef SO_TIMESTAMPING
+        if (control->cmsg_type != SCM_TIMESTAMPING || !message) {
+            continue;
+        }
+        const scm_timestamping* stamps = (const scm_timestamping*)CMSG_DATA(control);
+        uint64_t software = to_microseconds(stamps->ts[0]);
+        uint64_t hardware = to_microseconds(stamps->ts[2]);
+        if (!software) {
+            continue;
+        }
+        
+        // The software stamp is on the same clock as the sender's, so it
+        // stands in for the time the message was read.  The device's clock
+        // may not be, so it is only used to time the gaps between blocks.
+        message->set_stamp(software);
+        uint64_t now = Metrics::now();
+        Metrics::record(STAGE_RECEIVE_QUEUE, now > software ? now - software : 0);
+        // The packet is still where it was read into
+        const Header* packet = (const Header*)header.msg_iov->iov_base;
+        if (header.msg_iov->iov_len >= sizeof(Header) && ntohl(packet->type) == MESSAGE_TYPE_BLOCK) {
+            uint64_t arrival = hardware ? hardware : software;
+            if (last_arrival && arrival >= last_arrival) {
+                Metrics::record(STAGE_ARRIVAL_GAP, arrival - last_arrival);
+            }
+            last_arrival = arrival;
+        }
+#endif
+    }
+}
+#endif
+
+void BlockSocket::read_send_timestamps()
+{
+#ifdef SO_TIMESTAMPING
+    uint64_t now = Metrics::now();
+    while (true) {
+        char control[CONTROL_BUFFER];
+        msghdr header;
+        memset(&header, 0, sizeof(header));
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+        if (recvmsg(sock, &header, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+        }
+        
+        // Each report carries the time in one message and the number of
+        // the packet in another
+        uint64_t transmitted = 0;
+        uint32_t id = 0;
+        bool has_id = false;
+        for (cmsghdr* control = CMSG_FIRSTHDR(&header); control; control = CMSG_NXTHDR(&header, control)) {
+            if (control->cmsg_level == SOL_SOCKET && control->cmsg_type == SCM_TIMESTAMPING) {
+                transmitted = to_microseconds(((const scm_timestamping*)CMSG_DATA(control))->ts[0]);
+            } else if ((control->cmsg_level == SOL_IP && control->cmsg_type == IP_RECVERR) ||
+                (control->cmsg_level == SOL_IPV6 && control->cmsg_type == IPV6_RECVERR)) {
+                const sock_extended_err* error = (const sock_extended_err*)CMSG_DATA(control);
+                if (error->ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+                    id = error->ee_data;
+                    has_id = true;
+                }
+            }
+        }
+        
+        // Reports for packets older than the ring are ignored
+        if (!transmitted || !has_id || send_count - id > SEND_STAMP_SLOTS || id >= send_count) {
+            continue;
+        }
+        uint64_t sent = send_stamps[id % SEND_STAMP_SLOTS];
+        if (sent && transmitted >= sent && transmitted <= now) {
+            Metrics::record(STAGE_TRANSMIT, transmitted - sent);
+        }
+    }
+#endif
+}
+
 BlockSocket& BlockSocket::operator>>(Address& address)
 {
     address.ip_address = inet_ntoa(from.sin_addr);
@@ -231,9 +786,286 @@ void BlockSocket::close()
 #endif
         sock = INVALID_SOCKET;
     }
+    impairment.reset();
+    segment_offset = segment_end = 0;
+}
+
+void BlockSocket::set_impairment(const ImpairmentProfile& profile)
+{
+    impairment_profile = profile;
+}
+
+void BlockSocket::set_send_timestamps(bool enabled)
+{
+    send_timestamps = enabled;
+}
+
+void BlockSocket::set_offload(bool enabled)
+{
+    offload = enabled;
+}
+
+void BlockSocket::set_buffer_size(unsigned long rate, unsigned int packet_size)
+{
+    buffer_rate = rate;
+    buffer_packet_size = packet_size;
+}
+
+void BlockSocket::size_buffer(int option, int force, uint64_t bytes, const char* name)
+{
+    // The kernel doubles the size it is given to allow for its overhead,
+    // which has already been counted
+    int size = (int)(bytes / 2);
+    if (!force || setsockopt(sock, SOL_SOCKET, force, (char*)&size, sizeof(size)) < 0) {
+        if (setsockopt(sock, SOL_SOCKET, option, (char*)&size, sizeof(size)) < 0) {
+            MSYNC_LOG(logger, WARNING) << "Could not set the " << name << " buffer size: " << errmsg() << "\n";
+            return;
+        }
+    }
+    int actual = 0;
+    socklen_t length = sizeof(actual);
+    if (getsockopt(sock, SOL_SOCKET, option, (char*)&actual, &length) < 0) {
+        return;
+    }
+    if ((uint64_t)actual < bytes) {
+        MSYNC_LOG(logger, INFO) << name << " buffer limited to " << actual << " of " << bytes 
+            << " bytes; raise net.core." << (option == SO_RCVBUF ? "rmem_max" : "wmem_max") << " to avoid drops\n";
+    } else {
+        MSYNC_LOG(logger, FINE) << name << " buffer is " << actual << " bytes\n";
+    }
+}
+
+bool BlockSocket::receive_buffer_full()
+{
+#ifdef SO_MEMINFO
+    uint32_t memory[SK_MEMINFO_VARS];
+    socklen_t length = sizeof(memory);
+    if (getsockopt(sock, SOL_SOCKET, SO_MEMINFO, memory, &length) < 0 || length < sizeof(memory)) {
+        return true;
+    }
+    return memory[SK_MEMINFO_RMEM_ALLOC] * 2 >= memory[SK_MEMINFO_RCVBUF];
+#else
+    return true;
+#endif
+}
+
+uint64_t BlockSocket::get_receive_drops() const
+{
+    return receive_drops;
+}
+
+int BlockSocket::get_descriptor()
+{
+    return sock == INVALID_SOCKET ? -1 : (int)sock;
+}
+
+void BlockSocket::set_default_impairment(const ImpairmentProfile& profile)
+{
+    default_impairment = profile;
+}
+
+void BlockSocket::set_reuse(bool reuse)
+{
+    this->reuse = reuse;
+}
+
+void BlockSocket::set_block_filter(unsigned int index, unsigned int count)
+{
+    filter_index = index;
+    filter_count = count;
+    attach_filter();
+    if (impairment) {
+        impair();
+    }
+}
+
+void BlockSocket::set_type_filter(unsigned int types)
+{
+    filter_types = types;
+    attach_filter();
+}
+
+void BlockSocket::set_session_filter(unsigned int sender, bool peers)
+{
+    filter_sender = sender;
+    has_filter_sender = true;
+    filter_peers = peers;
+    attach_filter();
+}
+
+void BlockSocket::set_received_filter(uint64_t start, uint64_t end)
+{
+    const uint64_t limit = 0xffffffffULL;
+    received_start = (uint32_t)std::min(start, limit);
+    received_end = (uint32_t)std::min(end, limit);
+    attach_filter();
+}
+
+#ifdef SO_ATTACH_FILTER
+// Jump targets used while assembling a socket filter.  Jumps in classic BPF
+// are relative and forward only, so they are resolved once the program is
+// complete.
+enum FilterLabel { NEXT, ACCEPT, DROP, NOT_BLOCK, PEER, STEER };
+
+struct FilterInstruction {
+    sock_filter code;
+    FilterLabel jt;
+    FilterLabel jf;
+};
+
+static void emit(std::vector<FilterInstruction>& program, unsigned short code, uint32_t k, 
+    FilterLabel jt = NEXT, FilterLabel jf = NEXT)
+{
+    FilterInstruction instruction = { { code, 0, 0, k }, jt, jf };
+    program.push_back(instruction);
+}
+#endif
+
+void BlockSocket::attach_filter()
+{
+#ifdef SO_ATTACH_FILTER
+    // Multicast datagrams are delivered to every socket bound to the group
+    // port, so unwanted messages are dropped before they are queued rather
+    // than after a system call and a copy.  Socket filters on UDP sockets
+    // see the UDP header first, so payload offsets are shifted by its size.
+    // Block numbers are 64-bit, but the low word is enough to spread them,
+    // and blocks past the first 2^32 are never dropped as received.
+    const unsigned int udp = 8;
+    const unsigned int type = udp + offsetof(Header, type);
+    const unsigned int sender = udp + offsetof(Header, sender);
+    const unsigned int block_high = udp + sizeof(Header) + sizeof(FileInfo);
+    const unsigned int block_low = block_high + sizeof(uint32_t);
+    std::vector<FilterInstruction> program;
+    std::vector<size_t> labels(STEER + 1, 0);
+    
+    // Drop the message types this socket doesn't want
+    if (filter_types) {
+        emit(program, BPF_LD | BPF_W | BPF_ABS, type);
+        emit(program, BPF_JMP | BPF_JGE | BPF_K, 32, DROP, NEXT);
+        emit(program, BPF_MISC | BPF_TAX, 0);
+        emit(program, BPF_LD | BPF_IMM, 1);
+        emit(program, BPF_ALU | BPF_LSH | BPF_X, 0);
+        emit(program, BPF_JMP | BPF_JSET | BPF_K, filter_types, NEXT, DROP);
+    }
+    
+    // Drop messages from other sessions, except their file information.
+    // Other clients send repair requests and blocks under their own IDs.
+    if (has_filter_sender) {
+        emit(program, BPF_LD | BPF_W | BPF_ABS, type);
+        emit(program, BPF_JMP | BPF_JEQ | BPF_K, MESSAGE_TYPE_INFO, NOT_BLOCK, NEXT);
+        if (filter_peers) {
+            emit(program, BPF_JMP | BPF_JEQ | BPF_K, MESSAGE_TYPE_GETRANGES, NOT_BLOCK, NEXT);
+        }
+        emit(program, BPF_LD | BPF_W | BPF_ABS, sender);
+        emit(program, BPF_JMP | BPF_JEQ | BPF_K, filter_sender, NEXT, filter_peers ? PEER : DROP);
+    }
+    
+    emit(program, BPF_LD | BPF_W | BPF_ABS, type);
+    emit(program, BPF_JMP | BPF_JEQ | BPF_K, MESSAGE_TYPE_BLOCK, NEXT, NOT_BLOCK);
+    
+    // Drop blocks that have already been received.  The filter only sees
+    // the first packet of a coalesced run, and the rest of the run may
+    // not have been received, so coalescing sockets keep them all.
+    if (received_end > received_start && !coalescing) {
+        emit(program, BPF_LD | BPF_W | BPF_ABS, block_high);
+        emit(program, BPF_JMP | BPF_JEQ | BPF_K, 0, NEXT, STEER);
+        emit(program, BPF_LD | BPF_W | BPF_ABS, block_low);
+        emit(program, BPF_JMP | BPF_JGE | BPF_K, received_start, NEXT, STEER);
+        emit(program, BPF_JMP | BPF_JGE | BPF_K, received_end, STEER, DROP);
+    }
+    
+    // A peer's block is kept even if it has been received, since a client
+    // waiting to send the same block holds back when it sees it
+    if (filter_peers) {
+        emit(program, BPF_JMP | BPF_JA, 0, STEER, STEER);
+        labels[PEER] = program.size();
+        emit(program, BPF_LD | BPF_W | BPF_ABS, type);
+        emit(program, BPF_JMP | BPF_JEQ | BPF_K, MESSAGE_TYPE_BLOCK, NEXT, DROP);
+    }
+    
+    // Steer each block to one of the sockets sharing the port.  Messages
+    // other than blocks are only kept by socket 0.
+    labels[STEER] = program.size();
+    if (filter_count > 1) {
+        emit(program, BPF_LD | BPF_W | BPF_ABS, block_low);
+        emit(program, BPF_ALU | BPF_MOD | BPF_K, filter_count);
+        emit(program, BPF_JMP | BPF_JEQ | BPF_K, filter_index, ACCEPT, DROP);
+    } else {
+        emit(program, BPF_JMP | BPF_JA, 0, ACCEPT, ACCEPT);
+    }
+    labels[NOT_BLOCK] = program.size();
+    emit(program, BPF_RET | BPF_K, filter_index == 0 ? 0xffffffff : 0);
+    labels[ACCEPT] = program.size();
+    emit(program, BPF_RET | BPF_K, 0xffffffff);
+    labels[DROP] = program.size();
+    emit(program, BPF_RET | BPF_K, 0);
+    
+    // Resolve the jumps.  Unconditional jumps keep their offset in k.
+    std::vector<sock_filter> code;
+    for (size_t i = 0; i < program.size(); i++) {
+        sock_filter instruction = program[i].code;
+        if (BPF_CLASS(instruction.code) == BPF_JMP) {
+            size_t jt = program[i].jt == NEXT ? i + 1 : labels[program[i].jt];
+            size_t jf = program[i].jf == NEXT ? i + 1 : labels[program[i].jf];
+            if (BPF_OP(instruction.code) == BPF_JA) {
+                instruction.k = (uint32_t)(jt - i - 1);
+            } else {
+                instruction.jt = (unsigned char)(jt - i - 1);
+                instruction.jf = (unsigned char)(jf - i - 1);
+            }
+        }
+        code.push_back(instruction);
+    }
+    sock_fprog fprog;
+    fprog.len = (unsigned short)code.size();
+    fprog.filter = &code.front();
+    
+    MSYNC_LOG(logger, FINE) << "Attaching socket filter of " << code.size() << " instructions\n";
+    if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0) {
+        throw std::string(errmsg());
+    }
+#else
+    MSYNC_LOG(logger, WARNING) << "Socket filters are not supported; every socket will see every message\n";
+#endif
 }
 
 void BlockSocket::set_timeout(long timeout)
 {
     this->timeout = timeout;
 }
+
+BlockSocketFactory BlockSocketFactory::Default;
+
+BlockSocketFactory::BlockSocketFactory() :
+    impaired(false)
+{
+}
+
+Transport* BlockSocketFactory::create(const std::string& group, unsigned short port, Logger& logger)
+{
+    return prepare(new BlockSocket(group, port, logger));
+}
+
+void BlockSocketFactory::set_impairment(const ImpairmentProfile& profile)
+{
+    impairment = profile;
+    impaired = true;
+}
+
+BlockSocket* BlockSocketFactory::prepare(BlockSocket* socket)
+{
+    if (impaired) {
+        socket->set_impairment(impairment);
+    }
+    return socket;
+}
+
+TransportFactory::Clock::time_point BlockSocketFactory::now()
+{
+    return Clock::now();
+}
+
+void BlockSocketFactory::sleep_until(Clock::time_point when)
+{
+    std::this_thread::sleep_until(when);
+}
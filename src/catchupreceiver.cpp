@@ -0,0 +1,120 @@
+#include "catchupreceiver.hpp"
+#include "blockserver.hpp"
+
+#ifdef WINDOWS
+#include <winsock2.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+using namespace Msync;
+
+CatchupReceiver::CatchupReceiver(const std::string& host, unsigned short port, unsigned int id, Logger& logger) :
+    sock(socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)),
+    id(id),
+    logger(logger)
+{
+    if (sock < 0) {
+        throw std::string(strerror(errno));
+    }
+    timeval timeout;
+    timeout.tv_sec = CATCHUP_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout));
+    
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = inet_addr(host.c_str());
+    address.sin_port = htons(port);
+    MSYNC_LOG(logger, INFO) << "Connecting to " << host << ":" << port << " to catch up\n";
+    if (connect(sock, (sockaddr*)&address, sizeof(address)) < 0) {
+        std::string message(strerror(errno));
+        ::close(sock);
+        throw message;
+    }
+}
+
+CatchupReceiver::~CatchupReceiver()
+{
+    ::close(sock);
+}
+
+uint64_t CatchupReceiver::receive(SyncStatus& status)
+{
+    // Ask for everything that is missing in one go
+    std::vector<Extent> ranges;
+    uint64_t block = 0;
+    while (ranges.size() < CATCHUP_MAX_RANGES) {
+        size_t before = ranges.size();
+        block = status.encode_missing(block, ranges, CATCHUP_MAX_RANGES - ranges.size());
+        if (ranges.size() == before) {
+            break;
+        }
+    }
+    uint32_t request[2] = { htonl(id), htonl((uint32_t)ranges.size()) };
+    write_fully((const char*)request, sizeof(request));
+    if (!ranges.empty()) {
+        write_fully((const char*)&ranges.front(), ranges.size() * sizeof(Extent));
+    }
+    
+    // Each range arrives as a header and the data for its blocks
+    uint64_t received = 0;
+    std::vector<char> data(BLOCKSIZE);
+    for (size_t i = 0; i < ranges.size(); i++) {
+        CatchupRange range(0, 0, 0);
+        read_fully((char*)&range, sizeof(range));
+        uint64_t length = range.get_length();
+        if (range.get_start() != ranges[i].get_start() || length > (uint64_t)BLOCKSIZE * range.get_count()) {
+            throw std::string("Unexpected catch-up range");
+        }
+        for (uint64_t block = range.get_start(); length > 0; block++) {
+            size_t bytes = (size_t)std::min(length, (uint64_t)BLOCKSIZE);
+            read_fully(&data.front(), bytes);
+            status.write_data(block, &data.front(), bytes);
+            length -= bytes;
+            received++;
+        }
+    }
+    MSYNC_LOG(logger, INFO) << "Caught up on " << received << " blocks\n";
+    return received;
+}
+
+void CatchupReceiver::read_fully(char* data, size_t length)
+{
+    while (length > 0) {
+        ssize_t bytes = recv(sock, data, length, 0);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        } else if (bytes < 0) {
+            throw std::string(strerror(errno));
+        } else if (bytes == 0) {
+            throw std::string("Catch-up stream closed early");
+        }
+        data += bytes;
+        length -= bytes;
+    }
+}
+
+void CatchupReceiver::write_fully(const char* data, size_t length)
+{
+    while (length > 0) {
+        ssize_t bytes = send(sock, data, length, MSG_NOSIGNAL);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        } else if (bytes < 0) {
+            throw std::string(strerror(errno));
+        }
+        data += bytes;
+        length -= bytes;
+    }
+}
@@ -0,0 +1,285 @@
+#include "catchupsender.hpp"
+#include "byteorder.hpp"
+#include "blockserver.hpp"
+
+#ifdef WINDOWS
+#include <winsock2.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+using namespace Msync;
+
+CatchupRange::CatchupRange(uint64_t start, uint64_t count, uint64_t length) :
+    start(hton64(start)),
+    count(hton64(count)),
+    length(hton64(length))
+{
+}
+
+uint64_t CatchupRange::get_start() const
+{
+    return ntoh64(start);
+}
+
+uint64_t CatchupRange::get_count() const
+{
+    return ntoh64(count);
+}
+
+uint64_t CatchupRange::get_length() const
+{
+    return ntoh64(length);
+}
+
+CatchupSender::CatchupSender(const std::string& source, Logger& logger) :
+    source(source),
+    logger(logger),
+    listener(-1),
+    stopped(false),
+    blocks_sent(0)
+{
+}
+
+CatchupSender::~CatchupSender()
+{
+    stopped = true;
+    if (acceptor.joinable()) {
+        acceptor.join();
+    }
+    for (std::list<std::thread>::iterator i = connections.begin(); i != connections.end(); i++) {
+        i->join();
+    }
+    if (listener >= 0) {
+        ::close(listener);
+    }
+}
+
+unsigned short CatchupSender::start()
+{
+    listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener < 0) {
+        throw std::string(strerror(errno));
+    }
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = 0;
+    socklen_t length = sizeof(address);
+    if (bind(listener, (sockaddr*)&address, sizeof(address)) < 0 || listen(listener, 16) < 0 ||
+            getsockname(listener, (sockaddr*)&address, &length) < 0) {
+        throw std::string(strerror(errno));
+    }
+    unsigned short port = ntohs(address.sin_port);
+    MSYNC_LOG(logger, INFO) << "Listening for catch-up connections on port " << port << "\n";
+    acceptor = std::thread(&CatchupSender::accept_connections, this);
+    return port;
+}
+
+void CatchupSender::offer(unsigned int id, const std::string& host)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    offers[id] = host;
+}
+
+bool CatchupSender::connected(unsigned int id)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return connected_hosts.count(id) > 0;
+}
+
+uint64_t CatchupSender::get_blocks_sent() const
+{
+    return blocks_sent;
+}
+
+void CatchupSender::accept_connections()
+{
+    while (!stopped) {
+        join_finished();
+        pollfd fds;
+        fds.fd = listener;
+        fds.events = POLLIN;
+        if (poll(&fds, 1, 100) <= 0) {
+            continue;
+        }
+        sockaddr_in address;
+        socklen_t length = sizeof(address);
+        int sock = accept(listener, (sockaddr*)&address, &length);
+        if (sock < 0) {
+            continue;
+        }
+        
+        // Only the hosts that were offered a stream may connect
+        std::string host(inet_ntoa(address.sin_addr));
+        bool offered = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (std::map<unsigned int, std::string>::iterator i = offers.begin(); i != offers.end() && !offered; i++) {
+                offered = i->second == host;
+            }
+        }
+        if (!offered) {
+            MSYNC_LOG(logger, WARNING) << "Refusing catch-up connection from " << host << "\n";
+            ::close(sock);
+            continue;
+        }
+        
+        // Don't let a stalled client hold up the server forever
+        timeval timeout;
+        timeout.tv_sec = CATCHUP_TIMEOUT;
+        timeout.tv_usec = 0;
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+        std::lock_guard<std::mutex> lock(mutex);
+        connections.push_back(std::thread(&CatchupSender::serve, this, sock, host));
+    }
+}
+
+void CatchupSender::join_finished()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::list<std::thread>::iterator i = connections.begin();
+    while (i != connections.end()) {
+        if (finished.erase(i->get_id())) {
+            i->join();
+            connections.erase(i++);
+        } else {
+            i++;
+        }
+    }
+}
+
+static bool read_fully(int sock, char* data, size_t length)
+{
+    while (length > 0) {
+        ssize_t bytes = recv(sock, data, length, 0);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        } else if (bytes <= 0) {
+            return false;
+        }
+        data += bytes;
+        length -= bytes;
+    }
+    return true;
+}
+
+static void write_fully(int sock, const char* data, size_t length)
+{
+    while (length > 0) {
+        ssize_t bytes = send(sock, data, length, MSG_NOSIGNAL);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        } else if (bytes < 0) {
+            throw std::string(strerror(errno));
+        }
+        data += bytes;
+        length -= bytes;
+    }
+}
+
+void CatchupSender::serve(int sock, std::string host)
+{
+    int file = -1;
+    try {
+        // The host ID has to match the address the stream was offered to,
+        // and each offer is good for one connection
+        uint32_t request[2];
+        if (!read_fully(sock, (char*)request, sizeof(request))) {
+            throw std::string("Catch-up request was cut short");
+        }
+        unsigned int id = ntohl(request[0]);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::map<unsigned int, std::string>::iterator i = offers.find(id);
+            if (i == offers.end() || i->second != host) {
+                throw std::string("Host ") + host + " wasn't offered a stream";
+            }
+            offers.erase(i);
+            connected_hosts.insert(id);
+        }
+        uint32_t count = ntohl(request[1]);
+        if (count > CATCHUP_MAX_RANGES) {
+            throw std::string("Too many catch-up ranges");
+        }
+        std::vector<Extent> ranges(count);
+        if (count && !read_fully(sock, (char*)&ranges.front(), count * sizeof(Extent))) {
+            throw std::string("Catch-up request was cut short");
+        }
+        
+        file = ::open(source.c_str(), O_RDONLY);
+        struct stat info;
+        if (file < 0 || fstat(file, &info) < 0) {
+            throw std::string("Could not open ") + source + ": " + strerror(errno);
+        }
+        uint64_t size = info.st_size;
+        uint64_t blocks = 0;
+        for (uint32_t i = 0; i < count && !stopped; i++) {
+            // Ranges past the end of the file are sent empty
+            uint64_t offset = std::min((uint64_t)BLOCKSIZE * ranges[i].get_start(), size);
+            uint64_t length = std::min((uint64_t)BLOCKSIZE * ranges[i].get_count(), size - offset);
+            CatchupRange range(ranges[i].get_start(), ranges[i].get_count(), length);
+            write_fully(sock, (const char*)&range, sizeof(range));
+            send_file(sock, file, offset, length);
+            blocks += ranges[i].get_count();
+        }
+        blocks_sent += blocks;
+        MSYNC_LOG(logger, INFO) << "Sent " << blocks << " blocks in " << count << " catch-up ranges\n";
+    } catch (std::string& message) {
+        MSYNC_LOG(logger, WARNING) << "Catch-up failed: " << message << "\n";
+    }
+    if (file >= 0) {
+        ::close(file);
+    }
+    ::close(sock);
+    std::lock_guard<std::mutex> lock(mutex);
+    finished.insert(std::this_thread::get_id());
+}
+
+void CatchupSender::send_file(int sock, int file, uint64_t offset, uint64_t length)
+{
+#ifdef __linux__
+    // The data goes from the page cache to the socket without a copy
+    // through user space
+    off_t position = offset;
+    while (length > 0) {
+        ssize_t bytes = sendfile(sock, file, &position, std::min(length, (uint64_t)1 << 30));
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        } else if (bytes <= 0) {
+            throw std::string(bytes < 0 ? strerror(errno) : "File is shorter than expected");
+        }
+        length -= bytes;
+    }
+#else
+    std::vector<char> buffer(64 * BLOCKSIZE);
+    while (length > 0) {
+        ssize_t bytes = pread(file, &buffer.front(), std::min(length, (uint64_t)buffer.size()), offset);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        } else if (bytes <= 0) {
+            throw std::string(bytes < 0 ? strerror(errno) : "File is shorter than expected");
+        }
+        write_fully(sock, &buffer.front(), bytes);
+        offset += bytes;
+        length -= bytes;
+    }
+#endif
+}
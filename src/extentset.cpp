@@ -0,0 +1,77 @@
+#include "extentset.hpp"
+
+using namespace Msync;
+
+ExtentSet::ExtentSet() :
+    total(0)
+{
+}
+
+void ExtentSet::add(uint64_t start, uint64_t count)
+{
+    if (count == 0) {
+        return;
+    }
+    uint64_t end = start + count;
+    
+    // Start from the last run that begins at or before the new one, in case
+    // it reaches into it
+    std::map<uint64_t, uint64_t>::iterator i = runs.upper_bound(start);
+    if (i != runs.begin()) {
+        std::map<uint64_t, uint64_t>::iterator previous = i;
+        previous--;
+        if (previous->second >= start) {
+            i = previous;
+        }
+    }
+    
+    // Absorb every run that overlaps or touches the new one
+    while (i != runs.end() && i->first <= end) {
+        if (i->first < start) {
+            start = i->first;
+        }
+        if (i->second > end) {
+            end = i->second;
+        }
+        total -= i->second - i->first;
+        runs.erase(i++);
+    }
+    runs[start] = end;
+    total += end - start;
+}
+
+bool ExtentSet::pop(uint64_t& block)
+{
+    if (runs.empty()) {
+        return false;
+    }
+    std::map<uint64_t, uint64_t>::iterator i = runs.begin();
+    block = i->first;
+    if (i->second > block + 1) {
+        runs[block + 1] = i->second;
+    }
+    runs.erase(i);
+    total--;
+    return true;
+}
+
+bool ExtentSet::empty() const
+{
+    return runs.empty();
+}
+
+size_t ExtentSet::size() const
+{
+    return runs.size();
+}
+
+uint64_t ExtentSet::blocks() const
+{
+    return total;
+}
+
+void ExtentSet::clear()
+{
+    runs.clear();
+    total = 0;
+}
@@ -12,11 +12,8 @@ FileInfo::FileInfo(const std::string& path)
     // Read the file's size
     std::ifstream input(path.c_str());
     input.seekg(0, std::ios::end);
-    num_blocks = input.tellg() / BLOCKSIZE;
-    if (input.tellg() % BLOCKSIZE) {
-        num_blocks++;
-    }
-    num_blocks = htonl(num_blocks);
+    uint64_t size = input.tellg();
+    num_blocks = hton64(size / BLOCKSIZE + (size % BLOCKSIZE ? 1 : 0));
     input.seekg(0, std::ios::beg);
     
     // Get the MD5 digest for the whole input
@@ -28,7 +25,7 @@ FileInfo::FileInfo(const std::string& path)
 
 bool FileInfo::operator==(const FileInfo& other) const
 {
-    return memcmp(digest, other.digest, sizeof(this->digest)) && (num_blocks == other.num_blocks);
+    return !memcmp(digest, other.digest, sizeof(this->digest)) && (num_blocks == other.num_blocks);
 }
 
 bool FileInfo::operator<(const FileInfo& other) const
@@ -37,13 +34,13 @@ bool FileInfo::operator<(const FileInfo& other) const
     if (val != 0) {
         return val < 0;   
     } else {
-        return num_blocks < other.num_blocks;   
+        return get_block_count() < other.get_block_count();   
     }
 }
 
-unsigned int FileInfo::get_block_count() const
+uint64_t FileInfo::get_block_count() const
 {
-    return ntohl(num_blocks);
+    return ntoh64(num_blocks);
 }
 
 const char* FileInfo::get_digest() const
@@ -0,0 +1,116 @@
+#include "histogram.hpp"
+#include <cmath>
+
+using namespace Msync;
+
+Histogram::Histogram() :
+    count(0),
+    sum(0),
+    max(0)
+{
+    for (unsigned int i = 0; i < BUCKETS; i++) {
+        counts[i] = 0;
+    }
+}
+
+void Histogram::record(uint64_t value)
+{
+    // Only this thread writes the histogram, so a plain load and store is
+    // enough; readers see either the old or the new value
+    std::atomic<uint64_t>& bucket = counts[index(value)];
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    sum.store(sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    if (value > max.load(std::memory_order_relaxed)) {
+        max.store(value, std::memory_order_relaxed);
+    }
+}
+
+void Histogram::merge(const Histogram& other)
+{
+    for (unsigned int i = 0; i < BUCKETS; i++) {
+        uint64_t added = other.counts[i].load(std::memory_order_relaxed);
+        if (added) {
+            counts[i].store(counts[i].load(std::memory_order_relaxed) + added, std::memory_order_relaxed);
+        }
+    }
+    count.store(count.load(std::memory_order_relaxed) + other.get_count(), std::memory_order_relaxed);
+    sum.store(sum.load(std::memory_order_relaxed) + other.get_sum(), std::memory_order_relaxed);
+    uint64_t largest = other.get_max();
+    if (largest > max.load(std::memory_order_relaxed)) {
+        max.store(largest, std::memory_order_relaxed);
+    }
+}
+
+uint64_t Histogram::get_count() const
+{
+    return count.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::get_sum() const
+{
+    return sum.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::get_max() const
+{
+    return max.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::get_quantile(double quantile) const
+{
+    // The buckets are read one at a time while other threads may be
+    // recording, so the total is taken from the buckets themselves
+    uint64_t total = 0;
+    for (unsigned int i = 0; i < BUCKETS; i++) {
+        total += counts[i].load(std::memory_order_relaxed);
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)std::ceil(quantile * total);
+    rank = rank ? rank : 1;
+    uint64_t seen = 0;
+    for (unsigned int i = 0; i < BUCKETS; i++) {
+        seen += counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            uint64_t value = highest(i);
+            uint64_t largest = get_max();
+            return value < largest ? value : largest;
+        }
+    }
+    return get_max();
+}
+
+unsigned int Histogram::index(uint64_t value)
+{
+    if (value < SUB_BUCKETS) {
+        return (unsigned int)value;
+    }
+
+    // Each power of two above the exact range gets SUB_BUCKETS buckets,
+    // indexed by the top HISTOGRAM_PRECISION + 1 bits of the value
+#ifdef __GNUC__
+    unsigned int exponent = 63 - __builtin_clzll(value);
+#else
+    unsigned int exponent = HISTOGRAM_PRECISION;
+    while (value >> (exponent + 1)) {
+        exponent++;
+    }
+#endif
+    if (exponent >= HISTOGRAM_RANGE) {
+        return BUCKETS - 1;
+    }
+    unsigned int shift = exponent - HISTOGRAM_PRECISION;
+    return SUB_BUCKETS * shift + (unsigned int)(value >> shift);
+}
+
+uint64_t Histogram::highest(unsigned int index)
+{
+    if (index < 2 * SUB_BUCKETS) {
+        return index;
+    }
+    unsigned int shift = index / SUB_BUCKETS - 1;
+    uint64_t mantissa = index % SUB_BUCKETS + SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
+}
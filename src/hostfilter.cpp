@@ -0,0 +1,60 @@
+#include "hostfilter.hpp"
+
+using namespace Msync;
+
+static uint64_t mix(uint64_t x)
+{
+    // splitmix64 finalizer
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+HostFilter::HostFilter(size_t hosts)
+{
+    size_t segments = (hosts * FILTER_BITS_PER_HOST + FILTER_SEGMENT_BYTES * 8 - 1) / (FILTER_SEGMENT_BYTES * 8);
+    bits.resize((segments ? segments : 1) * FILTER_SEGMENT_BYTES, 0);
+}
+
+void HostFilter::insert(unsigned int id)
+{
+    char* segment = &bits[segment_of(id, get_segment_count()) * FILTER_SEGMENT_BYTES];
+    uint64_t hash = mix(id);
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+    for (unsigned int i = 0; i < FILTER_PROBES; i++) {
+        uint32_t bit = (h1 + i * h2) % (FILTER_SEGMENT_BYTES * 8);
+        segment[bit / 8] |= (char)(1 << (bit % 8));
+    }
+}
+
+uint32_t HostFilter::get_segment_count() const
+{
+    return bits.size() / FILTER_SEGMENT_BYTES;
+}
+
+const char* HostFilter::get_segment(uint32_t segment) const
+{
+    return &bits[segment * FILTER_SEGMENT_BYTES];
+}
+
+uint32_t HostFilter::segment_of(unsigned int id, uint32_t segments)
+{
+    // Use different bits of the hash than the probes do
+    return segments ? (uint32_t)(mix(~(uint64_t)id) % segments) : 0;
+}
+
+bool HostFilter::segment_contains(const char* segment, unsigned int id)
+{
+    uint64_t hash = mix(id);
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+    for (unsigned int i = 0; i < FILTER_PROBES; i++) {
+        uint32_t bit = (h1 + i * h2) % (FILTER_SEGMENT_BYTES * 8);
+        if (!(segment[bit / 8] & (1 << (bit % 8)))) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,208 @@
+#include "impairment.hpp"
+#include <sstream>
+#include <cstdlib>
+
+using namespace Msync;
+
+/**
+ * Parses a probability, written either as a fraction or as a percentage.
+ */
+static double parse_probability(const std::string& text)
+{
+    char* end;
+    double value = strtod(text.c_str(), &end);
+    if (*end == '%') {
+        value /= 100;
+        end++;
+    }
+    if (end == text.c_str() || *end != '\0' || value < 0 || value > 1) {
+        throw std::string("Invalid probability: ") + text;
+    }
+    return value;
+}
+
+/**
+ * Parses a non-negative integer with an optional K, M or G suffix.
+ */
+static uint64_t parse_number(const std::string& text)
+{
+    char* end;
+    uint64_t value = strtoull(text.c_str(), &end, 10);
+    switch (*end) {
+        case 'k': case 'K': value <<= 10; end++; break;
+        case 'm': case 'M': value <<= 20; end++; break;
+        case 'g': case 'G': value <<= 30; end++; break;
+    }
+    if (end == text.c_str() || *end != '\0' || text[0] == '-') {
+        throw std::string("Invalid number: ") + text;
+    }
+    return value;
+}
+
+/**
+ * Splits a setting's value into its colon-separated fields.
+ */
+static std::vector<std::string> split(const std::string& text, char separator)
+{
+    std::vector<std::string> fields;
+    std::stringstream stream(text);
+    std::string field;
+    while (std::getline(stream, field, separator)) {
+        fields.push_back(field);
+    }
+    return fields;
+}
+
+ImpairmentProfile::ImpairmentProfile() :
+    loss(0),
+    burst_enter(0),
+    burst_leave(1),
+    burst_loss(1),
+    good_loss(0),
+    reorder(0),
+    reorder_delay(REORDER_DELAY),
+    duplicate(0),
+    delay(0),
+    jitter(0),
+    rate(0),
+    seed(1)
+{
+}
+
+ImpairmentProfile ImpairmentProfile::parse(const std::string& spec)
+{
+    ImpairmentProfile profile;
+    profile.spec = spec;
+    std::vector<std::string> settings = split(spec, ',');
+    for (size_t i = 0; i < settings.size(); i++) {
+        if (settings[i].empty()) {
+            continue;
+        }
+        size_t equals = settings[i].find('=');
+        if (equals == std::string::npos) {
+            throw std::string("Invalid impairment setting: ") + settings[i];
+        }
+        std::string key = settings[i].substr(0, equals);
+        std::vector<std::string> values = split(settings[i].substr(equals + 1), ':');
+        if (values.empty()) {
+            throw std::string("Missing value for ") + key;
+        }
+
+        if (key == "loss" && values.size() == 1) {
+            profile.loss = parse_probability(values[0]);
+        } else if (key == "burst" && values.size() >= 2 && values.size() <= 4) {
+            profile.burst_enter = parse_probability(values[0]);
+            profile.burst_leave = parse_probability(values[1]);
+            profile.burst_loss = values.size() > 2 ? parse_probability(values[2]) : 1;
+            profile.good_loss = values.size() > 3 ? parse_probability(values[3]) : 0;
+        } else if (key == "reorder" && values.size() <= 2) {
+            profile.reorder = parse_probability(values[0]);
+            profile.reorder_delay = values.size() > 1 ? parse_number(values[1]) : REORDER_DELAY;
+        } else if (key == "dup" && values.size() == 1) {
+            profile.duplicate = parse_probability(values[0]);
+        } else if (key == "delay" && values.size() <= 2) {
+            profile.delay = parse_number(values[0]);
+            profile.jitter = values.size() > 1 ? parse_number(values[1]) : 0;
+        } else if (key == "rate" && values.size() == 1) {
+            profile.rate = parse_number(values[0]);
+        } else if (key == "seed" && values.size() == 1) {
+            profile.seed = (unsigned int)parse_number(values[0]);
+        } else {
+            throw std::string("Invalid impairment setting: ") + settings[i];
+        }
+    }
+    return profile;
+}
+
+bool ImpairmentProfile::enabled() const
+{
+    return loss > 0 || burst_enter > 0 || good_loss > 0 || reorder > 0 ||
+        duplicate > 0 || delay > 0 || jitter > 0 || rate > 0;
+}
+
+Impairment::Impairment(const ImpairmentProfile& profile, unsigned int seed) :
+    profile(profile),
+    random(seed ? seed : 1),
+    bad_state(false)
+{
+}
+
+bool Impairment::chance(double probability)
+{
+    double value = (double)(random() - random.min()) / ((double)random.max() - random.min() + 1);
+    return value < probability;
+}
+
+bool Impairment::lost()
+{
+    // Gilbert-Elliott: the state changes before each packet, and each
+    // state has its own loss probability.  Every draw is made whatever the
+    // settings, so that the decisions for one impairment don't depend on
+    // which others are set.
+    if (bad_state) {
+        bad_state = !chance(profile.burst_leave);
+    } else {
+        bad_state = chance(profile.burst_enter);
+    }
+    bool burst = chance(bad_state ? profile.burst_loss : profile.good_loss);
+    bool random_loss = chance(profile.loss);
+    return burst || random_loss;
+}
+
+void Impairment::push(const char* data, size_t length, const sockaddr_in& from, Clock::time_point now)
+{
+    if (lost()) {
+        return;
+    }
+
+    // A bandwidth cap is a link that sends one packet at a time, with a
+    // queue in front of it that drops packets once it is too long
+    Clock::time_point sent = now;
+    if (profile.rate) {
+        if (link_free > now) {
+            sent = link_free;
+        }
+        if (sent - now > std::chrono::milliseconds(IMPAIRMENT_BACKLOG)) {
+            return;
+        }
+        sent += std::chrono::nanoseconds(length * 1000000000ULL / profile.rate);
+        link_free = sent;
+    }
+
+    unsigned int copies = chance(profile.duplicate) ? 2 : 1;
+    for (unsigned int k = 0; k < copies; k++) {
+        long delay = profile.delay;
+        unsigned long offset = random() % (2 * profile.jitter + 1);
+        delay += (long)offset - (long)profile.jitter;
+        if (chance(profile.reorder)) {
+            delay += profile.reorder_delay;
+        }
+        Packet packet;
+        packet.data.assign(data, data + length);
+        packet.from = from;
+        pending.insert(std::make_pair(sent + std::chrono::milliseconds(delay > 0 ? delay : 0), packet));
+    }
+}
+
+bool Impairment::pop(std::vector<char>& data, sockaddr_in& from, Clock::time_point now)
+{
+    if (pending.empty() || pending.begin()->first > now) {
+        return false;
+    }
+    data.swap(pending.begin()->second.data);
+    from = pending.begin()->second.from;
+    pending.erase(pending.begin());
+    return true;
+}
+
+long Impairment::next_due(Clock::time_point now) const
+{
+    if (pending.empty()) {
+        return -1;
+    }
+    Clock::time_point due = pending.begin()->first;
+    if (due <= now) {
+        return 0;
+    }
+    return (long)std::chrono::duration_cast<std::chrono::milliseconds>(due - now + std::chrono::microseconds(999)).count();
+}
@@ -1,43 +1,157 @@
 #include "logger.hpp"
-#include <ctime>
-#include <cstring>
+#include "logwriter.hpp"
+#include <chrono>
+#include <streambuf>
 
 using namespace Msync;
 
 
 Logger Logger::Default(std::cout);
 
-Logger::Logger(std::ostream& output) :
-    output(output),
-    output_level(INFO),
-    message_level(INFO)
-{    
-}
-
-Logger& Logger::operator<<(const Level& level)
-{
-    message_level = level;
-    
-    if (message_level >= output_level) {
-        time_t rawtime;
-        time(&rawtime);
-        char* timestring = asctime(localtime(&rawtime));
-        timestring[strlen(timestring) - 1] = '\0';
-        output << timestring;
-    
-        switch (level) {
-            case FINEST: output << " [FINEST] "; break;
-            case FINE: output << " [FINE] "; break;
-            case INFO: output << " [INFO] "; break;
-            case WARNING: output << " [WARNING] "; break;
-            case ERR: output << " [ERROR] "; break;
-        }
-    }
-    
+namespace {
+
+/**
+ * A stream buffer over a fixed array; output that doesn't fit is dropped.
+ */
+class FixedBuffer : public std::streambuf {
+public:
+    FixedBuffer()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        setp(data, data + sizeof(data));
+    }
+
+    char* begin() const
+    {
+        return pbase();
+    }
+
+    size_t size() const
+    {
+        return pptr() - pbase();
+    }
+
+private:
+    char data[LOG_RECORD_SIZE];
+};
+
+/**
+ * The buffer each thread formats its messages into.
+ */
+struct ThreadBuffer {
+    ThreadBuffer() :
+        stream(&buffer)
+    {
+    }
+
+    FixedBuffer buffer;
+    std::ostream stream;
+};
+
+thread_local ThreadBuffer local;
+
+uint64_t now()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+}
+
+LogLimiter::LogLimiter() :
+    second(0),
+    count(0),
+    dropped(0)
+{
+}
+
+bool LogLimiter::allow()
+{
+    uint64_t current = now() / 1000000;
+    uint64_t previous = second.load(std::memory_order_relaxed);
+    if (current != previous && second.compare_exchange_strong(previous, current, std::memory_order_relaxed)) {
+        count.store(0, std::memory_order_relaxed);
+    }
+    if (count.fetch_add(1, std::memory_order_relaxed) < LOG_RATE_LIMIT) {
+        return true;
+    }
+    dropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+uint64_t LogLimiter::take_dropped()
+{
+    return dropped.exchange(0, std::memory_order_relaxed);
+}
+
+Logger::Record::Record(const Logger& logger, Level level) :
+    logger(&logger),
+    level(level),
+    time(now()),
+    active(true)
+{
+    local.buffer.reset();
+    local.stream.clear();
+}
+
+Logger::Record::Record(const Record& other) :
+    logger(other.logger),
+    level(other.level),
+    time(other.time),
+    active(other.active)
+{
+    other.active = false;
+}
+
+Logger::Record::~Record()
+{
+    if (!active) {
+        return;
+    }
+
+    // A message cut short still ends its line
+    char* text = local.buffer.begin();
+    size_t size = local.buffer.size();
+    if (size == LOG_RECORD_SIZE && text[size - 1] != '\n') {
+        text[size - 1] = '\n';
+    }
+    LogWriter::push(logger->output, level, time, text, size);
+}
+
+Logger::Record& Logger::Record::operator<<(LogLimiter& limiter)
+{
+    uint64_t dropped = limiter.take_dropped();
+    if (active && dropped) {
+        stream() << "(" << dropped << " similar messages dropped) ";
+    }
     return *this;
 }
 
+std::ostream& Logger::Record::stream()
+{
+    return local.stream;
+}
+
+Logger::Logger(std::ostream& output) :
+    output(&output),
+    output_level(INFO)
+{
+}
+
+Logger::Record Logger::operator<<(const Level& level) const
+{
+    return Record(*this, level);
+}
+
 void Logger::set_level(const Level& level)
 {
     output_level = level;
 }
+
+void Logger::flush()
+{
+    LogWriter::flush();
+}
@@ -0,0 +1,219 @@
+#include "logwriter.hpp"
+#include <chrono>
+#include <ctime>
+#include <cstring>
+#include <cstdlib>
+
+#ifndef WINDOWS
+#include <pthread.h>
+#endif
+
+using namespace Msync;
+
+LogWriter::Slot LogWriter::slots[LOG_QUEUE_SIZE];
+std::atomic<size_t> LogWriter::head(0);
+std::atomic<size_t> LogWriter::tail(0);
+std::atomic<uint64_t> LogWriter::dropped(0);
+std::atomic<bool> LogWriter::running(false);
+std::atomic<bool> LogWriter::sleeping(false);
+std::mutex LogWriter::mutex;
+std::condition_variable* LogWriter::wakeup = NULL;
+bool LogWriter::fork_handlers = LogWriter::add_fork_handlers();
+
+// Number of messages written and flushed, for flush() to wait on
+static std::atomic<size_t> written(0);
+
+// Whether the slots have been numbered; they stay numbered across a fork
+static bool initialized = false;
+
+bool LogWriter::push(std::ostream* output, int level, uint64_t time, const char* text, size_t length)
+{
+    if (!running.load(std::memory_order_acquire)) {
+        start();
+    }
+
+    // Each slot's sequence number says whose turn it is: a producer may
+    // claim slot (position % size) once its sequence equals the position,
+    // and the writer may take it once the sequence is one past that
+    size_t position = tail.load(std::memory_order_relaxed);
+    Slot* slot;
+    while (true) {
+        slot = &slots[position % LOG_QUEUE_SIZE];
+        size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        if (sequence == position) {
+            if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if ((ptrdiff_t)(sequence - position) < 0) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        } else {
+            position = tail.load(std::memory_order_relaxed);
+        }
+    }
+    slot->output = output;
+    slot->level = level;
+    slot->time = time;
+    slot->length = length < LOG_RECORD_SIZE ? length : LOG_RECORD_SIZE;
+    memcpy(slot->text, text, slot->length);
+    slot->sequence.store(position + 1, std::memory_order_release);
+
+    // Either the writer sees the message before it sleeps, or this sees
+    // that it is asleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(mutex);
+        wakeup->notify_one();
+    }
+    return true;
+}
+
+void LogWriter::flush()
+{
+    if (!running.load(std::memory_order_acquire)) {
+        return;
+    }
+    size_t target = tail.load(std::memory_order_acquire);
+    while (written.load(std::memory_order_acquire) < target) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+void LogWriter::start()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (running) {
+        return;
+    }
+    if (!initialized) {
+        for (size_t i = 0; i < LOG_QUEUE_SIZE; i++) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+
+        // The condition is never destroyed, as the writer is still waiting
+        // on it at exit
+        wakeup = new std::condition_variable();
+        initialized = true;
+        std::atexit(&LogWriter::flush);
+    }
+
+    // The thread is never joined; messages still queued at exit are
+    // written by flush()
+    std::thread(&LogWriter::run).detach();
+    running.store(true, std::memory_order_release);
+}
+
+bool LogWriter::add_fork_handlers()
+{
+#ifndef WINDOWS
+    pthread_atfork(&LogWriter::forking, &LogWriter::resumed, &LogWriter::forked);
+#endif
+    return true;
+}
+
+void LogWriter::forking()
+{
+    mutex.lock();
+}
+
+void LogWriter::resumed()
+{
+    mutex.unlock();
+}
+
+void LogWriter::forked()
+{
+    // A message half written by another thread of the parent is never
+    // finished, so every slot is numbered afresh
+    for (size_t i = 0; i < LOG_QUEUE_SIZE; i++) {
+        slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    head.store(0, std::memory_order_relaxed);
+    tail.store(0, std::memory_order_relaxed);
+    written.store(0, std::memory_order_relaxed);
+    dropped.store(0, std::memory_order_relaxed);
+    sleeping.store(false, std::memory_order_relaxed);
+    running.store(false, std::memory_order_release);
+
+    // The old condition still counts the parent's writer as waiting on
+    // it, and would wait for it to wake up before signalling anyone else
+    if (wakeup) {
+        wakeup = new std::condition_variable();
+    }
+    mutex.unlock();
+}
+
+void LogWriter::run()
+{
+    while (true) {
+        if (drain()) {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while (!ready()) {
+            wakeup->wait(lock);
+        }
+        sleeping.store(false, std::memory_order_relaxed);
+    }
+}
+
+bool LogWriter::ready()
+{
+    size_t position = head.load(std::memory_order_relaxed);
+    return slots[position % LOG_QUEUE_SIZE].sequence.load(std::memory_order_acquire) == position + 1;
+}
+
+size_t LogWriter::drain()
+{
+    static const char* levels[] = { " [FINEST] ", " [FINE] ", " [INFO] ", " [WARNING] ", " [ERROR] " };
+    static time_t last = 0;
+    static char prefix[64] = "";
+
+    std::ostream* output = NULL;
+    size_t count = 0;
+    size_t position = head.load(std::memory_order_relaxed);
+    while (true) {
+        Slot& slot = slots[position % LOG_QUEUE_SIZE];
+        if (slot.sequence.load(std::memory_order_acquire) != position + 1) {
+            break;
+        }
+        if (output && output != slot.output) {
+            output->flush();
+        }
+        output = slot.output;
+
+        // The time is only formatted once a second
+        time_t seconds = (time_t)(slot.time / 1000000);
+        if (seconds != last) {
+            tm local;
+#ifdef WINDOWS
+            localtime_s(&local, &seconds);
+#else
+            localtime_r(&seconds, &local);
+#endif
+            strftime(prefix, sizeof(prefix), "%a %b %e %H:%M:%S %Y", &local);
+            last = seconds;
+        }
+        *output << prefix << levels[slot.level];
+        output->write(slot.text, slot.length);
+
+        slot.sequence.store(position + LOG_QUEUE_SIZE, std::memory_order_release);
+        position++;
+        count++;
+    }
+    head.store(position, std::memory_order_relaxed);
+
+    uint64_t lost = dropped.exchange(0, std::memory_order_relaxed);
+    if (lost) {
+        std::ostream& stream = output ? *output : std::cerr;
+        stream << prefix << levels[3] << lost << " log messages were dropped\n";
+        output = &stream;
+    }
+    if (output) {
+        output->flush();
+    }
+    written.store(position, std::memory_order_release);
+    return count;
+}
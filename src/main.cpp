@@ -14,7 +14,11 @@
 #include "message.hpp"
 #include "blockserver.hpp"
 #include "blockclient.hpp"
+#include "blockrelay.hpp"
 #include "logger.hpp"
+#include "metricsexporter.hpp"
+#include "tracer.hpp"
+#include <tr1/memory>
 
 
 
@@ -72,18 +76,40 @@ int main(int argc, char** argv)
 {
 
     Msync::Logger::Default.set_level(Msync::Logger::FINE);
+    std::tr1::shared_ptr<Msync::MetricsExporter> exporter;
     try {
+        // Network conditions to emulate, such as -i loss=1%,delay=20:5,
+        // where to export metrics, a file or unix:PATH for a socket, and
+        // where to write a trace of one block in TRACE_SAMPLE_INTERVAL
+        while (argc > 2 && (std::string(argv[1]) == "-i" || std::string(argv[1]) == "-M" || std::string(argv[1]) == "-t")) {
+            if (std::string(argv[1]) == "-i") {
+                Msync::BlockSocket::set_default_impairment(Msync::ImpairmentProfile::parse(argv[2]));
+            } else if (std::string(argv[1]) == "-t") {
+                Msync::Tracer::start(argv[2]);
+            } else {
+                exporter.reset(new Msync::MetricsExporter(argv[2]));
+            }
+            argv[2] = argv[0];
+            argv += 2;
+            argc -= 2;
+        }
         if (argc == 3) {
             Msync::BlockServer server(argv[1], argv[2]);
-            Msync::Logger::Default << Msync::Logger::INFO << "Starting server\n";
+            MSYNC_LOG(Msync::Logger::Default, INFO) << "Starting server\n";
             server.start();
         } else if (argc == 1) {
-            Msync::Logger::Default << Msync::Logger::INFO << "Starting client\n";
+            MSYNC_LOG(Msync::Logger::Default, INFO) << "Starting client\n";
             Msync::BlockClient client;
             client.start();
+        } else if (argc > 1 && std::string(argv[1]) == "relay") {
+            MSYNC_LOG(Msync::Logger::Default, INFO) << "Starting relay\n";
+            Msync::BlockRelay relay(argc > 2 ? argv[2] : "228.5.6.7", 9000, 
+                argc > 3 ? argv[3] : "228.5.6.8", 9000);
+            relay.start();
         } else if (argc > 1 && std::string(argv[1]) == "listen") {
             Listen();
         }
+        Msync::Tracer::stop();
     } catch (std::string& message)  {
         std::cout << message << std::endl;
     }
@@ -0,0 +1,269 @@
+#include "memorybus.hpp"
+#include "memorytransport.hpp"
+
+#ifdef WINDOWS
+#include <winsock2.h>
+#else
+#include <netinet/in.h>
+#endif
+
+using namespace Msync;
+
+MemoryBus::MemoryBus(unsigned long latency, bool virtual_time) :
+    latency(std::chrono::milliseconds(latency)),
+    epoch(Clock::now()),
+    elapsed(0),
+    virtual_time(virtual_time),
+    waiting(0),
+    generation(0),
+    next_host(0),
+    next_port(BUS_EPHEMERAL_PORT),
+    queued(0),
+    sent(32, 0),
+    deliveries(0),
+    bytes(0)
+{
+}
+
+Transport* MemoryBus::create(const std::string& group, unsigned short port, Logger& logger)
+{
+    return new MemoryTransport(*this, group, port, logger);
+}
+
+TransportFactory::Clock::time_point MemoryBus::now()
+{
+    if (!virtual_time) {
+        return Clock::now();
+    }
+    return epoch + std::chrono::nanoseconds(elapsed.load());
+}
+
+void MemoryBus::sleep_until(Clock::time_point when)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (now() < when) {
+        wait(lock, sleepers, when);
+    }
+}
+
+void MemoryBus::attach_thread()
+{
+    // A thread may be attached more than once, by each layer that uses
+    // the bus
+    std::lock_guard<std::mutex> lock(mutex);
+    members[std::this_thread::get_id()]++;
+}
+
+void MemoryBus::detach_thread()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<std::thread::id, unsigned int>::iterator i = members.find(std::this_thread::get_id());
+    if (i != members.end() && --i->second == 0) {
+        members.erase(i);
+    }
+    
+    // The threads left may all be waiting for this one
+    advance();
+}
+
+void MemoryBus::wait_for_delivery(uint64_t& seen, Clock::time_point when)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (deliveries == seen && now() < when) {
+        wait(lock, delivered, when);
+    }
+    seen = deliveries;
+}
+
+uint64_t MemoryBus::get_messages_sent(unsigned int type)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return type < sent.size() ? sent[type] : 0;
+}
+
+uint64_t MemoryBus::get_deliveries()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return deliveries;
+}
+
+uint64_t MemoryBus::get_bytes_sent()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return bytes;
+}
+
+void MemoryBus::attach(MemoryTransport* transport, uint32_t group, unsigned short port)
+{
+    // Hosts are numbered from 10.0.0.1
+    if (!port) {
+        port = next_port++;
+        if (!next_port) {
+            next_port = BUS_EPHEMERAL_PORT;
+        }
+    }
+    transport->local = Key((10U << 24) + ++next_host, port);
+    hosts[transport->local] = transport;
+    if (IN_MULTICAST(group)) {
+        groups.insert(std::make_pair(Key(group, port), transport));
+    }
+    transports.insert(transport);
+}
+
+void MemoryBus::detach(MemoryTransport* transport)
+{
+    hosts.erase(transport->local);
+    std::multimap<Key, MemoryTransport*>::iterator i = groups.begin();
+    while (i != groups.end()) {
+        if (i->second == transport) {
+            groups.erase(i++);
+        } else {
+            i++;
+        }
+    }
+    transports.erase(transport);
+    queued -= transport->queue.size();
+    transport->queue.clear();
+}
+
+void MemoryBus::send(MemoryTransport* from, const Key& to, const std::vector<char>& data)
+{
+    // Every receiver shares one copy of the message
+    MemoryTransport::Delivery delivery;
+    delivery.data.reset(new std::vector<char>(data));
+    delivery.from = from->local;
+    unsigned int type = data.size() >= sizeof(Header) ? ntohl(((const Header*)&data.front())->type) : 0;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    bytes += delivery.data->size();
+    if (type < sent.size()) {
+        sent[type]++;
+    }
+    uint64_t before = deliveries;
+    delivery.due = now() + latency;
+    delivery.round = generation;
+    if (IN_MULTICAST(to.first)) {
+        std::pair<std::multimap<Key, MemoryTransport*>::iterator, std::multimap<Key, MemoryTransport*>::iterator> range = groups.equal_range(to);
+        for (std::multimap<Key, MemoryTransport*>::iterator i = range.first; i != range.second; i++) {
+            if (i->second->accepts(*delivery.data)) {
+                i->second->queue.push_back(delivery);
+                deliveries++;
+                queued++;
+                if (!virtual_time) {
+                    i->second->arrived.notify_one();
+                }
+            }
+        }
+    } else {
+        std::map<Key, MemoryTransport*>::iterator i = hosts.find(to);
+        if (i != hosts.end() && i->second->accepts(*delivery.data)) {
+            i->second->queue.push_back(delivery);
+            deliveries++;
+            queued++;
+            if (!virtual_time) {
+                i->second->arrived.notify_one();
+            }
+        }
+    }
+    
+    // With a virtual clock the receivers are woken when the round ends
+    if (deliveries != before && !virtual_time) {
+        delivered.notify_all();
+    }
+}
+
+void MemoryBus::wait(std::unique_lock<std::mutex>& lock, std::condition_variable& condition, Clock::time_point when)
+{
+    if (!virtual_time) {
+        if (when == Clock::time_point()) {
+            condition.wait(lock);
+        } else {
+            condition.wait_until(lock, when);
+        }
+        return;
+    }
+    
+    if (when != Clock::time_point() && now() >= when) {
+        return;
+    }
+    
+    // An attached thread counts as waiting until the clock moves.  Moving
+    // the clock wakes every waiter, and the thread that moved it returns
+    // at once, as if it had been woken too.
+    std::multiset<Clock::time_point>::iterator timer = timers.end();
+    if (when != Clock::time_point()) {
+        timer = timers.insert(when);
+    }
+    bool member = members.count(std::this_thread::get_id()) > 0;
+    uint64_t counted = generation;
+    if (member) {
+        waiting++;
+    }
+    if (!advance()) {
+        condition.wait(lock);
+    }
+    if (member && counted == generation) {
+        waiting--;
+    }
+    if (timer != timers.end()) {
+        timers.erase(timer);
+    }
+}
+
+void MemoryBus::wake_all()
+{
+    for (std::set<MemoryTransport*>::iterator i = transports.begin(); i != transports.end(); i++) {
+        (*i)->arrived.notify_all();
+    }
+    sleepers.notify_all();
+    delivered.notify_all();
+}
+
+bool MemoryBus::advance()
+{
+    // Messages sent in a round can only be read in a later one, so that
+    // what each thread sees doesn't depend on which ran first
+    if (!virtual_time || waiting < members.size()) {
+        return false;
+    }
+    Clock::time_point current = now();
+    Clock::time_point next = timers.empty() ? Clock::time_point() : *timers.begin();
+    bool sent_this_round = false;
+    if (queued) {
+        for (std::set<MemoryTransport*>::iterator i = transports.begin(); i != transports.end(); i++) {
+            if ((*i)->queue.empty()) {
+                continue;
+            }
+            const MemoryTransport::Delivery& front = (*i)->queue.front();
+            if (front.due > current) {
+                if (next == Clock::time_point() || front.due < next) {
+                    next = front.due;
+                }
+            } else if (front.round == generation) {
+                sent_this_round = true;
+            }
+            
+            // Otherwise the message could have been read this round, and
+            // isn't going to be, as nobody is running
+        }
+    }
+    if (sent_this_round) {
+        next = current;
+    } else if (next == Clock::time_point()) {
+        return false;
+    }
+    
+    // Merge the wakeups just after the first one into the same jump.  The
+    // threads that were waiting count as running until they wait again.
+    if (next > current) {
+        std::multiset<Clock::time_point>::iterator last = timers.upper_bound(next + std::chrono::milliseconds(BUS_TIMER_SLACK));
+        if (last != timers.begin() && *--last > next) {
+            next = *last;
+        }
+        elapsed += std::chrono::duration_cast<std::chrono::nanoseconds>(next - current).count();
+    }
+    waiting = 0;
+    generation++;
+    wake_all();
+    return true;
+}
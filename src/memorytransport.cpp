@@ -0,0 +1,209 @@
+#include "memorytransport.hpp"
+#include "byteorder.hpp"
+#include "metrics.hpp"
+
+#ifdef WINDOWS
+#include <winsock2.h>
+#else
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+using namespace Msync;
+
+MemoryTransport::MemoryTransport(MemoryBus& bus, const std::string& group, unsigned short port, Logger& logger) :
+    bus(bus),
+    logger(logger),
+    group(ntohl(inet_addr(group.c_str()))),
+    port(port),
+    to(ntohl(inet_addr(group.c_str())), port),
+    attached(false),
+    filter_index(0),
+    filter_count(1),
+    filter_types(0),
+    filter_sender(0),
+    has_filter_sender(false),
+    filter_peers(false),
+    received_start(0),
+    received_end(0)
+{
+}
+
+MemoryTransport::~MemoryTransport()
+{
+    close();
+}
+
+void MemoryTransport::open()
+{
+    std::lock_guard<std::mutex> lock(bus.mutex);
+    if (!attached) {
+        bus.attach(this, group, port);
+        attached = true;
+    }
+}
+
+Transport::Status MemoryTransport::select(long timeout, bool poll_write)
+{
+    typedef TransportFactory::Clock Clock;
+    std::unique_lock<std::mutex> lock(bus.mutex);
+    Clock::time_point deadline = bus.now() + std::chrono::milliseconds(timeout);
+    while (true) {
+        Clock::time_point now = bus.now();
+        bool ready = readable(now);
+        if (ready && poll_write) {
+            return BOTH;
+        } else if (ready) {
+            return READ;
+        } else if (poll_write) {
+            return WRITE;
+        } else if (timeout >= 0 && now >= deadline) {
+            return NONE;
+        }
+
+        // Wait for the next message to arrive or fall due
+        Clock::time_point wake = timeout >= 0 ? deadline : Clock::time_point();
+        Clock::time_point arrival = next_arrival(now);
+        if (arrival != Clock::time_point() && (wake == Clock::time_point() || arrival < wake)) {
+            wake = arrival;
+        }
+        bus.wait(lock, arrived, wake);
+    }
+}
+
+MemoryTransport& MemoryTransport::operator>>(Message& message)
+{
+    Delivery delivery;
+    {
+        std::unique_lock<std::mutex> lock(bus.mutex);
+        while (!readable(bus.now())) {
+            bus.wait(lock, arrived, next_arrival(bus.now()));
+        }
+        delivery = queue.front();
+        queue.pop_front();
+        bus.queued--;
+    }
+    message.buffer = *delivery.data;
+    Metrics::add(METRIC_PACKETS_RECEIVED);
+    Metrics::add(METRIC_BYTES_RECEIVED, message.buffer.size());
+    from = delivery.from;
+    return *this;
+}
+
+MemoryTransport& MemoryTransport::operator<<(const Message& message)
+{
+    if (!attached) {
+        throw std::string("Transport is not open");
+    }
+    bus.send(this, to, message.buffer);
+    Metrics::add(METRIC_PACKETS_SENT);
+    Metrics::add(METRIC_BYTES_SENT, message.buffer.size());
+    return *this;
+}
+
+MemoryTransport& MemoryTransport::operator>>(Address& address)
+{
+    in_addr ip;
+    ip.s_addr = htonl(from.first);
+    address.ip_address = inet_ntoa(ip);
+    address.port = from.second;
+    return *this;
+}
+
+MemoryTransport& MemoryTransport::operator<<(const Address& address)
+{
+    to = MemoryBus::Key(ntohl(inet_addr(address.ip_address.c_str())), address.port);
+    return *this;
+}
+
+void MemoryTransport::close()
+{
+    std::lock_guard<std::mutex> lock(bus.mutex);
+    if (attached) {
+        bus.detach(this);
+        attached = false;
+    }
+}
+
+void MemoryTransport::set_reuse(bool reuse)
+{
+    // Ports on the bus can always be shared
+}
+
+void MemoryTransport::set_block_filter(unsigned int index, unsigned int count)
+{
+    std::lock_guard<std::mutex> lock(bus.mutex);
+    filter_index = index;
+    filter_count = count;
+}
+
+void MemoryTransport::set_type_filter(unsigned int types)
+{
+    std::lock_guard<std::mutex> lock(bus.mutex);
+    filter_types = types;
+}
+
+void MemoryTransport::set_session_filter(unsigned int sender, bool peers)
+{
+    std::lock_guard<std::mutex> lock(bus.mutex);
+    filter_sender = sender;
+    has_filter_sender = true;
+    filter_peers = peers;
+}
+
+void MemoryTransport::set_received_filter(uint64_t start, uint64_t end)
+{
+    std::lock_guard<std::mutex> lock(bus.mutex);
+    received_start = start;
+    received_end = end;
+}
+
+bool MemoryTransport::accepts(const std::vector<char>& data) const
+{
+    // The same rules as the socket filters that BlockSocket attaches
+    if (data.size() < sizeof(Header)) {
+        return false;
+    }
+    const Header* header = (const Header*)&data.front();
+    unsigned int type = ntohl(header->type);
+    if (filter_types && (type >= 32 || !(filter_types & (1U << type)))) {
+        return false;
+    }
+    bool peer = false;
+    if (has_filter_sender && type != MESSAGE_TYPE_INFO && ntohl(header->sender) != filter_sender) {
+        if (!filter_peers || (type != MESSAGE_TYPE_GETRANGES && type != MESSAGE_TYPE_BLOCK)) {
+            return false;
+        }
+        peer = true;
+    }
+    if (type != MESSAGE_TYPE_BLOCK) {
+        return filter_index == 0;
+    }
+
+    const size_t offset = sizeof(Header) + sizeof(FileInfo);
+    if (data.size() < offset + sizeof(uint64_t)) {
+        return false;
+    }
+    uint64_t block = ntoh64(*(const uint64_t*)&data[offset]);
+    if (!peer && block >= received_start && block < received_end) {
+        return false;
+    }
+    return filter_count <= 1 || block % filter_count == filter_index;
+}
+
+bool MemoryTransport::readable(TransportFactory::Clock::time_point now) const
+{
+    // With a virtual clock a message sent in this round waits for the next
+    if (queue.empty() || queue.front().due > now) {
+        return false;
+    }
+    return !bus.virtual_time || queue.front().round != bus.generation;
+}
+
+TransportFactory::Clock::time_point MemoryTransport::next_arrival(TransportFactory::Clock::time_point now) const
+{
+    if (queue.empty() || queue.front().due <= now) {
+        return TransportFactory::Clock::time_point();
+    }
+    return queue.front().due;
+}
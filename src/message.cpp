@@ -7,7 +7,8 @@ using namespace Msync;
 
 Message::Message(unsigned int reserve) :
     buffer(reserve + sizeof(Header)),
-    direction(INPUT)
+    direction(INPUT),
+    stamp(0)
 {
     Header* header = (Header*)&buffer.front();
     header->type = 0;
@@ -18,7 +19,8 @@ Message::Message(unsigned int reserve) :
 
 Message::Message(unsigned int sender, unsigned int type) :
     buffer(sizeof(Header)),
-    direction(OUTPUT)
+    direction(OUTPUT),
+    stamp(0)
 {
     Header* header = (Header*)&buffer.front();
     header->type = htonl(type);
@@ -29,7 +31,8 @@ Message::Message(unsigned int sender, unsigned int type) :
 
 Message::Message(unsigned int sender, unsigned int type, unsigned int reserve) :
     buffer(reserve + sizeof(Header)),
-    direction(OUTPUT)
+    direction(OUTPUT),
+    stamp(0)
 {
     Header* header = (Header*)&buffer.front();
     header->type = htonl(type);
@@ -40,7 +43,8 @@ Message::Message(unsigned int sender, unsigned int type, unsigned int reserve) :
 
 Message::Message(unsigned int sender, unsigned int type, const std::string& text) :
     buffer(text.length() + sizeof(Header)),
-    direction(OUTPUT)
+    direction(OUTPUT),
+    stamp(0)
 {
     Header* header = (Header*)&buffer.front();
     header->type = htonl(type);
@@ -59,6 +63,29 @@ unsigned int Message::get_type() const
     return ntohl(header->type);
 }
 
+unsigned int Message::get_sender() const
+{
+    // Return the sender from the header portion
+    Header* header = (Header*)&buffer.front();
+    return ntohl(header->sender);
+}
+
+void Message::set_sender(unsigned int sender)
+{
+    Header* header = (Header*)&buffer.front();
+    header->sender = htonl(sender);
+}
+
+uint64_t Message::get_stamp() const
+{
+    return stamp;
+}
+
+void Message::set_stamp(uint64_t stamp)
+{
+    this->stamp = stamp;
+}
+
 unsigned int Message::get_length() const
 {
     // Return the length of the data portion of the message
@@ -0,0 +1,182 @@
+#include "metrics.hpp"
+#include <sstream>
+#include <chrono>
+
+using namespace Msync;
+
+const Metrics::Description Metrics::descriptions[METRIC_COUNT] = {
+    { "msync_packets_sent_total", "counter", "Packets sent" },
+    { "msync_bytes_sent_total", "counter", "Bytes sent, including headers" },
+    { "msync_packets_received_total", "counter", "Packets received" },
+    { "msync_bytes_received_total", "counter", "Bytes received, including headers" },
+    { "msync_send_wouldblock_total", "counter", "Sends that failed because the socket buffer was full" },
+    { "msync_repair_requests_total", "counter", "Repair requests received by servers" },
+    { "msync_repairs_sent_total", "counter", "Blocks resent by servers in answer to repair requests" },
+    { "msync_blocks_received_total", "counter", "New blocks written by clients" },
+    { "msync_duplicate_blocks_total", "counter", "Blocks received by clients that already had them" },
+    { "msync_disk_writes_total", "counter", "Blocks written to disk" },
+    { "msync_disk_write_microseconds_total", "counter", "Time spent writing blocks to disk" },
+    { "msync_ring_write_microseconds_total", "counter", "Time from submitting block writes to a transport's ring to reaping their completions" },
+    { "msync_receive_buffer_drops_total", "counter", "Packets the kernel dropped because a receive buffer was full" },
+    { "msync_blocks_lost_total", "counter", "Blocks missing after a client's first pass that its receive buffers didn't drop, so were lost on the way" },
+    { "msync_send_queue_depth", "gauge", "Messages waiting in the servers' send queues" },
+    { "msync_missing_blocks", "gauge", "Blocks that clients are still waiting for" },
+    { "msync_hosts", "gauge", "Clients known to the servers" },
+    { "msync_jitter_microseconds", "gauge", "Interarrival jitter of blocks, summed over clients" }
+};
+
+const Metrics::Description Metrics::stages[STAGE_COUNT] = {
+    { "msync_block_read_microseconds", "summary", "Time taken by servers to read a block from disk" },
+    { "msync_send_queue_microseconds", "summary", "Time messages wait in servers' queues before they are sent" },
+    { "msync_network_microseconds", "summary", "One-way delay of blocks from server to client" },
+    { "msync_write_microseconds", "summary", "Time from a client receiving a block to writing it to disk" },
+    { "msync_transmit_microseconds", "summary", "Time from a server sending a packet to the kernel transmitting it" },
+    { "msync_receive_queue_microseconds", "summary", "Time packets wait in the kernel after arriving before they are read" },
+    { "msync_arrival_gap_microseconds", "summary", "Time between blocks arriving on a socket" }
+};
+
+std::mutex Metrics::mutex;
+std::set<ThreadMetrics*> Metrics::threads;
+int64_t Metrics::retired[METRIC_COUNT];
+Histogram Metrics::retired_histograms[STAGE_COUNT];
+
+namespace Msync {
+
+/**
+ * One thread's copy of the metrics, registered on first use.  Histograms
+ * are only allocated for the stages the thread records.
+ */
+struct ThreadMetrics {
+    ThreadMetrics()
+    {
+        for (unsigned int i = 0; i < METRIC_COUNT; i++) {
+            values[i] = 0;
+        }
+        for (unsigned int i = 0; i < STAGE_COUNT; i++) {
+            histograms[i] = 0;
+        }
+        Metrics::attach(this);
+    }
+
+    ~ThreadMetrics()
+    {
+        Metrics::detach(this);
+    }
+
+    std::atomic<int64_t> values[METRIC_COUNT];
+    std::atomic<Histogram*> histograms[STAGE_COUNT];
+};
+
+static thread_local ThreadMetrics local;
+
+}
+
+void Metrics::add(Metric metric, int64_t value)
+{
+    // Only this thread writes its copy, so a plain load and store is
+    // enough; readers see either the old or the new value
+    std::atomic<int64_t>& total = local.values[metric];
+    total.store(total.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+int64_t Metrics::get(Metric metric)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    int64_t value = retired[metric];
+    for (std::set<ThreadMetrics*>::iterator i = threads.begin(); i != threads.end(); i++) {
+        value += (*i)->values[metric].load(std::memory_order_relaxed);
+    }
+    return value;
+}
+
+const char* Metrics::get_name(Metric metric)
+{
+    return descriptions[metric].name;
+}
+
+void Metrics::record(Stage stage, uint64_t microseconds)
+{
+    Histogram* histogram = local.histograms[stage].load(std::memory_order_relaxed);
+    if (!histogram) {
+        histogram = add_histogram(&local, stage);
+    }
+    histogram->record(microseconds);
+}
+
+void Metrics::get_histogram(Stage stage, Histogram& histogram)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    histogram.merge(retired_histograms[stage]);
+    for (std::set<ThreadMetrics*>::iterator i = threads.begin(); i != threads.end(); i++) {
+        Histogram* copy = (*i)->histograms[stage].load(std::memory_order_relaxed);
+        if (copy) {
+            histogram.merge(*copy);
+        }
+    }
+}
+
+const char* Metrics::get_name(Stage stage)
+{
+    return stages[stage].name;
+}
+
+uint64_t Metrics::now()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+std::string Metrics::format()
+{
+    std::ostringstream output;
+    for (unsigned int i = 0; i < METRIC_COUNT; i++) {
+        const Description& description = descriptions[i];
+        output << "# HELP " << description.name << " " << description.help << "\n";
+        output << "# TYPE " << description.name << " " << description.type << "\n";
+        output << description.name << " " << get((Metric)i) << "\n";
+    }
+    const double quantiles[] = { 0.5, 0.9, 0.99, 0.999, 1 };
+    for (unsigned int i = 0; i < STAGE_COUNT; i++) {
+        const Description& description = stages[i];
+        Histogram histogram;
+        get_histogram((Stage)i, histogram);
+        output << "# HELP " << description.name << " " << description.help << "\n";
+        output << "# TYPE " << description.name << " " << description.type << "\n";
+        for (unsigned int k = 0; k < sizeof(quantiles) / sizeof(quantiles[0]); k++) {
+            output << description.name << "{quantile=\"" << quantiles[k] << "\"} " << histogram.get_quantile(quantiles[k]) << "\n";
+        }
+        output << description.name << "_sum " << histogram.get_sum() << "\n";
+        output << description.name << "_count " << histogram.get_count() << "\n";
+    }
+    return output.str();
+}
+
+void Metrics::attach(ThreadMetrics* metrics)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    threads.insert(metrics);
+}
+
+Histogram* Metrics::add_histogram(ThreadMetrics* metrics, Stage stage)
+{
+    // The lock keeps readers from seeing the histogram half built
+    std::lock_guard<std::mutex> lock(mutex);
+    Histogram* histogram = new Histogram();
+    metrics->histograms[stage].store(histogram, std::memory_order_relaxed);
+    return histogram;
+}
+
+void Metrics::detach(ThreadMetrics* metrics)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (unsigned int i = 0; i < METRIC_COUNT; i++) {
+        retired[i] += metrics->values[i].load(std::memory_order_relaxed);
+    }
+    for (unsigned int i = 0; i < STAGE_COUNT; i++) {
+        Histogram* histogram = metrics->histograms[i].load(std::memory_order_relaxed);
+        if (histogram) {
+            retired_histograms[i].merge(*histogram);
+            delete histogram;
+        }
+    }
+    threads.erase(metrics);
+}
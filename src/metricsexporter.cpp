@@ -0,0 +1,129 @@
+#include "metricsexporter.hpp"
+#include "metrics.hpp"
+#include <chrono>
+#include <fstream>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+
+#ifndef WINDOWS
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+// Interval at which the export thread checks whether it has been stopped,
+// in milliseconds
+#define METRICS_STOP_CHECK 100
+
+using namespace Msync;
+
+MetricsExporter::MetricsExporter(const std::string& target, unsigned long interval, Logger& logger) :
+    path(target),
+    interval(interval),
+    logger(logger),
+    listener(-1),
+    stopped(false)
+{
+    std::string prefix(METRICS_SOCKET_PREFIX);
+    if (target.compare(0, prefix.size(), prefix) == 0) {
+        path = target.substr(prefix.size());
+#ifdef WINDOWS
+        throw std::string("UNIX sockets are not supported");
+#else
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            throw std::string("Socket path is too long: ") + path;
+        }
+        strcpy(address.sun_path, path.c_str());
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0) {
+            throw std::string("Could not create metrics socket: ") + strerror(errno);
+        }
+        ::unlink(path.c_str());
+        if (bind(listener, (sockaddr*)&address, sizeof(address)) < 0 || listen(listener, 8) < 0) {
+            std::string error = strerror(errno);
+            ::close(listener);
+            throw std::string("Could not listen on ") + path + ": " + error;
+        }
+#endif
+    }
+    thread = std::thread(&MetricsExporter::run, this);
+}
+
+MetricsExporter::~MetricsExporter()
+{
+    stopped = true;
+    thread.join();
+#ifndef WINDOWS
+    if (listener >= 0) {
+        ::close(listener);
+        ::unlink(path.c_str());
+        return;
+    }
+#endif
+    write_file();
+}
+
+void MetricsExporter::write_file()
+{
+    std::string temp = path + ".tmp";
+    {
+        std::ofstream output(temp.c_str());
+        output << Metrics::format();
+        if (!output) {
+            MSYNC_LOG(logger, WARNING) << "Could not write metrics to " << temp << "\n";
+            return;
+        }
+    }
+    if (rename(temp.c_str(), path.c_str()) != 0) {
+        MSYNC_LOG(logger, WARNING) << "Could not move metrics to " << path << ": " << strerror(errno) << "\n";
+    }
+}
+
+void MetricsExporter::run()
+{
+    typedef std::chrono::steady_clock clock;
+    clock::time_point next = clock::now();
+    while (!stopped) {
+        if (listener < 0) {
+            if (clock::now() >= next) {
+                write_file();
+                next += std::chrono::milliseconds(interval);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(METRICS_STOP_CHECK));
+            continue;
+        }
+
+#ifndef WINDOWS
+        // Each connection gets a snapshot, so that a scraper can simply
+        // read until the socket is closed
+        pollfd descriptor;
+        descriptor.fd = listener;
+        descriptor.events = POLLIN;
+        if (poll(&descriptor, 1, METRICS_STOP_CHECK) <= 0) {
+            continue;
+        }
+        int connection = accept(listener, NULL, NULL);
+        if (connection < 0) {
+            continue;
+        }
+        std::string text = Metrics::format();
+        size_t sent = 0;
+        while (sent < text.size()) {
+            ssize_t bytes = ::send(connection, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+            if (bytes < 0 && errno == EINTR) {
+                continue;
+            } else if (bytes <= 0) {
+                break;
+            }
+            sent += bytes;
+        }
+        ::close(connection);
+#endif
+    }
+}
@@ -0,0 +1,198 @@
+#include "pathmonitor.hpp"
+#include "metrics.hpp"
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+// Weight of each new sample in the smoothed delay
+#define DELAY_GAIN (1.0 / 8)
+
+// Weight of each new sample in the jitter, as RTP uses
+#define JITTER_GAIN (1.0 / 16)
+
+using namespace Msync;
+
+/**
+ * The measurements of the blocks read from one transport.  Only the thread
+ * reading the transport writes them, so a plain load and store is enough;
+ * the thread making reports sees either the old or the new value.
+ */
+struct PathMonitor::Source {
+    Source();
+
+    /**
+     * Records the arrival of a block, as PathMonitor::arrived() does.
+     * @param sent the time the server sent the block
+     * @param received the time the block was received
+     */
+    void arrived(uint64_t sent, uint64_t received);
+
+    /**
+     * Returns the lowest transit time of the intervals kept.
+     * @return the base transit time
+     */
+    int64_t base_transit() const;
+
+    /**
+     * Returns true if the source has measured a block since it was last
+     * reset.
+     * @return true if the measurements are meaningful
+     */
+    bool measured() const;
+
+    int64_t last_transit;
+    uint64_t interval;
+    std::atomic<bool> stale;
+    std::atomic<uint64_t> count;
+    std::atomic<int64_t> min_transits[BASE_DELAY_HISTORY];
+    std::atomic<double> delay;
+    std::atomic<double> jitter;
+};
+
+PathMonitor::Source::Source() :
+    last_transit(0),
+    interval(0),
+    stale(false),
+    count(0),
+    delay(0),
+    jitter(0)
+{
+    for (unsigned int i = 0; i < BASE_DELAY_HISTORY; i++) {
+        min_transits[i] = std::numeric_limits<int64_t>::max();
+    }
+}
+
+void PathMonitor::Source::arrived(uint64_t sent, uint64_t received)
+{
+    // The transit time includes the offset between the two clocks, which
+    // cancels out of the jitter and the queueing delay
+    int64_t transit = (int64_t)(received - sent);
+    uint64_t current_interval = received / BASE_DELAY_INTERVAL;
+    if (stale.load(std::memory_order_relaxed) && stale.exchange(false)) {
+        count.store(0, std::memory_order_relaxed);
+    }
+    uint64_t samples = count.load(std::memory_order_relaxed);
+    if (samples == 0) {
+        for (unsigned int i = 0; i < BASE_DELAY_HISTORY; i++) {
+            min_transits[i].store(std::numeric_limits<int64_t>::max(), std::memory_order_relaxed);
+        }
+        interval = current_interval;
+        delay.store((double)transit, std::memory_order_relaxed);
+        jitter.store(0, std::memory_order_relaxed);
+    } else {
+        double current_jitter = jitter.load(std::memory_order_relaxed);
+        double current_delay = delay.load(std::memory_order_relaxed);
+        jitter.store(current_jitter + (std::fabs((double)(transit - last_transit)) - current_jitter) * JITTER_GAIN,
+            std::memory_order_relaxed);
+        delay.store(current_delay + (transit - current_delay) * DELAY_GAIN, std::memory_order_relaxed);
+    }
+
+    // Start the intervals since the last block afresh, forgetting the
+    // oldest.  A block received out of order counts in the current one.
+    for (unsigned int i = 0; i < BASE_DELAY_HISTORY && interval < current_interval; i++) {
+        interval++;
+        min_transits[interval % BASE_DELAY_HISTORY].store(std::numeric_limits<int64_t>::max(), std::memory_order_relaxed);
+    }
+    interval = std::max(interval, current_interval);
+    std::atomic<int64_t>& min_transit = min_transits[interval % BASE_DELAY_HISTORY];
+    if (transit < min_transit.load(std::memory_order_relaxed)) {
+        min_transit.store(transit, std::memory_order_relaxed);
+    }
+    last_transit = transit;
+    count.store(samples + 1, std::memory_order_relaxed);
+}
+
+int64_t PathMonitor::Source::base_transit() const
+{
+    int64_t base = std::numeric_limits<int64_t>::max();
+    for (unsigned int i = 0; i < BASE_DELAY_HISTORY; i++) {
+        base = std::min(base, min_transits[i].load(std::memory_order_relaxed));
+    }
+    return base;
+}
+
+bool PathMonitor::Source::measured() const
+{
+    return count.load(std::memory_order_relaxed) > 0 && !stale.load(std::memory_order_relaxed);
+}
+
+PathMonitor::PathMonitor() :
+    reported_jitter(0)
+{
+}
+
+PathMonitor::~PathMonitor()
+{
+    Metrics::add(METRIC_JITTER_MICROSECONDS, -reported_jitter);
+}
+
+void PathMonitor::set_sources(size_t count)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    while (sources.size() < count) {
+        sources.push_back(std::tr1::shared_ptr<Source>(new Source()));
+    }
+}
+
+void PathMonitor::arrived(size_t source, uint64_t sent, uint64_t received)
+{
+    if (source < sources.size()) {
+        sources[source]->arrived(sent, received);
+    }
+}
+
+void PathMonitor::reset()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t k = 0; k < sources.size(); k++) {
+        sources[k]->stale = true;
+    }
+    Metrics::add(METRIC_JITTER_MICROSECONDS, -reported_jitter);
+    reported_jitter = 0;
+}
+
+PathReport PathMonitor::get_report()
+{
+    // The sources see the same path, so their delays and jitters are
+    // averaged, and the base is the lowest any of them has seen
+    std::lock_guard<std::mutex> lock(mutex);
+    double delay = 0;
+    double jitter = 0;
+    int64_t base = std::numeric_limits<int64_t>::max();
+    unsigned int measured = 0;
+    for (size_t k = 0; k < sources.size(); k++) {
+        const Source& source = *sources[k];
+        if (!source.measured()) {
+            continue;
+        }
+        delay += source.delay.load(std::memory_order_relaxed);
+        jitter += source.jitter.load(std::memory_order_relaxed);
+        base = std::min(base, source.base_transit());
+        measured++;
+    }
+    if (measured == 0) {
+        return PathReport();
+    }
+    delay /= measured;
+    jitter /= measured;
+
+    int64_t current = (int64_t)jitter;
+    if (current != reported_jitter) {
+        Metrics::add(METRIC_JITTER_MICROSECONDS, current - reported_jitter);
+        reported_jitter = current;
+    }
+    double queueing = delay - base;
+    return PathReport(delay > 0 ? (uint32_t)delay : 0, queueing > 0 ? (uint32_t)queueing : 0, (uint32_t)jitter);
+}
+
+bool PathMonitor::has_report()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t k = 0; k < sources.size(); k++) {
+        if (sources[k]->measured()) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,100 @@
+#include "sparsescanner.hpp"
+
+#ifndef WINDOWS
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <cerrno>
+#include <cstring>
+
+using namespace Msync;
+
+SparseScanner::SparseScanner(const std::string& path, unsigned int block_size) :
+    fd(-1),
+    block_size(block_size),
+    data_start(0),
+    data_end(0)
+{
+#ifndef WINDOWS
+    fd = ::open(path.c_str(), O_RDONLY);
+#endif
+}
+
+SparseScanner::~SparseScanner()
+{
+#ifndef WINDOWS
+    if (fd >= 0) {
+        ::close(fd);
+    }
+#endif
+}
+
+uint64_t SparseScanner::next_data(uint64_t block, uint64_t count)
+{
+#if defined(SEEK_DATA) && !defined(WINDOWS)
+    if (fd < 0) {
+        return block;
+    }
+    if (block >= data_start && block < data_end) {
+        return block;
+    }
+
+    off_t offset = lseek(fd, (off_t)block * block_size, SEEK_DATA);
+    if (offset < 0) {
+        // ENXIO means there is no data past the offset, i.e. the rest of
+        // the file is one big hole.  Anything else means holes aren't
+        // supported here, so assume the rest of the file has data.
+        if (errno == ENXIO) {
+            return count;
+        }
+        data_start = block;
+        data_end = count;
+        return block;
+    }
+
+    // Round down so that a block that is only partially inside the hole
+    // is still read and sent, and round the end of the data up for the
+    // same reason.  If the end can't be found, only this block is known.
+    uint64_t next = offset / block_size;
+    off_t hole = lseek(fd, offset, SEEK_HOLE);
+    data_start = next;
+    data_end = hole < 0 ? next + 1 : (hole + block_size - 1) / block_size;
+    return next < count ? next : count;
+#else
+    return block;
+#endif
+}
+
+bool SparseScanner::is_zero(const char* data, size_t length)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    // OR together four vectors at a time so that the branch is only taken
+    // once every 64 bytes
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 64 <= length; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(data + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(data + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i*)(data + i + 48));
+        __m128i v = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff) {
+            return false;
+        }
+    }
+#endif
+
+    for (; i < length; i++) {
+        if (data[i]) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -1,61 +1,303 @@
 #include "syncstatus.hpp"
+#include "metrics.hpp"
+#include "tracer.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <chrono>
+
+#ifndef WINDOWS
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 using namespace Msync;
 
-SyncStatus::SyncStatus(const FileInfo& info, const Address& server_address) :
+SyncStatus::SyncStatus(const FileInfo& info, const Address& server_address, uint64_t drops) :
     temp(std::string(tmpnam(NULL)) + info.get_digest() + ".msync"),
-    block_array(info.get_block_count(), false),
-    remaining_blocks(info.get_block_count()),
-    output(new std::ofstream(temp.c_str(), std::ios::binary)),
+    block_array(info.get_block_count()),
+    pending((info.get_block_count() + 63) / 64),
+    writers(0),
+    output(::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)),
+    input(::open(temp.c_str(), O_RDONLY)),
+    phase(PHASE_RECEIVING),
+    heard(0),
+    start_drops(drops),
 	server_address(server_address)
 {
+    if (output < 0) {
+        throw std::string("Could not open ") + temp + ": " + strerror(errno);
+    }
+    Metrics::add(METRIC_MISSING_BLOCKS, block_array.remaining());
+}
+
+SyncStatus::~SyncStatus()
+{
+    Metrics::add(METRIC_MISSING_BLOCKS, -(int64_t)block_array.remaining());
+    if (output >= 0) {
+        ::close(output);
+    }
+    if (input >= 0) {
+        ::close(input);
+    }
+}
+    
+bool SyncStatus::write_block(uint64_t block, const Message& message)
+{
+    Array<char> data = message.get_array<char>();
+    if (!write_data(block, data.data, data.length)) {
+        return false;
+    }
+    record_write(block, message);
+    return true;
+}
+
+bool SyncStatus::write_data(uint64_t block, const char* data, size_t length)
+{
+    // Writers register before checking the bitmap; the file is only closed
+    // once every block is set and no writer is registered, so a write can
+    // never land on a closed (or reused) descriptor.  The block is marked
+    // after it is written, so if two threads race on the same block it is
+    // simply written twice.  Blocks whose write is still running elsewhere
+    // are left to it.
+    writers++;
+    if (block >= block_array.size() || block_array.test(block) ||
+            (pending[block / 64].load() & ((uint64_t)1 << (block % 64)))) {
+        writers--;
+        return false;
+    }
+    
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    off_t offset = (off_t)BLOCKSIZE * block;
+    size_t written = 0;
+    while (written < length) {
+        ssize_t bytes = pwrite(output, data + written, length - written, offset + written);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            writers--;
+            throw std::string("Could not write data block to file: ") + strerror(errno);
+        }
+        written += bytes;
+    }
+    Metrics::add(METRIC_DISK_WRITE_MICROSECONDS, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+    return mark_written(block);
+}
+
+bool SyncStatus::begin_write(uint64_t block)
+{
+    // Only the thread that sets the pending bit writes the block
+    writers++;
+    uint64_t bit = (uint64_t)1 << (block % 64);
+    if (block >= block_array.size() || block_array.test(block) ||
+            (pending[block / 64].fetch_or(bit) & bit)) {
+        writers--;
+        return false;
+    }
+    return true;
+}
+
+bool SyncStatus::end_write(uint64_t block, const Message& message, bool written)
+{
+    if (block >= block_array.size()) {
+        writers--;
+        return false;
+    }
+    pending[block / 64].fetch_and(~((uint64_t)1 << (block % 64)));
+    if (!written) {
+        writers--;
+        return false;
+    }
+    if (!mark_written(block)) {
+        return false;
+    }
+    record_write(block, message);
+    return true;
+}
+
+int SyncStatus::get_descriptor() const
+{
+    return output;
+}
+
+bool SyncStatus::mark_written(uint64_t block)
+{
+    // Only the thread that sets the bit counts the block, if two raced to
+    // write it
+    Metrics::add(METRIC_DISK_WRITES);
+    bool added = block_array.set(block);
+    if (added) {
+        Metrics::add(METRIC_BLOCKS_RECEIVED);
+        Metrics::add(METRIC_MISSING_BLOCKS, -1);
+    }
+    writers--;
+    return added;
+}
+
+void SyncStatus::record_write(uint64_t block, const Message& message)
+{
+    uint64_t received = message.get_stamp();
+    if (received) {
+        uint64_t now = Metrics::now();
+        Metrics::record(STAGE_WRITE, now > received ? now - received : 0);
+        if (Tracer::sampled(block)) {
+            Tracer::span("write", block, received, now);
+        }
+    }
+}
+
+void SyncStatus::mark_empty(uint64_t start, uint64_t count)
+{
+    Metrics::add(METRIC_MISSING_BLOCKS, -(int64_t)block_array.set_range(start, count));
 }
     
-void SyncStatus::write_block(unsigned long block, const Message& message)
+uint64_t SyncStatus::get_remaining_blocks() const
+{
+    return block_array.remaining();
+}
+
+uint64_t SyncStatus::encode_missing(uint64_t block, std::vector<Extent>& extents, size_t max) const
+{
+    return block_array.encode_missing(block, extents, max);
+}
+
+void SyncStatus::get_received_run(uint64_t& start, uint64_t& end) const
 {
-    if (!block_array[block]) {
-        // Seek to the location where the block should go, and write
-        // the block to the output stream
-        output->seekp(BLOCKSIZE * block);
-        (*output) << message;
-                
-        // Mark the block as written.
-        block_array[block] = true;
-        remaining_blocks--;
+    start = end = 0;
+    uint64_t size = block_array.size();
+    uint64_t block = block_array.next_present(0);
+    for (unsigned int runs = 0; block < size && runs < RUN_SCAN_LIMIT; runs++) {
+        uint64_t last = block_array.next_missing(block);
+        if (last - block > end - start) {
+            start = block;
+            end = last;
+        }
+        block = block_array.next_present(last);
     }
 }
     
+bool SyncStatus::read_block(uint64_t block, std::string& data) const
+{
+    if (input < 0 || block + 1 >= block_array.size() || !block_array.test(block)) {
+        return false;
+    }
+    data.resize(BLOCKSIZE);
+    off_t offset = (off_t)BLOCKSIZE * block;
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t bytes = pread(input, &data[done], data.size() - done, offset + done);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        } else if (bytes < 0) {
+            return false;
+        } else if (bytes == 0) {
+            // Blocks at the end of a file still being written may be holes
+            // past its current length; they are zero
+            std::fill(data.begin() + done, data.end(), 0);
+            break;
+        }
+        done += bytes;
+    }
+    return true;
+}
+
+bool SyncStatus::has_block(uint64_t block) const
+{
+    return block < block_array.size() && block_array.test(block);
+}
+
+bool SyncStatus::has_path()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return !path.empty();
+}
+
+const std::string& SyncStatus::get_temp_path() const
+{
+    return temp;
+}
+
 void SyncStatus::set_path(const std::string& path)
 {
+    std::lock_guard<std::mutex> lock(mutex);
     this->path = path;
 }
     
-void SyncStatus::set_goodbye_received()
+Phase SyncStatus::get_phase()
 {
-	this->goodbye_received = true;
+    std::lock_guard<std::mutex> lock(mutex);
+    return phase;
 }
 
-bool SyncStatus::transfer_complete()
+bool SyncStatus::begin_repair()
 {
-    if (remaining_blocks == 0 && !path.empty()) {
-		if (output) {
-			output->close();
-			std::cout << "closing, moving " << temp << " to " << path << std::endl;
-        	rename(temp.c_str(), path.c_str());
-		} else {
-			output.reset();
-		}
-        return true;
-    } else {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (phase != PHASE_RECEIVING) {
         return false;
     }
+    phase = PHASE_REPAIRING;
+    return true;
 }
 
-const Address& SyncStatus::get_server_address() {
-	return this->server_address;
+bool SyncStatus::complete()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (phase != PHASE_RECEIVING && phase != PHASE_REPAIRING) {
+        return false;
+    }
+    if (block_array.remaining() != 0 || path.empty() || writers != 0) {
+        return false;
+    }
+    ::close(output);
+    output = -1;
+    std::cout << "closing, moving " << temp << " to " << path << std::endl;
+    rename(temp.c_str(), path.c_str());
+    phase = PHASE_LEAVING;
+    return true;
+}
+
+bool SyncStatus::acknowledge()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (phase != PHASE_LEAVING) {
+        return false;
+    }
+    phase = PHASE_DONE;
+    return true;
+}
+
+bool SyncStatus::fail()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (phase != PHASE_RECEIVING && phase != PHASE_REPAIRING) {
+        return false;
+    }
+    
+    // The output is left open for writers that are still running, and
+    // closed when the status is destroyed
+    unlink(temp.c_str());
+    phase = PHASE_FAILED;
+    return true;
+}
+
+void SyncStatus::touch(uint64_t now)
+{
+    heard.store(now, std::memory_order_relaxed);
+}
+
+uint64_t SyncStatus::get_heard() const
+{
+    return heard.load(std::memory_order_relaxed);
 }
 
-bool SyncStatus::sync_complete()
+uint64_t SyncStatus::get_start_drops() const
 {
-	return goodbye_received && transfer_complete();
+    return start_drops;
+}
+
+const Address& SyncStatus::get_server_address() {
+	return this->server_address;
 }
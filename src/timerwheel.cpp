@@ -0,0 +1,54 @@
+#include "timerwheel.hpp"
+
+using namespace Msync;
+
+TimerWheel::TimerWheel(uint64_t tick, size_t slots, uint64_t now) :
+    slots(slots ? slots : 1),
+    tick(tick ? tick : 1),
+    current(now / this->tick),
+    count(0)
+{
+}
+
+void TimerWheel::schedule(unsigned int id, uint64_t when)
+{
+    // Timers that are already due go in the current slot, so they fire on
+    // the next advance
+    uint64_t slot = when / tick;
+    if (slot < current) {
+        slot = current;
+    }
+    slots[slot % slots.size()].push_back(Timer(id, when));
+    count++;
+}
+
+void TimerWheel::advance(uint64_t now, std::vector<Timer>& expired)
+{
+    uint64_t target = now / tick;
+    if (target < current) {
+        return;
+    }
+    
+    // Visit each slot that has passed, but never go around more than once.
+    // Timers more than one rotation away stay in their slot.
+    uint64_t first = target - current >= slots.size() ? target - slots.size() + 1 : current;
+    for (uint64_t t = first; t <= target; t++) {
+        std::vector<Timer>& slot = slots[t % slots.size()];
+        size_t kept = 0;
+        for (size_t i = 0; i < slot.size(); i++) {
+            if (slot[i].second <= now) {
+                expired.push_back(slot[i]);
+                count--;
+            } else {
+                slot[kept++] = slot[i];
+            }
+        }
+        slot.resize(kept);
+    }
+    current = target;
+}
+
+size_t TimerWheel::size() const
+{
+    return count;
+}
@@ -0,0 +1,63 @@
+#include "tracer.hpp"
+#include <fstream>
+#include <thread>
+#include <functional>
+#include <cerrno>
+#include <cstring>
+
+#ifdef WINDOWS
+#define getpid() GetCurrentProcessId()
+#else
+#include <unistd.h>
+#endif
+
+using namespace Msync;
+
+std::atomic<uint64_t> Tracer::interval(0);
+std::mutex Tracer::mutex;
+std::string Tracer::path;
+std::vector<Tracer::Event> Tracer::events;
+
+void Tracer::start(const std::string& path, uint64_t interval)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Tracer::path = path;
+    events.clear();
+    Tracer::interval = interval ? interval : 1;
+}
+
+void Tracer::stop()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!interval) {
+        return;
+    }
+    interval = 0;
+
+    // Each stage is a complete event on the thread that recorded it
+    std::ofstream output(path.c_str());
+    output << "{\"traceEvents\": [";
+    for (size_t i = 0; i < events.size(); i++) {
+        const Event& event = events[i];
+        output << (i ? ",\n" : "\n") << "{\"name\": \"" << event.name << "\", \"cat\": \"block\", \"ph\": \"X\""
+            << ", \"ts\": " << event.start << ", \"dur\": " << event.duration
+            << ", \"pid\": " << getpid() << ", \"tid\": " << event.thread
+            << ", \"args\": {\"block\": " << event.block << "}}";
+    }
+    output << "\n], \"displayTimeUnit\": \"ms\"}\n";
+    events.clear();
+    if (!output) {
+        throw std::string("Could not write trace to ") + path + ": " + strerror(errno);
+    }
+}
+
+void Tracer::span(const char* name, uint64_t block, uint64_t start, uint64_t end)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!interval || events.size() >= TRACE_EVENT_LIMIT) {
+        return;
+    }
+    Event event = { name, block, start, end > start ? end - start : 0,
+        std::hash<std::thread::id>()(std::this_thread::get_id()) % 100000 };
+    events.push_back(event);
+}
@@ -0,0 +1,619 @@
+#include "uringsocket.hpp"
+#include "logger.hpp"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#ifdef IORING_RECV_MULTISHOT
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+#include <cerrno>
+#include <cstring>
+#include <vector>
+#include <map>
+#include <deque>
+#include <algorithm>
+
+// Number of buffers each socket's ring holds for arriving packets; a power
+// of two
+#define URING_BUFFERS 64
+
+// Space in each buffer for a packet, or a coalesced run of them
+#define URING_PAYLOAD 65536
+
+// Space in each buffer for the packet's ancillary data
+#define URING_CONTROL 256
+
+// Number of submission entries; the receive and each write are submitted
+// as soon as they are added
+#define URING_ENTRIES 4
+
+// Number of writes that can be running on each ring; further writes are
+// left to the caller
+#define URING_WRITES 64
+
+// Buffer group that the receive takes its buffers from
+#define URING_GROUP 0
+
+using namespace Msync;
+
+#ifdef IORING_RECV_MULTISHOT
+
+/**
+ * The rings shared with the kernel, and the buffers packets are received
+ * into.  Only the thread reading the socket touches it.
+ */
+struct UringSocket::Ring {
+    Ring();
+    ~Ring();
+
+    /**
+     * Creates the ring and registers its buffers.  Whatever has been set
+     * up is released by the destructor if this fails.
+     * @throw string if the kernel can't provide the ring
+     */
+    void setup();
+
+    /**
+     * Lets the kernel post the completions it has deferred to this thread,
+     * and clears the event that signalled them.
+     */
+    void flush();
+
+    /**
+     * Returns the next completion, if there is one.
+     * @param completion receives the completion
+     * @return false if there are no completions waiting
+     */
+    bool next(io_uring_cqe& completion);
+
+    /**
+     * Hands a buffer back to the kernel.
+     * @param id the buffer's ID
+     */
+    void recycle(unsigned short id);
+
+    /**
+     * Adds an entry to the submission queue and submits it.
+     * @param entry the entry
+     * @return false if the kernel wouldn't take it
+     */
+    bool submit(const io_uring_sqe& entry);
+
+    /**
+     * Finishes a write that the kernel has completed.
+     * @param completion the write's completion
+     */
+    void complete(const io_uring_cqe& completion);
+
+    int fd;
+    int event;
+    int signal;
+    void* rings;
+    size_t rings_size;
+    io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe* cqes;
+    io_uring_buf* buffers;
+    unsigned short* buffer_tail;
+    std::vector<char> pool;
+    size_t buffer_size;
+    msghdr request;
+    bool holding;
+    unsigned short current;
+    size_t offset;
+    size_t end;
+    size_t size;
+    uint64_t stamp;
+    bool deferred;
+    bool enabled;
+    bool armed;
+    std::map<uint64_t, std::tr1::shared_ptr<FileWrite> > writes;
+    uint64_t next_write;
+    std::deque<io_uring_cqe> received;
+};
+
+UringSocket::Ring::Ring() :
+    fd(-1),
+    event(-1),
+    signal(-1),
+    rings(MAP_FAILED),
+    rings_size(0),
+    sqes((io_uring_sqe*)MAP_FAILED),
+    sqes_size(0),
+    buffers((io_uring_buf*)MAP_FAILED),
+    buffer_size(sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_in) + URING_CONTROL + URING_PAYLOAD),
+    holding(false),
+    current(0),
+    offset(0),
+    end(0),
+    size(0),
+    stamp(0),
+    deferred(false),
+    enabled(true),
+    armed(false),
+    next_write(0)
+{
+}
+
+void UringSocket::Ring::setup()
+{
+    // Every buffer and write can be waiting in the completion queue at
+    // once, so it is made large enough that completions are never dropped
+    io_uring_params params;
+#ifdef IORING_SETUP_DEFER_TASKRUN
+    // Packets are received only when the reading thread asks for them, so
+    // a burst is reaped with one system call rather than interrupting the
+    // thread for each packet.  The ring is enabled by the thread that
+    // arms the receive, which is the only one allowed to submit, and an
+    // event tells it when there is work, since the ring's own descriptor
+    // doesn't wake a poll for deferred work.
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER |
+        IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_R_DISABLED;
+    params.cq_entries = URING_BUFFERS * 2 + URING_WRITES;
+    fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    deferred = fd >= 0;
+    enabled = !deferred;
+    if (fd < 0 && errno == EINVAL)
+#endif
+    {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = URING_BUFFERS * 2 + URING_WRITES;
+        fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    }
+    if (fd < 0) {
+        throw std::string("Could not create ring: ") + strerror(errno);
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        throw std::string("Ring needs a newer kernel");
+    }
+    signal = fd;
+    if (deferred) {
+        event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (event < 0) {
+            throw std::string("Could not create event: ") + strerror(errno);
+        }
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD, &event, 1) < 0) {
+            throw std::string("Could not register event: ") + strerror(errno);
+        }
+        signal = event;
+    }
+
+    // Both queues share one mapping; the submission entries have their own
+    rings_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    rings = mmap(0, rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED) {
+        throw std::string("Could not map ring: ") + strerror(errno);
+    }
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = (io_uring_sqe*)mmap(0, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        throw std::string("Could not map ring: ") + strerror(errno);
+    }
+    char* base = (char*)rings;
+    sq_tail = (unsigned*)(base + params.sq_off.tail);
+    sq_mask = *(unsigned*)(base + params.sq_off.ring_mask);
+    sq_array = (unsigned*)(base + params.sq_off.array);
+    cq_head = (unsigned*)(base + params.cq_off.head);
+    cq_tail = (unsigned*)(base + params.cq_off.tail);
+    cq_mask = *(unsigned*)(base + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe*)(base + params.cq_off.cqes);
+
+    // The buffer ring must be page aligned.  Its tail overlays the
+    // reserved field of its first entry.
+    buffers = (io_uring_buf*)mmap(0, URING_BUFFERS * sizeof(io_uring_buf), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers == MAP_FAILED) {
+        throw std::string("Could not allocate buffer ring: ") + strerror(errno);
+    }
+    buffer_tail = &buffers[0].resv;
+    io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (uint64_t)(uintptr_t)buffers;
+    registration.ring_entries = URING_BUFFERS;
+    registration.bgid = URING_GROUP;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+        throw std::string("Could not register buffers: ") + strerror(errno);
+    }
+    pool.resize(URING_BUFFERS * buffer_size);
+    for (unsigned int k = 0; k < URING_BUFFERS; k++) {
+        recycle(k);
+    }
+
+    // Each buffer starts with the receive's header, then room for the
+    // address and ancillary data this template asks for, then the packet
+    memset(&request, 0, sizeof(request));
+    request.msg_namelen = sizeof(sockaddr_in);
+    request.msg_controllen = URING_CONTROL;
+}
+
+UringSocket::Ring::~Ring()
+{
+    // The kernel may still be reading the data of writes that are running,
+    // so they are kept until it finishes, where this thread may wait for
+    // them.  They are dropped without being completed.
+    while (fd >= 0 && !writes.empty()) {
+        if (syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            break;
+        }
+        io_uring_cqe completion;
+        while (next(completion)) {
+            writes.erase(completion.user_data);
+        }
+    }
+
+    // Closing the ring cancels the receive
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    if (event >= 0) {
+        ::close(event);
+    }
+    if (buffers != MAP_FAILED) {
+        munmap(buffers, URING_BUFFERS * sizeof(io_uring_buf));
+    }
+    if (sqes != MAP_FAILED) {
+        munmap(sqes, sqes_size);
+    }
+    if (rings != MAP_FAILED) {
+        munmap(rings, rings_size);
+    }
+}
+
+void UringSocket::Ring::flush()
+{
+    if (deferred) {
+        eventfd_t count;
+        eventfd_read(event, &count);
+        syscall(__NR_io_uring_enter, fd, 0, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+    }
+}
+
+bool UringSocket::Ring::next(io_uring_cqe& completion)
+{
+    unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    completion = cqes[head & cq_mask];
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void UringSocket::Ring::recycle(unsigned short id)
+{
+    unsigned short tail = *buffer_tail;
+    io_uring_buf& buffer = buffers[tail & (URING_BUFFERS - 1)];
+    buffer.addr = (uint64_t)(uintptr_t)&pool[id * buffer_size];
+    buffer.len = buffer_size;
+    buffer.bid = id;
+    __atomic_store_n(buffer_tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+bool UringSocket::Ring::submit(const io_uring_sqe& entry)
+{
+    unsigned tail = *sq_tail;
+    unsigned index = tail & sq_mask;
+    sqes[index] = entry;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    // The kernel only fails the call if it took nothing
+    if (syscall(__NR_io_uring_enter, fd, 1, 0, 0, NULL, 0) < 0) {
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+        return false;
+    }
+    return true;
+}
+
+void UringSocket::Ring::complete(const io_uring_cqe& completion)
+{
+    std::map<uint64_t, std::tr1::shared_ptr<FileWrite> >::iterator i = writes.find(completion.user_data);
+    if (i == writes.end()) {
+        return;
+    }
+    std::tr1::shared_ptr<FileWrite> write = i->second;
+    writes.erase(i);
+    write->completed(completion.res);
+}
+
+#else
+
+struct UringSocket::Ring {
+};
+
+#endif
+
+UringSocket::UringSocket(const std::string& group, unsigned short port, Logger& logger) :
+    BlockSocket(group, port, logger)
+{
+}
+
+UringSocket::~UringSocket()
+{
+    ring.reset();
+}
+
+void UringSocket::open()
+{
+    BlockSocket::open();
+#ifdef IORING_RECV_MULTISHOT
+    // An impairment reads packets itself
+    if (impairment_profile.enabled()) {
+        return;
+    }
+
+    try {
+        ring.reset(new Ring());
+        ring->setup();
+    } catch (std::string& message) {
+        MSYNC_LOG(logger, INFO) << message << "; receiving without io_uring\n";
+        ring.reset();
+    }
+#endif
+}
+
+void UringSocket::arm()
+{
+#ifdef IORING_RECV_MULTISHOT
+    if (ring->armed) {
+        return;
+    }
+    if (!ring->enabled) {
+        if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0) < 0) {
+            throw std::string("Could not enable ring: ") + strerror(errno);
+        }
+        ring->enabled = true;
+    }
+    io_uring_sqe entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.opcode = IORING_OP_RECVMSG;
+    entry.fd = sock;
+    entry.addr = (uint64_t)(uintptr_t)&ring->request;
+    entry.len = 1;
+    entry.ioprio = IORING_RECV_MULTISHOT;
+    entry.flags = IOSQE_BUFFER_SELECT;
+    entry.buf_group = URING_GROUP;
+    if (!ring->submit(entry)) {
+        throw std::string("Could not start receiving: ") + strerror(errno);
+    }
+    ring->armed = true;
+#endif
+}
+
+BlockSocket::Status UringSocket::select(long timeout, bool poll_write)
+{
+#ifdef IORING_RECV_MULTISHOT
+    if (!ring) {
+        return BlockSocket::select(timeout, poll_write);
+    }
+
+    // The kernel completes the receive and the writes on this thread,
+    // either by interrupting the wait or when asked to once its signal is
+    // readable
+    bool readable = ring->holding || reap();
+    if (!readable) {
+        ring->flush();
+        readable = reap();
+    }
+    bool writable = false;
+    if (!readable || poll_write) {
+        pollfd descriptors[2];
+        descriptors[0].fd = ring->signal;
+        descriptors[0].events = POLLIN;
+        descriptors[1].fd = sock;
+        descriptors[1].events = POLLOUT;
+        int ret = ::poll(descriptors, poll_write ? 2 : 1, readable ? 0 : timeout);
+        if (ret < 0 && errno != EINTR) {
+            throw std::string(strerror(errno));
+        }
+        if (ret > 0 && descriptors[0].revents) {
+            ring->flush();
+        }
+        readable = ring->holding || reap();
+        writable = ret > 0 && poll_write && (descriptors[1].revents & POLLOUT);
+    }
+    if (readable && writable) {
+        return BOTH;
+    } else if (readable) {
+        return READ;
+    } else if (writable) {
+        return WRITE;
+    }
+    return NONE;
+#else
+    return BlockSocket::select(timeout, poll_write);
+#endif
+}
+
+UringSocket& UringSocket::operator>>(Message& message)
+{
+#ifdef IORING_RECV_MULTISHOT
+    if (!ring) {
+        BlockSocket::operator>>(message);
+        return *this;
+    }
+    // Packets left in the buffer arrived with the first of them
+    if (!ring->holding) {
+        io_uring_cqe completion;
+        while (true) {
+            if (!reap()) {
+                select(-1);
+                continue;
+            }
+            completion = ring->received.front();
+            ring->received.pop_front();
+            if (completion.res < 0) {
+                throw std::string("Receive failed: ") + strerror(-completion.res);
+            }
+            break;
+        }
+        unsigned short id = completion.flags >> IORING_CQE_BUFFER_SHIFT;
+        char* buffer = &ring->pool[id * ring->buffer_size];
+        const io_uring_recvmsg_out* out = (const io_uring_recvmsg_out*)buffer;
+        char* name = buffer + sizeof(io_uring_recvmsg_out);
+        char* control = name + ring->request.msg_namelen;
+        char* payload = control + ring->request.msg_controllen;
+
+        // A packet too large for the buffer was cut short, and fails the
+        // length check
+        size_t bytes = std::min((size_t)out->payloadlen, (size_t)URING_PAYLOAD);
+        memcpy(&from, name, std::min((size_t)out->namelen, sizeof(from)));
+        iovec vector;
+        vector.iov_base = payload;
+        vector.iov_len = bytes;
+        msghdr header;
+        memset(&header, 0, sizeof(header));
+        header.msg_iov = &vector;
+        header.msg_iovlen = 1;
+        header.msg_control = control;
+        header.msg_controllen = std::min((size_t)out->controllen, (size_t)URING_CONTROL);
+        segment_size = 0;
+        read_control(&message, header);
+        ring->holding = true;
+        ring->current = id;
+        ring->offset = payload - buffer;
+        ring->end = ring->offset + bytes;
+        ring->size = segment_size && segment_size < bytes ? segment_size : bytes;
+        ring->stamp = message.get_stamp();
+    } else {
+        message.set_stamp(ring->stamp);
+    }
+
+    // The buffer goes back to the kernel once its last packet is copied
+    size_t length = std::min(ring->size, ring->end - ring->offset);
+    const char* data = &ring->pool[ring->current * ring->buffer_size + ring->offset];
+    message.buffer.assign(data, data + length);
+    ring->offset += length;
+    if (ring->offset >= ring->end) {
+        ring->holding = false;
+        ring->recycle(ring->current);
+    }
+    finish_read(message, (int)length);
+#else
+    BlockSocket::operator>>(message);
+#endif
+    return *this;
+}
+
+bool UringSocket::can_submit_write()
+{
+#ifdef IORING_RECV_MULTISHOT
+    if (!ring) {
+        return false;
+    }
+    
+    // Writes that have finished may not have been posted yet.  When none
+    // have, the caller writes the block itself rather than this thread
+    // waiting on the disk with packets arriving.
+    if (ring->writes.size() >= URING_WRITES) {
+        ring->flush();
+        reap();
+    }
+    return ring->writes.size() < URING_WRITES;
+#else
+    return false;
+#endif
+}
+
+bool UringSocket::submit_write(const std::tr1::shared_ptr<FileWrite>& write)
+{
+#ifdef IORING_RECV_MULTISHOT
+    if (!can_submit_write()) {
+        return false;
+    }
+    
+    // The ring is enabled for this thread along with the receive.  A write
+    // is told apart from the receive by its nonzero ID.
+    arm();
+    io_uring_sqe entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.opcode = IORING_OP_WRITE;
+    entry.fd = write->descriptor;
+    entry.off = write->offset;
+    entry.addr = (uint64_t)(uintptr_t)write->data;
+    entry.len = write->length;
+    entry.user_data = ++ring->next_write;
+    if (!ring->submit(entry)) {
+        throw std::string("Could not submit write: ") + strerror(errno);
+    }
+    ring->writes[entry.user_data] = write;
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool UringSocket::reap()
+{
+#ifdef IORING_RECV_MULTISHOT
+    // The receive's completions are kept, so that its messages are still
+    // read in order.  It stops when the buffers run out, with a completion
+    // that carries no packet and is dropped.
+    io_uring_cqe completion;
+    while (ring->next(completion)) {
+        if (completion.user_data) {
+            ring->complete(completion);
+            continue;
+        }
+        if (!(completion.flags & IORING_CQE_F_MORE)) {
+            ring->armed = false;
+        }
+        if (completion.res >= 0 ? (completion.flags & IORING_CQE_F_BUFFER) != 0 : completion.res != -ENOBUFS) {
+            ring->received.push_back(completion);
+        }
+    }
+
+    // Once every packet that was waiting has been taken, all but the
+    // buffer being read are back with the kernel, so a receive that
+    // stopped is armed again
+    if (!ring->armed && ring->received.empty()) {
+        arm();
+    }
+    return !ring->received.empty();
+#else
+    return false;
+#endif
+}
+
+void UringSocket::close()
+{
+    ring.reset();
+    BlockSocket::close();
+}
+
+int UringSocket::get_descriptor()
+{
+#ifdef IORING_RECV_MULTISHOT
+    if (ring) {
+        arm();
+        return ring->signal;
+    }
+#endif
+    return BlockSocket::get_descriptor();
+}
+
+UringSocketFactory UringSocketFactory::Default;
+
+Transport* UringSocketFactory::create(const std::string& group, unsigned short port, Logger& logger)
+{
+    return prepare(new UringSocket(group, port, logger));
+}